@@ -57,6 +57,14 @@
 #define MEMORY_USAGE_LOG_FILE_ENVAR_DEFAULT "__MEMORY_USAGE_LOG_FILE"
 #define MEMORY_USAGE_LOG_LEVEL_ENVAR_DEFAULT "__MEMORY_USAGE_LOG_LEVEL"
 #define MEMORY_USAGE_LOG_INC_ENVAR_DEFAULT "__MEMORY_USAGE_LOG_INC"
+#define MEMORY_SEGMENT_POOL_MAX_ENVAR_DEFAULT "__MEMORY_SEGMENT_POOL_MAX"
+#define MEMORY_LARGE_FRAMES_ENVAR_DEFAULT "__MEMORY_LARGE_FRAMES"
+#define MEMORY_PROFILE_RATE_ENVAR_DEFAULT "__MEMORY_PROFILE_RATE"
+#define MEMORY_PRESSURE_FRAMES_ENVAR_DEFAULT "__MEMORY_PRESSURE_FRAMES"
+#define MEMORY_PRESSURE_LIMIT_ENVAR_DEFAULT "__MEMORY_PRESSURE_LIMIT"
+#define MEMORY_EVENT_LOG_FILE_ENVAR_DEFAULT "__MEMORY_EVENT_LOG_FILE"
+#define MEMORY_SAMPLE_FILE_ENVAR_DEFAULT "__MEMORY_SAMPLE_FILE"
+#define MEMORY_SAMPLE_INTERVAL_ENVAR_DEFAULT "__MEMORY_SAMPLE_INTERVAL"
 
 typedef enum {
   __NO_TAG_READ_DEFAULT = 0,
@@ -302,6 +310,17 @@ __Z_EXPORT unsigned long __mach_absolute_time(void);
  */
 __Z_EXPORT void *__zalloc(size_t len, size_t alignment);
 
+/**
+ * Allocate memory like __zalloc(), but without clearing it, for callers that
+ * overwrite all of it anyway. Memory that comes from 64-bit virtual storage
+ * is still zero.
+ * \param [in] len length in bytes of memory to allocate
+ * \param [in] alignment in bytes and applies only to 31-bit storage
+ * \return pointer to the beginning of newly allocated memory, or 0 if
+ *         unsuccessful
+ */
+__Z_EXPORT void *__zalloc_nozero(size_t len, size_t alignment);
+
 /**
  * Allocate memory in 64-bit virtual storage when size is a megabyte multiple
  * or above 2GB, or in 31-bit storage (with PAGE_SIZE bytes alignment)
@@ -328,6 +347,20 @@ __Z_EXPORT void *anon_mmap(void *_, size_t len);
 __Z_EXPORT void *__zalloc_for_fd(size_t len, const char *filename, int fd,
                                  off_t offset);
 
+/**
+ * Allocate memory like __zalloc_for_fd(), and account for it under a tag;
+ * see __zalloc_tagged().
+ * \param [in] len length in bytes of memory to allocate
+ * \param [in] filename filename to read
+ * \param [in] fd file descriptor
+ * \param [in] offset offset in bytes into the file to read
+ * \param [in] tag category of the memory, from 1 to ZALLOC_MAX_TAGS-1, or 0
+ * \return pointer to the beginning of newly allocated memory, or 0 if
+ *         unsuccessful
+ */
+__Z_EXPORT void *__zalloc_for_fd_tagged(size_t len, const char *filename,
+                                        int fd, off_t offset, int tag);
+
 /**
  * Allocate memory (using __zalloc()) and read into it contents of given file
  * at the given offset.
@@ -364,6 +397,335 @@ __Z_EXPORT int __zfree(void *addr, int len);
  */
 __Z_EXPORT int anon_munmap(void *addr, size_t len);
 
+#define ZALLOC_STATS_SIZE_CLASSES 28
+
+/**
+ * Snapshot of the counters of the memory allocated by __zalloc() and related
+ * functions; see __zalloc_stats().
+ */
+struct zalloc_stats {
+  /** bytes currently allocated below the bar */
+  size_t current31;
+  /** peak of current31 */
+  size_t max31;
+  /** bytes currently allocated above the bar, including committed storage */
+  size_t current64;
+  /** peak of current64 */
+  size_t max64;
+  /** successful __zalloc() calls that returned memory below the bar */
+  size_t allocs31;
+  /** successful __zfree() calls for memory below the bar */
+  size_t frees31;
+  /** successful __zalloc() calls that returned memory above the bar */
+  size_t allocs64;
+  /** successful __zfree() calls for memory above the bar */
+  size_t frees64;
+  /** blocks currently allocated below the bar */
+  size_t live31;
+  /** blocks currently allocated above the bar */
+  size_t live64;
+  /** requests that fell through to 64-bit storage because __malloc31 failed */
+  size_t fallbacks64;
+  /** __zalloc() calls that returned 0 */
+  size_t failures;
+  /** released segments that were reused from the segment pool */
+  size_t segpool_hits;
+  /** segment allocations that found no segment of their size in the pool */
+  size_t segpool_misses;
+  /**
+   * successful __zalloc() calls by requested size: entry i counts sizes of
+   * more than 8<<i (except for i=0) and at most 16<<i bytes, and the last
+   * entry also counts all larger sizes
+   */
+  size_t size_classes[ZALLOC_STATS_SIZE_CLASSES];
+  /** arenas created by __zarena_create() and not yet destroyed */
+  size_t arenas;
+  /** bytes of the chunks held by those arenas */
+  size_t arena_bytes;
+  /** blocks allocated from those arenas since they were last reset */
+  size_t arena_allocs;
+  /**
+   * small allocations served from the cache of the calling thread; a
+   * thread's counts are added in each time its cache is refilled or drained
+   */
+  size_t tcache_hits;
+  /** small allocations that found the cache of the calling thread empty */
+  size_t tcache_misses;
+  /**
+   * segments currently allocated above the bar, including those that hold
+   * smaller blocks
+   */
+  size_t segments;
+};
+
+/**
+ * Get a snapshot of the counters of memory allocated by __zalloc(). It takes
+ * no lock, so it can be called often, e.g. from a monitoring thread; the
+ * counters are read one at a time and may be slightly out of step with each
+ * other while other threads allocate.
+ * \param [out] stats structure to fill in
+ * \return returns 0 if successful, -1 if stats is NULL
+ */
+__Z_EXPORT int __zalloc_stats(struct zalloc_stats *stats);
+
+/**
+ * Write a profile of the live memory allocated by __zalloc(), sampled as set
+ * by the __MEMORY_PROFILE_RATE envar, in folded-stack format: one line per
+ * call stack, with its entry names from the outermost caller down to the
+ * caller of __zalloc() separated by ';', followed by a space and the
+ * estimated number of bytes allocated from that stack and still live.
+ * \param [in] fd file descriptor to write to
+ * \return returns 0 if successful, -1 if unsuccessful
+ */
+__Z_EXPORT int __zalloc_heap_profile(int fd);
+
+/**
+ * State passed to the callbacks registered with __zalloc_pressure_register().
+ */
+struct zalloc_pressure {
+  /** 1 if the process has come under memory pressure, 0 if it's relieved */
+  int under_pressure;
+  /** frames available to the system, as returned by __get_num_frames() */
+  int available_frames;
+  /** bytes currently allocated below the bar */
+  size_t current31;
+  /** bytes currently allocated above the bar */
+  size_t current64;
+};
+
+typedef void (*zalloc_pressure_callback_t)(const struct zalloc_pressure *info,
+                                           void *arg);
+
+/**
+ * Register a callback to be called by the memory-pressure monitor, from its
+ * own thread, when the process comes under memory pressure and when it's
+ * relieved. The monitor runs while the __MEMORY_PRESSURE_FRAMES or
+ * __MEMORY_PRESSURE_LIMIT envar is set, and trims the allocator's caches
+ * while there's pressure; callbacks should release what memory they can.
+ * \param [in] callback function to call
+ * \param [in] arg argument to pass to the callback
+ * \return 0 if successful, or -1 with errno set (ENOMEM if too many
+ *         callbacks are registered).
+ */
+__Z_EXPORT int __zalloc_pressure_register(zalloc_pressure_callback_t callback,
+                                          void *arg);
+
+/**
+ * Unregister a callback registered with __zalloc_pressure_register().
+ * \param [in] callback function passed to __zalloc_pressure_register()
+ * \param [in] arg argument passed to __zalloc_pressure_register()
+ * \return 0 if successful, or -1 with errno set to ENOENT if the callback
+ *         isn't registered.
+ */
+__Z_EXPORT int
+__zalloc_pressure_unregister(zalloc_pressure_callback_t callback, void *arg);
+
+#define ZALLOC_MAX_TAGS 16
+#define ZALLOC_TAG_NAME_MAX 16
+
+/** Flag for __zalloc_tag_config(): fail allocations over the soft limit */
+#define ZALLOC_TAG_FAIL_OVER_LIMIT 1
+
+/**
+ * Counters of the memory allocated under a tag; see __zalloc_tag_stats().
+ */
+struct zalloc_tag_stats {
+  /** name given by __zalloc_tag_config(), or an empty string */
+  char name[ZALLOC_TAG_NAME_MAX];
+  /** bytes currently allocated under the tag, as requested */
+  size_t current;
+  /** peak of current */
+  size_t max;
+  /** successful allocations under the tag */
+  size_t allocs;
+  /** allocations that failed because they would exceed the soft limit */
+  size_t denied;
+  /** soft limit in bytes, or 0 if there's none */
+  size_t limit;
+};
+
+/**
+ * Allocate memory like __zalloc(), and account for it under a tag, so the
+ * memory used by parts of an application (e.g. JIT code or I/O buffers) can
+ * be told apart. The memory is released with __zfree() as usual. If the tag
+ * has a soft limit and the allocation would exceed it, a warning is logged,
+ * or the allocation fails with errno set to ENOMEM if the tag was configured
+ * with ZALLOC_TAG_FAIL_OVER_LIMIT.
+ * \param [in] len length in bytes of memory to allocate
+ * \param [in] alignment in bytes and applies only to 31-bit storage
+ * \param [in] tag category of the memory, from 1 to ZALLOC_MAX_TAGS-1, or 0
+ *             for untagged memory
+ * \return pointer to the beginning of newly allocated memory, or 0 if
+ *         unsuccessful
+ */
+__Z_EXPORT void *__zalloc_tagged(size_t len, size_t alignment, int tag);
+
+/**
+ * Name a tag and set its soft limit.
+ * \param [in] tag from 1 to ZALLOC_MAX_TAGS-1
+ * \param [in] name shown in the memory log, or 0 to keep the current name;
+ *             truncated to ZALLOC_TAG_NAME_MAX-1 characters
+ * \param [in] soft_limit bytes the tag may hold before allocations under it
+ *             are reported, or 0 for no limit
+ * \param [in] flags 0 or ZALLOC_TAG_FAIL_OVER_LIMIT
+ * \return 0 if successful, or -1 with errno set to EINVAL if tag is out of
+ *         range.
+ */
+__Z_EXPORT int __zalloc_tag_config(int tag, const char *name,
+                                   size_t soft_limit, int flags);
+
+/**
+ * Get the counters of the memory allocated under a tag.
+ * \param [in] tag from 1 to ZALLOC_MAX_TAGS-1
+ * \param [out] stats structure to fill in
+ * \return 0 if successful, or -1 with errno set to EINVAL if tag is out of
+ *         range or stats is NULL.
+ */
+__Z_EXPORT int __zalloc_tag_stats(int tag, struct zalloc_tag_stats *stats);
+
+/** Storage watched by a watermark: below the bar */
+#define ZALLOC_WATERMARK_31 0
+/** Storage watched by a watermark: above the bar */
+#define ZALLOC_WATERMARK_64 1
+
+/**
+ * State passed to the callbacks registered with
+ * __zalloc_watermark_register().
+ */
+struct zalloc_watermark {
+  /** ZALLOC_WATERMARK_31 or ZALLOC_WATERMARK_64 */
+  int area;
+  /** the level that was crossed, or 0 for a growth-rate watermark */
+  size_t bytes;
+  /** the growth rate that was exceeded, or 0 for a level */
+  size_t growth_rate;
+  /** bytes allocated in the area when the watermark was crossed */
+  size_t current;
+};
+
+typedef void (*zalloc_watermark_callback_t)(
+    const struct zalloc_watermark *info, void *arg);
+
+/**
+ * Register a callback to be called when the memory allocated by __zalloc()
+ * in an area crosses a level, or grows faster than a rate, e.g. to start a
+ * garbage collection early. A level is reported when usage rises to it, and
+ * again only once usage has fallen an eighth of it below. A growth rate is
+ * reported when usage grows by growth_rate bytes in less than a second. The
+ * callback runs on the thread whose allocation or release crossed the
+ * watermark, with no allocator lock held.
+ * \param [in] area ZALLOC_WATERMARK_31 or ZALLOC_WATERMARK_64
+ * \param [in] bytes level to watch, or 0
+ * \param [in] growth_rate bytes per second to watch, or 0; exactly one of
+ *             bytes and growth_rate must be set
+ * \param [in] callback function to call
+ * \param [in] arg argument to pass to the callback
+ * \return 0 if successful, or -1 with errno set (EINVAL if the arguments
+ *         aren't valid, ENOMEM if too many watermarks are registered).
+ */
+__Z_EXPORT int __zalloc_watermark_register(int area, size_t bytes,
+                                           size_t growth_rate,
+                                           zalloc_watermark_callback_t callback,
+                                           void *arg);
+
+/**
+ * Unregister all the watermarks registered with a callback and argument.
+ * \param [in] callback function passed to __zalloc_watermark_register()
+ * \param [in] arg argument passed to __zalloc_watermark_register()
+ * \return 0 if successful, or -1 with errno set to ENOENT if no watermark
+ *         was registered with them.
+ */
+__Z_EXPORT int
+__zalloc_watermark_unregister(zalloc_watermark_callback_t callback, void *arg);
+
+/**
+ * Find the block allocated by __zalloc() (or the range reserved by
+ * __zreserve()) that contains an address.
+ * \param [in] ptr address anywhere in the block
+ * \param [out] base if not 0, set to the start of the block
+ * \param [out] len if not 0, set to the length of the block, which for small
+ *             blocks may be more than the length requested
+ * \return 0 if successful, or -1 with errno set to ENOENT if ptr isn't in a
+ *         block.
+ */
+__Z_EXPORT int __zalloc_find(const void *ptr, void **base, size_t *len);
+
+/**
+ * Arena from which blocks are allocated one after the other, and released
+ * all together; see __zarena_create().
+ */
+typedef struct __zarena __zarena_t;
+
+/**
+ * Create an arena, which gets its storage from __zalloc() in chunks. An arena
+ * isn't thread-safe; use one per thread, or serialize the calls.
+ * \param [in] chunk_size size in bytes of the chunks, or 0 for 1MB; chunks
+ *             that are a megabyte multiple are 64-bit segments, and others
+ *             are allocated in 31-bit storage
+ * \return pointer to the arena, or 0 if unsuccessful
+ */
+__Z_EXPORT __zarena_t *__zarena_create(size_t chunk_size);
+
+/**
+ * Allocate a block from an arena; it's released by __zarena_reset() or
+ * __zarena_destroy(), and can't be released by itself.
+ * \param [in] arena arena returned by __zarena_create()
+ * \param [in] len length in bytes of the block, which is zeroed
+ * \param [in] alignment in bytes
+ * \return pointer to the block, or 0 if unsuccessful
+ */
+__Z_EXPORT void *__zarena_alloc(__zarena_t *arena, size_t len,
+                                size_t alignment);
+
+/**
+ * Release all blocks allocated from an arena, keeping its first chunk for
+ * the blocks allocated next.
+ * \param [in] arena arena returned by __zarena_create()
+ */
+__Z_EXPORT void __zarena_reset(__zarena_t *arena);
+
+/**
+ * Release all blocks allocated from an arena, and the arena itself.
+ * \param [in] arena arena returned by __zarena_create()
+ */
+__Z_EXPORT void __zarena_destroy(__zarena_t *arena);
+
+/**
+ * Reserve a range of 64-bit virtual storage without backing it; the range
+ * can't be referenced until parts of it are committed with __zcommit().
+ * \param [in] len length in bytes of the range, rounded up to a megabyte
+ * \return pointer to the beginning of the range (megabyte-aligned), or 0 if
+ *         unsuccessful, with errno set
+ */
+__Z_EXPORT void *__zreserve(size_t len);
+
+/**
+ * Make part of a range reserved by __zreserve() usable; it reads as zeros.
+ * Storage is committed in whole megabytes, so the segments that overlap
+ * [addr, addr+len) are committed.
+ * \param [in] addr start address of memory to commit
+ * \param [in] len length in bytes
+ * \return returns 0 if successful, -1 if unsuccessful, with errno set
+ */
+__Z_EXPORT int __zcommit(void *addr, size_t len);
+
+/**
+ * Give the storage of part of a range reserved by __zreserve() back to the
+ * system while keeping the range reserved. Only the whole megabytes within
+ * [addr, addr+len) are decommitted.
+ * \param [in] addr start address of memory to decommit
+ * \param [in] len length in bytes
+ * \return returns 0 if successful, -1 if unsuccessful, with errno set
+ */
+__Z_EXPORT int __zdecommit(void *addr, size_t len);
+
+/**
+ * Release a whole range reserved by __zreserve(), committed or not.
+ * \param [in] addr start address returned by __zreserve()
+ * \return returns 0 if successful, -1 if unsuccessful, with errno set
+ */
+__Z_EXPORT int __zrelease(void *addr);
+
 /**
  * Check if an LE function is present in the LE vector table
  * \param [in] addr address to LE function
@@ -491,6 +853,51 @@ typedef struct __Z_EXPORT zoslib_config {
    * allocated, in bytes, after which logging occurs.
    */
   const char *MEMORY_USAGE_LOG_INC_ENVAR = MEMORY_USAGE_LOG_INC_ENVAR_DEFAULT;
+  /**
+   * String to indicate the envar to be used to specify the maximum size, in
+   * megabytes, of released 64-bit segments that are kept for reuse.
+   */
+  const char *MEMORY_SEGMENT_POOL_MAX_ENVAR =
+              MEMORY_SEGMENT_POOL_MAX_ENVAR_DEFAULT;
+  /**
+   * String to indicate the envar to be used to request that 64-bit segments
+   * be backed by fixed large frames (1M or 2G).
+   */
+  const char *MEMORY_LARGE_FRAMES_ENVAR = MEMORY_LARGE_FRAMES_ENVAR_DEFAULT;
+  /**
+   * String to indicate the envar to be used to specify the average number of
+   * bytes allocated between call stacks recorded by the heap profiler.
+   */
+  const char *MEMORY_PROFILE_RATE_ENVAR = MEMORY_PROFILE_RATE_ENVAR_DEFAULT;
+  /**
+   * String to indicate the envar to be used to specify the number of available
+   * system frames below which the process is under memory pressure.
+   */
+  const char *MEMORY_PRESSURE_FRAMES_ENVAR =
+              MEMORY_PRESSURE_FRAMES_ENVAR_DEFAULT;
+  /**
+   * String to indicate the envar to be used to specify the megabytes allocated
+   * by __zalloc above which the process is under memory pressure.
+   */
+  const char *MEMORY_PRESSURE_LIMIT_ENVAR =
+              MEMORY_PRESSURE_LIMIT_ENVAR_DEFAULT;
+  /**
+   * String to indicate the envar to be used to specify the file to which
+   * memory events are logged in binary, for zoslib-memlog.
+   */
+  const char *MEMORY_EVENT_LOG_FILE_ENVAR =
+              MEMORY_EVENT_LOG_FILE_ENVAR_DEFAULT;
+  /**
+   * String to indicate the envar to be used to specify the CSV file to which
+   * samples of the memory usage are appended periodically.
+   */
+  const char *MEMORY_SAMPLE_FILE_ENVAR = MEMORY_SAMPLE_FILE_ENVAR_DEFAULT;
+  /**
+   * String to indicate the envar to be used to specify the milliseconds
+   * between the samples of the memory usage.
+   */
+  const char *MEMORY_SAMPLE_INTERVAL_ENVAR =
+              MEMORY_SAMPLE_INTERVAL_ENVAR_DEFAULT;
 
 } zoslib_config_t;
 
@@ -538,6 +945,51 @@ typedef struct __Z_EXPORT zoslib_config {
    * to display when memory is allocated or freed.
    */
   const char *MEMORY_USAGE_LOG_LEVEL_ENVAR;
+  /**
+   * String to indicate the envar to be used to specify the increase in memory
+   * allocated, in bytes, after which logging occurs.
+   */
+  const char *MEMORY_USAGE_LOG_INC_ENVAR;
+  /**
+   * String to indicate the envar to be used to specify the maximum size, in
+   * megabytes, of released 64-bit segments that are kept for reuse.
+   */
+  const char *MEMORY_SEGMENT_POOL_MAX_ENVAR;
+  /**
+   * String to indicate the envar to be used to request that 64-bit segments
+   * be backed by fixed large frames (1M or 2G).
+   */
+  const char *MEMORY_LARGE_FRAMES_ENVAR;
+  /**
+   * String to indicate the envar to be used to specify the average number of
+   * bytes allocated between call stacks recorded by the heap profiler.
+   */
+  const char *MEMORY_PROFILE_RATE_ENVAR;
+  /**
+   * String to indicate the envar to be used to specify the number of available
+   * system frames below which the process is under memory pressure.
+   */
+  const char *MEMORY_PRESSURE_FRAMES_ENVAR;
+  /**
+   * String to indicate the envar to be used to specify the megabytes allocated
+   * by __zalloc above which the process is under memory pressure.
+   */
+  const char *MEMORY_PRESSURE_LIMIT_ENVAR;
+  /**
+   * String to indicate the envar to be used to specify the file to which
+   * memory events are logged in binary, for zoslib-memlog.
+   */
+  const char *MEMORY_EVENT_LOG_FILE_ENVAR;
+  /**
+   * String to indicate the envar to be used to specify the CSV file to which
+   * samples of the memory usage are appended periodically.
+   */
+  const char *MEMORY_SAMPLE_FILE_ENVAR;
+  /**
+   * String to indicate the envar to be used to specify the milliseconds
+   * between the samples of the memory usage.
+   */
+  const char *MEMORY_SAMPLE_INTERVAL_ENVAR;
 } zoslib_config_t;
 
 /**
@@ -590,12 +1042,14 @@ __Z_EXPORT char* __getprogramdir();
  * \param [in] alignment - must be a power of two and a multiple of
  *  sizeof(void*)
  * \param [in] size - number of bytes to allocate
- * \return pointer to the beginning of newly allocated memory
+ * \return pointer to the beginning of newly allocated memory, which must be
+ *  released with __aligned_free()
  */
 __Z_EXPORT void *__aligned_malloc(size_t size, size_t alignment);
 
 /**
- * \param [in] ptr - pointer to the memory to deallocate
+ * Release storage allocated by __aligned_malloc()
+ * \param [in] ptr - pointer to the memory to deallocate, or NULL
  */
 __Z_EXPORT void __aligned_free(void *ptr);
 
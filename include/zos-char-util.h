@@ -13,6 +13,7 @@
 #define ZOS_CHAR_UTIL_H_
 
 #include "zos-base.h"
+#include "zos-convert.h"
 
 #include <_Nascii.h>
 #include <sys/types.h>
@@ -39,6 +40,22 @@ __Z_EXPORT void *_convert_e2a(void *dst, const void *src, size_t size);
  */
 __Z_EXPORT void *_convert_a2e(void *dst, const void *src, size_t size);
 
+/**
+ * Convert between two built-in code pages: ISO8859-1 (819) and the EBCDIC
+ * code pages 037, 273, 285, 500, 1047 and 1140. The conversion is done with
+ * the tables in __ccsid_table, without iconv.
+ * \param [out] dst Destination buffer (must be pre-allocated); it may be
+ *  src, but must not otherwise overlap it.
+ * \param [in] src Source buffer.
+ * \param [in] len Number of bytes to convert.
+ * \param [in] from CCSID of src.
+ * \param [in] to CCSID to convert to.
+ * \return returns dst, or NULL with errno set to EINVAL if either CCSID
+ *  isn't built in.
+ */
+__Z_EXPORT void *__convert_ccsid(void *dst, const void *src, size_t len,
+                                 int from, int to);
+
 /**
  * Guess if string is UTF8 (ASCII) or EBCDIC based
  * on the first CCSID_GUESS_BUF_SIZE_ENVAR of the file
@@ -61,6 +78,64 @@ __Z_EXPORT int __guess_fd_ue(int fd, char *errmsg, size_t er_size,
 __Z_EXPORT int __guess_ue(const void *src, size_t size, char *errmsg,
                           size_t er_size);
 
+#define CCSID_GUESS_MSG_SIZE 256
+
+/**
+ * State of a CCSID guess made over data that arrives in chunks, such as from
+ * a pipe or socket; see __ccsid_guess_begin().
+ */
+struct __ccsid_guess {
+  /** number of bytes fed, up to the first NUL */
+  unsigned long long offset;
+  /** number of lines fed, from 1, while the data can still be UTF-8 */
+  int line;
+  /** 1 while the data fed can still be UTF-8 */
+  int utf8;
+  /** 1 while all the data fed is valid EBCDIC */
+  int ebcdic;
+  /** 1 once a NUL has been fed; nothing after it is looked at */
+  int ended;
+  /** number of bytes in partial */
+  int npartial;
+  /** UTF-8 sequence cut off at the end of the data fed so far */
+  unsigned char partial[4];
+  /** why the data can't be UTF-8, once utf8 is 0 */
+  char utf8msg[CCSID_GUESS_MSG_SIZE];
+};
+
+/**
+ * Starts a guess of whether data is UTF8 (ASCII) or EBCDIC that's made
+ * incrementally, as the data is passed to __ccsid_guess_feed() in chunks of
+ * any size. Unlike __guess_fd_ue(), it needs no seek or second read, and
+ * there's no limit on how much data it looks at.
+ * \param [out] guess - state of the guess.
+ */
+__Z_EXPORT void __ccsid_guess_begin(struct __ccsid_guess *guess);
+
+/**
+ * Adds the next chunk of data to a guess. A UTF-8 sequence may be split
+ * between chunks.
+ * \param [in,out] guess - state of the guess.
+ * \param [in] src - next chunk of data.
+ * \param [in] size - number of bytes in src.
+ * \return the CCSID that __ccsid_guess_end() will return if the data seen
+ *  so far already decides it, in which case more data needn't be fed;
+ *  otherwise 0.
+ */
+__Z_EXPORT int __ccsid_guess_feed(struct __ccsid_guess *guess, const void *src,
+                                  size_t size);
+
+/**
+ * Finishes a guess, once all the data has been fed.
+ * \param [in,out] guess - state of the guess.
+ * \param [out] errmsg - if not NULL, details for 65535.
+ * \param [in] er_size - size of errmsg.
+ * \return guessed CCSID, as __guess_ue() for all the data fed (819 for UTF8,
+ *  1047 for EBCDIC; otherwise 65535 for BINARY).
+ */
+__Z_EXPORT int __ccsid_guess_end(struct __ccsid_guess *guess, char *errmsg,
+                                 size_t er_size);
+
 /**
  * Guess if string is ASCII or EBCDIC.
  * \param [in] src - character string.
@@ -200,9 +275,33 @@ public:
 
 #endif // ifdef __cplusplus
 
+/**
+ * Finds the length of the longest prefix of a string that's valid ASCII or
+ * valid EBCDIC, up to the first NUL, and which of the two it is. Both are
+ * worked out in a single pass.
+ * \param [in] str - character string.
+ * \param [out] code_page - 819 or 1047; if both prefixes are the same length,
+ *  the code page last found on this thread.
+ * \param [in] max_len - maximum number of bytes to analyze.
+ * \param [out] ambiguous - set to 1 if both prefixes are the same length, or
+ *  to 0.
+ * \return length of the longer prefix.
+ */
 __Z_EXPORT unsigned strlen_ae(const unsigned char *str, int *code_page,
                               unsigned long max_len, int *ambiguous);
 
+/**
+ * Decides whether a string is ASCII or EBCDIC like strlen_ae(), but stops
+ * at the first byte that's valid in only one of them instead of going on to
+ * find the length; use it when only the code page is needed.
+ * \param [in] str - character string.
+ * \param [in] max_len - maximum number of bytes to analyze.
+ * \param [out] ambiguous - if not NULL, set as by strlen_ae().
+ * \return 819 or 1047, as the code_page of strlen_ae().
+ */
+__Z_EXPORT int __classify_ae(const unsigned char *str, unsigned long max_len,
+                             int *ambiguous);
+
 inline unsigned strlen_e(const unsigned char *str, unsigned size) {
   static const unsigned char _tab_e[256] __attribute__((aligned(8))) = {
       1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 0, 0, 1,
@@ -281,5 +380,112 @@ const unsigned char __iso88591_ibm1047[256] __attribute__((aligned(8))) = {
 
 #ifdef __cplusplus
 }
-#endif
+
+/**
+ * An EBCDIC byte that a code page maps to a different ISO8859-1 character
+ * than IBM-1047 does.
+ */
+struct __ccsid_delta {
+  unsigned char ebcdic;
+  unsigned char iso88591;
+};
+
+/**
+ * Translation tables between an EBCDIC code page and ISO8859-1.
+ */
+struct alignas(8) __ccsid_tables {
+  unsigned char e2a[256];
+  unsigned char a2e[256];
+};
+
+/**
+ * Builds the tables of a code page from __ibm1047_iso88591 and the bytes
+ * the code page maps differently; a2e is the inverse of e2a.
+ */
+template <size_t N>
+constexpr __ccsid_tables __make_ccsid_tables(const __ccsid_delta (&deltas)[N]) {
+  __ccsid_tables tables{};
+  for (int i = 0; i < 256; ++i)
+    tables.e2a[i] = __ibm1047_iso88591[i];
+  for (size_t i = 0; i < N; ++i)
+    tables.e2a[deltas[i].ebcdic] = deltas[i].iso88591;
+  for (int i = 0; i < 256; ++i)
+    tables.a2e[tables.e2a[i]] = (unsigned char)i;
+  return tables;
+}
+
+/**
+ * Checks that the tables convert every byte there and back, i.e. that no
+ * two EBCDIC bytes map to the same ISO8859-1 character.
+ */
+constexpr bool __ccsid_tables_round_trip(const __ccsid_tables &tables) {
+  for (int i = 0; i < 256; ++i)
+    if (tables.a2e[tables.e2a[i]] != i)
+      return false;
+  return true;
+}
+
+// Each byte maps to the character the IBM CDRA tables give it (as do, for
+// instance, the IBM037, IBM273, IBM285, IBM500 and IBM1140 converters of
+// iconv), except for these choices, which are the only ones to check:
+// - All of them, like __ibm1047_iso88591, map NL (0x15) to LF (0x0A) and
+//   LF (0x25) to NEL (0x85), the other way round from CDRA, as z/OS UNIX
+//   does.
+// - IBM-285: 0xA1 is the overline (U+203E), outside ISO8859-1; it maps to
+//   the macron (0xAF), which 285 doesn't have.
+// - IBM-1140: 0x9F is the euro sign (U+20AC), outside ISO8859-1; it maps to
+//   the currency sign (0xA4), which it replaced in IBM-037.
+// IBM-037, IBM-273 and IBM-500 have nothing else. In particular, 273 has no
+// overline: 0xA1 is the sharp s, and the macron is at 0xBC as in CDRA.
+constexpr __ccsid_delta __ibm037_deltas[] = {
+    {0x5f, 0xac}, {0xad, 0xdd}, {0xb0, 0x5e},
+    {0xba, 0x5b}, {0xbb, 0x5d}, {0xbd, 0xa8},
+};
+
+constexpr __ccsid_delta __ibm273_deltas[] = {
+    {0x43, 0x7b}, {0x4a, 0xc4}, {0x4f, 0x21}, {0x59, 0x7e}, {0x5a, 0xdc},
+    {0x63, 0x5b}, {0x6a, 0xf6}, {0x7c, 0xa7}, {0xa1, 0xdf}, {0xad, 0xdd},
+    {0xb0, 0xa2}, {0xb5, 0x40}, {0xba, 0xac}, {0xbb, 0x7c}, {0xbd, 0xa8},
+    {0xc0, 0xe4}, {0xcc, 0xa6}, {0xd0, 0xfc}, {0xdc, 0x7d}, {0xe0, 0xd6},
+    {0xec, 0x5c}, {0xfc, 0x5d},
+};
+
+constexpr __ccsid_delta __ibm285_deltas[] = {
+    {0x4a, 0x24}, {0x5b, 0xa3}, {0x5f, 0xac}, {0xa1, 0xaf},
+    {0xad, 0xdd}, {0xb0, 0xa2}, {0xb1, 0x5b}, {0xba, 0x5e},
+    {0xbb, 0x5d}, {0xbc, 0x7e}, {0xbd, 0xa8},
+};
+
+constexpr __ccsid_delta __ibm500_deltas[] = {
+    {0x4a, 0x5b}, {0x4f, 0x21}, {0x5a, 0x5d}, {0xad, 0xdd},
+    {0xb0, 0xa2}, {0xba, 0xac}, {0xbb, 0x7c}, {0xbd, 0xa8},
+};
+
+constexpr __ccsid_delta __ibm1140_deltas[] = {
+    {0x5f, 0xac}, {0x9f, 0xa4}, {0xad, 0xdd}, {0xb0, 0x5e},
+    {0xba, 0x5b}, {0xbb, 0x5d}, {0xbd, 0xa8},
+};
+
+/**
+ * The built-in tables of an EBCDIC CCSID, generated at compile time; IBM-1047
+ * uses __ibm1047_iso88591 and __iso88591_ibm1047 instead.
+ */
+template <int CCSID> struct __ccsid_table;
+
+#define __ZL_CCSID_TABLE(_ccsid, _deltas)                                      \
+  template <> struct __Z_EXPORT __ccsid_table<_ccsid> {                        \
+    static constexpr __ccsid_tables tables = __make_ccsid_tables(_deltas);     \
+    static_assert(__ccsid_tables_round_trip(tables),                           \
+                  "IBM-" #_ccsid " doesn't convert to ISO8859-1 and back");    \
+  }
+
+__ZL_CCSID_TABLE(37, __ibm037_deltas);
+__ZL_CCSID_TABLE(273, __ibm273_deltas);
+__ZL_CCSID_TABLE(285, __ibm285_deltas);
+__ZL_CCSID_TABLE(500, __ibm500_deltas);
+__ZL_CCSID_TABLE(1140, __ibm1140_deltas);
+
+#undef __ZL_CCSID_TABLE
+
+#endif // ifdef __cplusplus
 #endif // ZOS_CHAR_UTIL_H_
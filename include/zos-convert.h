@@ -0,0 +1,126 @@
+///////////////////////////////////////////////////////////////////////////////
+// Licensed Materials - Property of IBM
+// ZOSLIB
+// (C) Copyright IBM Corp. 2020. All Rights Reserved.
+// US Government Users Restricted Rights - Use, duplication
+// or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+///////////////////////////////////////////////////////////////////////////////
+
+// Kernels that translate a buffer through a 256-byte table, such as
+// __ibm1047_iso88591 and __iso88591_ibm1047, and that validate UTF-8, with
+// vector registers. They use no z/OS-specific definitions, so they can be
+// built and benchmarked on any host.
+
+#ifndef ZOS_CONVERT_H_
+#define ZOS_CONVERT_H_
+
+#include "zos-macros.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Translates size bytes from src into dst through table; dst and src may be
+ * the same buffer but must not otherwise overlap.
+ * \return dst
+ */
+typedef void *(*__convert_kernel_fn)(const unsigned char *table, void *dst,
+                                     size_t size, const void *src);
+
+/**
+ * An entry in the kernel dispatch table.
+ */
+struct __convert_kernel {
+  /** name of the kernel, e.g. "zvector", "troo" or "scalar" */
+  const char *name;
+  /** the kernel */
+  __convert_kernel_fn convert;
+};
+
+/**
+ * Returns the kernels that can run on this machine; the last one is always
+ * the scalar kernel.
+ * \param [out] count - number of kernels returned.
+ * \return array of count kernels.
+ */
+__Z_EXPORT const struct __convert_kernel *__convert_kernels(size_t *count);
+
+/**
+ * Returns the kernel used by __convert_table(). It's selected once, on the
+ * first call, by timing each kernel over a small buffer.
+ */
+__Z_EXPORT const struct __convert_kernel *__convert_kernel_selected(void);
+
+/**
+ * Translates size bytes from src into dst through the 256-byte table with
+ * the selected kernel; dst and src may be the same buffer.
+ * \param [in] table - translation table.
+ * \param [out] dst - destination buffer.
+ * \param [in] size - number of bytes to translate.
+ * \param [in] src - source buffer.
+ * \return dst
+ */
+__Z_EXPORT void *__convert_table(const unsigned char *table, void *dst,
+                                 size_t size, const void *src);
+
+/**
+ * Checks that size bytes from str are well-formed UTF-8.
+ * \return 1 if they are, or 0.
+ */
+typedef int (*__utf8_kernel_fn)(const unsigned char *str, size_t size);
+
+/**
+ * An entry in the UTF-8 validation kernel table.
+ */
+struct __utf8_kernel {
+  /** name of the kernel, e.g. "zvector" or "scalar" */
+  const char *name;
+  /** the kernel */
+  __utf8_kernel_fn validate;
+};
+
+/**
+ * Returns the UTF-8 validation kernels that can run on this machine, fastest
+ * first; the last one is the byte-at-a-time scanner that __utf8_validate()
+ * reports errors with.
+ * \param [out] count - number of kernels returned.
+ * \return array of count kernels.
+ */
+__Z_EXPORT const struct __utf8_kernel *__utf8_kernels(size_t *count);
+
+/**
+ * Checks that a buffer holds well-formed UTF-8 up to its first NUL, or all
+ * of it if there's no NUL. UTF-16 surrogates encoded in 3 bytes are
+ * accepted. The fastest kernel does the check; only if it fails is the
+ * buffer scanned again a byte at a time to describe the error.
+ * \param [in] src - buffer to check.
+ * \param [in] size - number of bytes in src.
+ * \param [out] errmsg - if not NULL, the offset, line and cause of the
+ *  first error.
+ * \param [in] errmsg_size - size of errmsg.
+ * \return 0 if it's well-formed, or -1.
+ */
+__Z_EXPORT int __utf8_validate(const void *src, size_t size, char *errmsg,
+                               size_t errmsg_size);
+
+/**
+ * Like __utf8_validate(), for a buffer that's part of a larger text.
+ * \param [in] src - buffer to check.
+ * \param [in] size - number of bytes in src.
+ * \param [in] offset - offset of src in the text.
+ * \param [in] line - line of the text that src starts on, from 1.
+ * \param [out] errmsg - if not NULL, the offset and line in the text and the
+ *  cause of the first error.
+ * \param [in] errmsg_size - size of errmsg.
+ * \return 0 if it's well-formed, or -1.
+ */
+__Z_EXPORT int __utf8_validate_at(const void *src, size_t size, size_t offset,
+                                  int line, char *errmsg, size_t errmsg_size);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // ZOS_CONVERT_H_
@@ -190,6 +190,39 @@ __Z_EXPORT int __getLogMemoryFileNo();
  */
 __Z_EXPORT void __memprintf(const char *format, ...);
 
+/**
+ * Writes out the messages logged by __memprintf() that are still buffered.
+ * Messages are formatted by the calling thread and written to the log file by
+ * a background thread; this is done when the process terminates.
+ */
+__Z_EXPORT void __memprintf_flush();
+
+/**
+ * Returns true if memory events are being logged to the binary event log
+ * specified in the environment variable
+ * zoslib_config_t.MEMORY_EVENT_LOG_FILE_ENVAR.
+ */
+__Z_EXPORT bool __doLogMemoryEvents();
+
+/**
+ * Logs a memory event to the binary event log, whose format is described in
+ * zos-memlog.h. Like the messages of __memprintf(), events are buffered and
+ * written by a background thread.
+ * \param [in] op zoslib_memlog_op_t value
+ * \param [in] addr address of the block
+ * \param [in] size size of the block
+ * \param [in] stack stack ID defined by __memlog_stack(), or 0
+ */
+__Z_EXPORT void __memlog_event(int op, const void *addr, size_t size,
+                               unsigned int stack);
+
+/**
+ * Defines a stack ID for the events logged by __memlog_event().
+ * \param [in] id stack ID, other than 0
+ * \param [in] stack call stack, in folded-stack format
+ */
+__Z_EXPORT void __memlog_stack(unsigned int id, const char *stack);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,93 @@
+///////////////////////////////////////////////////////////////////////////////
+// Licensed Materials - Property of IBM
+// ZOSLIB
+// (C) Copyright IBM Corp. 2020. All Rights Reserved.
+// US Government Users Restricted Rights - Use, duplication
+// or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+///////////////////////////////////////////////////////////////////////////////
+
+// Format of the binary memory-event log written while the
+// __MEMORY_EVENT_LOG_FILE envar is set, and read by zoslib-memlog. It uses no
+// z/OS-specific definitions, so the log can be analyzed on any host.
+
+#ifndef ZOS_MEMLOG_H_
+#define ZOS_MEMLOG_H_
+
+#include <stdint.h>
+
+#define ZOSLIB_MEMLOG_MAGIC_SIZE 8
+#define ZOSLIB_MEMLOG_VERSION 1
+#define ZOSLIB_MEMLOG_BYTE_ORDER 0x01020304u
+/** Most bytes of call stack a ZOSLIB_MEMLOG_STACK event is followed by */
+#define ZOSLIB_MEMLOG_MAX_STACK 4096
+
+/**
+ * Magic bytes at the start of a log ("ZMEMLOG" and a NUL, in ASCII).
+ */
+#define ZOSLIB_MEMLOG_MAGIC                                                    \
+  { 0x5a, 0x4d, 0x45, 0x4d, 0x4c, 0x4f, 0x47, 0x00 }
+
+/**
+ * Written once when a process opens the log, before its events. Several
+ * processes can append to the same log; each one writes a header, and their
+ * events are told apart by their pid.
+ */
+struct zoslib_memlog_header {
+  /** ZOSLIB_MEMLOG_MAGIC */
+  unsigned char magic[ZOSLIB_MEMLOG_MAGIC_SIZE];
+  /**
+   * ZOSLIB_MEMLOG_BYTE_ORDER in the byte order of the writer, which all the
+   * numbers that follow are in
+   */
+  uint32_t byte_order;
+  /** ZOSLIB_MEMLOG_VERSION */
+  uint32_t version;
+  /** process ID of the writer */
+  int32_t pid;
+  /** parent process ID of the writer */
+  int32_t ppid;
+  /** time the log was opened, in microseconds since the Epoch */
+  uint64_t start_time;
+};
+
+/** Operations recorded by the events */
+typedef enum {
+  /** size bytes were allocated at addr */
+  ZOSLIB_MEMLOG_ALLOC = 1,
+  /** the block at addr was released; size is the length given to __zfree */
+  ZOSLIB_MEMLOG_FREE = 2,
+  /** an allocation of size bytes failed */
+  ZOSLIB_MEMLOG_ALLOC_FAILED = 3,
+  /**
+   * defines stack ID addr; it's followed by size bytes holding the call
+   * stack, in folded-stack format
+   */
+  ZOSLIB_MEMLOG_STACK = 4,
+  /** size events of the thread were dropped because its buffer was full */
+  ZOSLIB_MEMLOG_DROPPED = 5
+} zoslib_memlog_op_t;
+
+/**
+ * One event. Blocks at or above 2GB are above the bar.
+ */
+struct zoslib_memlog_event {
+  /** microseconds since the start_time of the header */
+  uint64_t time;
+  uint64_t addr;
+  uint64_t size;
+  /** thread ID of the writer */
+  uint32_t thread;
+  /** zoslib_memlog_op_t */
+  uint16_t op;
+  uint16_t reserved;
+  /**
+   * for ZOSLIB_MEMLOG_ALLOC, the ID of the call stack that made the
+   * allocation if it was sampled by the heap profiler (see
+   * __MEMORY_PROFILE_RATE), or 0
+   */
+  uint32_t stack;
+  /** process ID of the writer */
+  int32_t pid;
+};
+
+#endif // ZOS_MEMLOG_H_
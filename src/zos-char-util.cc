@@ -23,234 +23,97 @@
 #include <unordered_map>
 #include <pthread.h>
 
+constexpr __ccsid_tables __ccsid_table<37>::tables;
+constexpr __ccsid_tables __ccsid_table<273>::tables;
+constexpr __ccsid_tables __ccsid_table<285>::tables;
+constexpr __ccsid_tables __ccsid_table<500>::tables;
+constexpr __ccsid_tables __ccsid_table<1140>::tables;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 static int ccsid_guess_buf_size = 4096;
 
-static int utf8scan(const unsigned char *str, unsigned size, char *errmsg,
-                    size_t sz) {
-  static int byte0_next_state[256] = {
-      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-      0,  0,  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1,  1,  1,  1,  1,  1,
-      1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
-      1,  1,  1,  1,  1,  1,  1,  1,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,
-      2,  2,  2,  2,  2,  2,  3,  3,  3,  3,  3,  3,  3,  3,  -1, -1, -1, -1,
-      -1, -1, -1, -1};
-
-  unsigned char onebyte;
-  int state = 0;
-  unsigned int value;
-  unsigned char d[4];
-  size_t offset = 0;
-  int linenum = 1;
-  onebyte = str[offset];
-  while (onebyte && offset < size) {
-    switch (state) {
-    case 0:
-      state = byte0_next_state[onebyte];
-      if (-1 == state) {
-        snprintf(errmsg, sz,
-                 "Invalid unicode sequence at file offset %lu around line "
-                 "%d, byte 0x%02X malformed, not one of 0xxxxxxx, "
-                 "110xxxxx, 1110xxxx, 11110xxx\n",
-                 offset, linenum, onebyte);
-        return -1;
-      }
-      if (state == 0) {
-        if (onebyte == 0x0a)
-          ++linenum;
-        break;
-      } else {
-        d[0] = onebyte;
-      }
-      break;
-    case 1:
-      if ((onebyte & 0xc0) == 0x80) {
-        d[1] = onebyte;
-        value = (0x1c & d[0] << 6) | (((0x03 & d[0]) << 6) | (0x3f & d[1]));
-        if (value < 0x80 || value > 0x7ff) {
-          snprintf(errmsg, sz,
-                   "Invalid unicode sequence at file offset %lu around line "
-                   "%d, 2-byte sequence 0x%02X%02X value U+%04X invalid, range "
-                   "out of U+0080 and U+07FF\n",
-                   offset, linenum, d[0], d[1], value);
-          return -1;
-        }
-        state = 0;
-      } else {
-        snprintf(errmsg, sz,
-                 "Invalid unicode sequence at file offset %lu around line "
-                 "%d, 2-byte sequence 0x%02X%02X 2nd byte malformed, not "
-                 "110xxxxx-10xxxxxx\n",
-                 offset, linenum, d[0], onebyte);
-        return -1;
-      }
-      break;
-
-    case 2:
-      if ((onebyte & 0xc0) == 0x80) {
-        d[1] = onebyte;
-        state = 22;
-      } else {
-        snprintf(errmsg, sz,
-                 "Invalid unicode sequence at file offset %lu around line "
-                 "%d, 3-byte sequence 0x%02X%02Xxx 2nd byte malformed, not "
-                 "1110xxxx-10xxxxxx-xxxxxxxx\n",
-                 offset, linenum, d[0], onebyte);
-        return -1;
-      }
-      break;
-
-    case 3:
-      if ((onebyte & 0xc0) == 0x80) {
-        d[1] = onebyte;
-        state = 33;
-      } else {
-        snprintf(errmsg, sz,
-                 "Invalid unicode sequence at file offset %lu around line "
-                 "%d, 4-byte sequence 0x%02X%02Xxxxx 2nd byte malformed, not "
-                 "11110xxx-10xxxxxx-xxxxxxxx-xxxxxxxx\n",
-                 offset, linenum, d[0], onebyte);
-        return -1;
-      }
-      break;
-
-    case 33:
-      if ((onebyte & 0xc0) == 0x80) {
-        d[2] = onebyte;
-        state = 333;
-      } else {
-        snprintf(errmsg, sz,
-                 "Invalid unicode sequence at file offset %lu around line "
-                 "%d, 4-byte sequence 0x%02X%02X%02Xxx 3rd byte malformed, not "
-                 "11110xxx-10xxxxxx-10xxxxxxx-xxxxxxxx\n",
-                 offset, linenum, d[0], d[1], onebyte);
-        return -1;
-      }
-      break;
-
-    case 22:
-      if ((onebyte & 0xc0) == 0x80) {
-        d[2] = onebyte;
-        value =
-            ((0x000f & d[0]) << 12) | ((0x003f & d[1]) << 6) | (0x3f & d[2]);
-        if (value < 0x0800 || value > 0x0ffff) {
-          snprintf(errmsg, sz,
-                   "Invalid unicode sequence at file offset %lu around line "
-                   "%d, 3-byte sequence 0x%02X%02X%02X value U+%04X "
-                   "invalid, range "
-                   "out of U+0800 and U+FFFF\n",
-                   offset, linenum, d[0], d[1], d[2], value);
-          return -1;
-        }
-        state = 0;
-      } else {
-        snprintf(errmsg, sz,
-                 "Invalid unicode sequence at file offset %lu around line "
-                 "%d, 3-byte sequence 0x%02X%02X%02X 3rd byte malformed, not "
-                 "11110xxx-10xxxxxx-10xxxxxxx\n",
-                 offset, linenum, d[0], d[1], onebyte);
-        return -1;
-      }
-      break;
-    case 333:
-      if ((onebyte & 0xc0) == 0x80) {
-        d[3] = onebyte;
-        value = ((0x0007 & d[0]) << 18) | ((0x003f & d[1]) << 12) |
-                ((0x003f & d[2]) << 6) | (0x3f & d[3]);
-        if (value < 0x010000 || value > 0x010ffff) {
-          snprintf(errmsg, sz,
-                   "Invalid unicode sequence at file offset %lu around line "
-                   "%d, 4-byte sequence 0x%02X%02X%02X%02X value U+%05X "
-                   "invalid, range "
-                   "out of U+10000 and U+10FFFF\n",
-                   offset, linenum, d[0], d[1], d[2], d[3], value);
-          return -1;
-        }
-        state = 0;
-      } else {
-        snprintf(errmsg, sz,
-                 "Invalid unicode sequence at file offset %lu around line "
-                 "%d, 4-byte sequence 0x%02X%02X%02X%02Xx 4th byte "
-                 "malformed, not "
-                 "11110xxx-10xxxxxx-10xxxxxxx-10xxxxxx\n",
-                 offset, linenum, d[0], d[1], d[2], onebyte);
-        return -1;
-      }
-      break;
-    default:
-      snprintf(errmsg, sz,
-               "Invalid unicode sequence at file offset %lu around line "
-               "%d, parser in unknown state %d, byte read 0x%02X\n",
-               offset, linenum, state, onebyte);
-      return -1;
-    }
-    ++offset;
-    onebyte = str[offset];
-  }
-  if (state != 0) {
-    snprintf(errmsg, sz,
-             "Excepted End of File detected at file offset %lu around line "
-             "%d, parser in state %d, byte read 0x%02X\n",
-             offset, linenum, state, onebyte);
-    return -1;
-  }
-  return 0;
-}
-
 void *_convert_e2a(void *dst, const void *src, size_t size) {
-  int ccsid;
-  int am;
-  strlen_ae((unsigned char *)src, &ccsid, size, &am);
-  if (ccsid == 819) {
+  if (__classify_ae((unsigned char *)src, size, NULL) == 819) {
     memcpy(dst, src, size);
     return dst;
   }
-  return __convert_one_to_one(__ibm1047_iso88591, dst, size, src);
+  return __convert_table(__ibm1047_iso88591, dst, size, src);
 }
 
 void *_convert_a2e(void *dst, const void *src, size_t size) {
-  int ccsid;
-  int am;
-  strlen_ae((unsigned char *)src, &ccsid, size, &am);
-  if (ccsid == 1047) {
+  if (__classify_ae((unsigned char *)src, size, NULL) == 1047) {
     memcpy(dst, src, size);
     return dst;
   }
-  return __convert_one_to_one(__iso88591_ibm1047, dst, size, src);
+  return __convert_table(__iso88591_ibm1047, dst, size, src);
 }
 
-int __guess_ue(const void *src, size_t size, char *errmsg, size_t er_size) {
-  const int ERR_MG_SIZE = 1024;
-  char utf8msg[ERR_MG_SIZE];
-  char ebcdicmsg[ERR_MG_SIZE];
-
-  if (utf8scan((unsigned char *)src, size, utf8msg, sizeof(utf8msg)) == 0)
-    return 819;
-
-  unsigned e_size = strlen_e((unsigned char *)src, size);
-  if (e_size == size)
-    return 1047;
-
-  if (errmsg) {
-    snprintf(ebcdicmsg, sizeof(ebcdicmsg),
-             "Character that does not belong to codepage 1047 was found");
+// Finds the tables between ccsid and ISO8859-1; both are NULL for ISO8859-1
+// itself. Returns false if ccsid isn't built in.
+static bool ccsid_tables(int ccsid, const unsigned char **e2a,
+                         const unsigned char **a2e) {
+  const __ccsid_tables *tables;
+  switch (ccsid) {
+  case 819:
+    *e2a = *a2e = NULL;
+    return true;
+  case 1047:
+    *e2a = __ibm1047_iso88591;
+    *a2e = __iso88591_ibm1047;
+    return true;
+  case 37:
+    tables = &__ccsid_table<37>::tables;
+    break;
+  case 273:
+    tables = &__ccsid_table<273>::tables;
+    break;
+  case 285:
+    tables = &__ccsid_table<285>::tables;
+    break;
+  case 500:
+    tables = &__ccsid_table<500>::tables;
+    break;
+  case 1140:
+    tables = &__ccsid_table<1140>::tables;
+    break;
+  default:
+    return false;
+  }
+  *e2a = tables->e2a;
+  *a2e = tables->a2e;
+  return true;
+}
 
-    snprintf(errmsg, er_size, "unicode: %s, ebcdic-1047: %s", utf8msg,
-             ebcdicmsg);
+void *__convert_ccsid(void *dst, const void *src, size_t len, int from,
+                      int to) {
+  const unsigned char *from_e2a, *from_a2e, *to_e2a, *to_a2e;
+  if (!ccsid_tables(from, &from_e2a, &from_a2e) ||
+      !ccsid_tables(to, &to_e2a, &to_a2e)) {
+    errno = EINVAL;
+    return NULL;
   }
-  return 65535;
+  if (from == to) {
+    if (dst != src)
+      memcpy(dst, src, len);
+    return dst;
+  }
+  if (from_e2a == NULL)
+    return __convert_table(to_a2e, dst, len, src);
+  __convert_table(from_e2a, dst, len, src);
+  if (to_a2e == NULL)
+    return dst;
+  // Between two EBCDIC code pages, go through ISO8859-1 in place.
+  return __convert_table(to_a2e, dst, len, dst);
+}
+
+int __guess_ue(const void *src, size_t size, char *errmsg, size_t er_size) {
+  struct __ccsid_guess guess;
+  __ccsid_guess_begin(&guess);
+  __ccsid_guess_feed(&guess, src, size);
+  return __ccsid_guess_end(&guess, errmsg, er_size);
 }
 
 extern "C" void __set_ccsid_guess_buf_size(int nbytes) {
@@ -263,36 +126,28 @@ int __guess_fd_ue(int fd, char *errmsg, size_t er_size, int is_new_fd) {
     return -1;
   }
 
-  // Only guess first CCSID_GUESS_BUF_SIZE_ENVAR byte of data at most
-  if (ccsid_guess_buf_size <= 4096) {
-    char buffer[ccsid_guess_buf_size];
-    ssize_t bytes = read(fd, buffer, ccsid_guess_buf_size);
+  // Only guess first CCSID_GUESS_BUF_SIZE_ENVAR byte of data at most, and
+  // stop early at a short read or once the guess is decided.
+  struct __ccsid_guess guess;
+  __ccsid_guess_begin(&guess);
+  char buffer[4096];
+  size_t remaining = ccsid_guess_buf_size > 0 ? ccsid_guess_buf_size : 0;
+  while (remaining > 0) {
+    size_t len = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+    ssize_t bytes = read(fd, buffer, len);
     if (bytes < 0) {
       perror("guess_ue:read");
       return -1;
     }
-    buffer[bytes] = '\0';
-    return __guess_ue(buffer, (size_t)bytes, errmsg, er_size);
-  } else {
-    char *buffer = (char *)malloc(ccsid_guess_buf_size);
-    ssize_t bytes = read(fd, buffer, ccsid_guess_buf_size);
-    if (bytes < 0) {
-      perror("guess_ue:read");
-      free(buffer);
-      return -1;
-    }
-    buffer[bytes] = '\0';
-    int ccsid = __guess_ue(buffer, (size_t)bytes, errmsg, er_size);
-    free(buffer);
-    return ccsid;
+    remaining -= bytes;
+    if (__ccsid_guess_feed(&guess, buffer, bytes) || (size_t)bytes < len)
+      break;
   }
+  return __ccsid_guess_end(&guess, errmsg, er_size);
 }
 
 int __guess_ae(const void *src, size_t size) {
-  int ccsid;
-  int am;
-  strlen_ae((unsigned char *)src, &ccsid, size, &am);
-  return ccsid;
+  return __classify_ae((unsigned char *)src, size, NULL);
 }
 
 #ifdef DEBUG_ONLY
@@ -308,7 +163,7 @@ size_t __e2a_l(char *bufptr, size_t szLen) {
     errno = EINVAL;
     return -1;
   }
-  strlen_ae((const unsigned char *)bufptr, &ccsid, szLen, &am);
+  ccsid = __classify_ae((const unsigned char *)bufptr, szLen, &am);
 
   if (ccsid == 819) {
     if (!am) {
@@ -331,7 +186,7 @@ size_t __a2e_l(char *bufptr, size_t szLen) {
     errno = EINVAL;
     return -1;
   }
-  strlen_ae((const unsigned char *)bufptr, &ccsid, szLen, &am);
+  ccsid = __classify_ae((const unsigned char *)bufptr, szLen, &am);
 
   if (ccsid == 1047) {
     if (!am) {
@@ -581,76 +436,259 @@ void __set_autocvt_on_fd_stream(int fd, unsigned short ccsid,
   }
 }
 
-unsigned strlen_ae(const unsigned char *str, int *code_page,
-                   unsigned long max_len, int *ambiguous) {
-  static __tlssim<int> last_ccsid(819);
-  #define last_ccsid (*last_ccsid.access())
-
-  static const unsigned char _tab_a[256] __attribute__((aligned(8))) = {
-      1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-      1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-  };
-  static const unsigned char _tab_e[256] __attribute__((aligned(8))) = {
-      1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 0, 0, 1,
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0,
-      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1,
-      1, 1, 1, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
-      0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
-      1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1,
-      1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1,
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0,
-      0, 0, 1, 1, 1, 1, 1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1,
-      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1,
-  };
-  unsigned long bytes;
-  unsigned long code_out;
-  const unsigned char *start;
-
-  bytes = max_len;
-  code_out = 0;
-  start = str;
-  __asm volatile(" trte %1,%3,0\n"
-                 " jo *-4\n"
-                 : __ZL_NR("+",r3)(bytes), __ZL_NR("+",r2)(str), "+r"(bytes), "+r"(code_out)
-                 : __ZL_NR("",r1)(_tab_a)
-                 :);
-  unsigned a_len = str - start;
+// Bytes that end a string that's valid ASCII, valid EBCDIC, or either; in
+// _tab_ae, 1 ends ASCII, 2 ends EBCDIC and 3 ends both.
+static const unsigned char _tab_a[256] __attribute__((aligned(8))) = {
+    1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+};
+static const unsigned char _tab_e[256] __attribute__((aligned(8))) = {
+    1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 0, 0, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1,
+    1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 1, 1, 1, 1, 1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1,
+};
+static const unsigned char _tab_ae[256] __attribute__((aligned(8))) = {
+    3, 3, 3, 3, 3, 1, 3, 2, 2, 2, 2, 0, 0, 0, 3, 3, 3, 3, 3, 3, 3, 1, 1, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0, 0,
+    0, 0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 0, 0, 0, 0, 0, 0, 1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3, 3, 3, 3, 3,
+    3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3, 3, 3, 3, 3, 3, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 3, 3, 3, 1, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 1, 3, 3,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3, 3, 3, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 3, 3, 3, 3, 3, 3, 1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3, 3, 3, 3, 3,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3, 3, 3, 3, 3,
+};
 
-  bytes = max_len;
-  code_out = 0;
-  str = start;
+// Returns the number of bytes at the start of str, up to max_len, whose
+// entry in table is 0, and sets *code to the entry that stopped the scan,
+// or to 0 if none did.
+static unsigned long ae_prefix(const unsigned char *table,
+                               const unsigned char *str,
+                               unsigned long max_len, unsigned long *code) {
+  unsigned long bytes = max_len;
+  unsigned long code_out = 0;
+  const unsigned char *start = str;
   __asm volatile(" trte %1,%3,0\n"
                  " jo *-4\n"
                  : __ZL_NR("+",r3)(bytes), __ZL_NR("+",r2)(str), "+r"(bytes), "+r"(code_out)
-                 : __ZL_NR("",r1)(_tab_e)
+                 : __ZL_NR("",r1)(table)
                  :);
-  unsigned e_len = str - start;
-  if (a_len > e_len) {
-    *code_page = 819;
-    last_ccsid = 819;
-    *ambiguous = 0;
-    return a_len;
-  } else if (e_len > a_len) {
-    *code_page = 1047;
-    last_ccsid = 1047;
-    *ambiguous = 0;
-    return e_len;
-  }
-  *code_page = last_ccsid;
+  *code = code_out;
+  return str - start;
+}
+
+// Works out the lengths of the prefixes of str that are valid ASCII and valid
+// EBCDIC in one pass over _tab_ae, which runs until the first byte that ends
+// either of them. If that byte ends only one, the other prefix is longer; with
+// decide_only that's all that's wanted, so its length is left as a lower
+// bound instead of scanning on for the end of it.
+static void ae_prefixes(const unsigned char *str, unsigned long max_len,
+                        bool decide_only, unsigned long *a_len,
+                        unsigned long *e_len) {
+  unsigned long code;
+  unsigned long len = ae_prefix(_tab_ae, str, max_len, &code);
+  *a_len = *e_len = len;
+  if (code == 0 || code == 3)
+    return;
+
+  unsigned long *longer = (code == 1) ? e_len : a_len;
+  *longer = ++len;
+  if (!decide_only)
+    *longer += ae_prefix((code == 1) ? _tab_e : _tab_a, str + len,
+                         max_len - len, &code);
+}
+
+// Picks the code page with the longer prefix; if they're the same length,
+// the string is ambiguous and gets the code page last picked on this thread.
+static int ae_code_page(unsigned long a_len, unsigned long e_len,
+                        int *ambiguous) {
+  static __tlssim<int> last_ccsid(819);
+  int *last = last_ccsid.access();
+  *ambiguous = 0;
+  if (a_len > e_len)
+    return *last = 819;
+  if (e_len > a_len)
+    return *last = 1047;
   *ambiguous = 1;
-  return a_len;
+  return *last;
+}
+
+int __classify_ae(const unsigned char *str, unsigned long max_len,
+                  int *ambiguous) {
+  unsigned long a_len, e_len;
+  int am;
+  ae_prefixes(str, max_len, true, &a_len, &e_len);
+  int code_page = ae_code_page(a_len, e_len, &am);
+  if (ambiguous)
+    *ambiguous = am;
+  return code_page;
+}
+
+unsigned strlen_ae(const unsigned char *str, int *code_page,
+                   unsigned long max_len, int *ambiguous) {
+  unsigned long a_len, e_len;
+  ae_prefixes(str, max_len, false, &a_len, &e_len);
+  *code_page = ae_code_page(a_len, e_len, ambiguous);
+  return (a_len > e_len) ? a_len : e_len;
+}
+
+void __ccsid_guess_begin(struct __ccsid_guess *guess) {
+  guess->offset = 0;
+  guess->line = 1;
+  guess->utf8 = 1;
+  guess->ebcdic = 1;
+  guess->ended = 0;
+  guess->npartial = 0;
+  guess->utf8msg[0] = 0;
+}
+
+// Length of the UTF-8 sequence that c leads; a byte that can't lead one
+// counts as a sequence of its own.
+static int utf8_sequence_length(unsigned char c) {
+  if (c >= 0xf0 && c <= 0xf7)
+    return 4;
+  if (c >= 0xe0 && c <= 0xef)
+    return 3;
+  if (c >= 0xc0 && c <= 0xdf)
+    return 2;
+  return 1;
+}
+
+// Checks size bytes of UTF-8 at offset. If they're malformed, the error is
+// described with the held bytes that follow them too, so that it's the same
+// as if the data had been checked in one piece.
+static void ccsid_guess_utf8(struct __ccsid_guess *guess, const void *src,
+                             size_t size, size_t held,
+                             unsigned long long offset) {
+  if (__utf8_validate(src, size, NULL, 0) != 0) {
+    __utf8_validate_at(src, size + held, offset, guess->line, guess->utf8msg,
+                       sizeof(guess->utf8msg));
+    guess->utf8 = 0;
+    return;
+  }
+  const char *p = (const char *)src, *end = p + size;
+  while ((p = (const char *)memchr(p, '\n', end - p)) != NULL) {
+    ++guess->line;
+    ++p;
+  }
 }
 
+// Checks the UTF-8 in size bytes that follow the data fed so far, holding
+// back a sequence that's cut off at the end until the next chunk.
+static void ccsid_guess_feed_utf8(struct __ccsid_guess *guess,
+                                  const unsigned char *src, size_t size) {
+  size_t start = 0;
+  if (guess->npartial > 0) {
+    size_t need = utf8_sequence_length(guess->partial[0]) - guess->npartial;
+    size_t take = need < size ? need : size;
+    memcpy(guess->partial + guess->npartial, src, take);
+    guess->npartial += take;
+    if (take < need)
+      return;
+    ccsid_guess_utf8(guess, guess->partial, guess->npartial, 0,
+                     guess->offset - (guess->npartial - take));
+    guess->npartial = 0;
+    if (!guess->utf8)
+      return;
+    start = take;
+  }
+
+  size_t end = size;
+  for (size_t k = 1; k <= 3 && k <= size - start; ++k) {
+    unsigned char c = src[size - k];
+    if (c >= 0xc0) {
+      if (utf8_sequence_length(c) > k)
+        end = size - k;
+      break;
+    }
+    if (c < 0x80)
+      break;
+  }
+  ccsid_guess_utf8(guess, src + start, end - start, size - end,
+                   guess->offset + start);
+  if (!guess->utf8)
+    return;
+  memcpy(guess->partial, src + end, size - end);
+  guess->npartial = size - end;
+}
+
+// A sequence still cut off when the data ends makes it not UTF-8. If it
+// ends at a NUL, the NUL is where the error is found.
+static void ccsid_guess_finish_utf8(struct __ccsid_guess *guess) {
+  if (guess->utf8 && guess->npartial > 0) {
+    guess->partial[guess->npartial] = 0;
+    ccsid_guess_utf8(guess, guess->partial, guess->npartial, guess->ended,
+                     guess->offset - guess->npartial);
+    guess->utf8 = 0;
+    guess->npartial = 0;
+  }
+}
+
+int __ccsid_guess_feed(struct __ccsid_guess *guess, const void *src,
+                       size_t size) {
+  const unsigned char *str = (const unsigned char *)src;
+  if (!guess->ended) {
+    // UTF-8 is only checked up to the first NUL, which isn't valid EBCDIC.
+    const unsigned char *nul = (const unsigned char *)memchr(str, 0, size);
+    size_t len = nul ? nul - str : size;
+    if (guess->ebcdic) {
+      unsigned long code;
+      if (nul || ae_prefix(_tab_e, str, len, &code) != len)
+        guess->ebcdic = 0;
+    }
+    if (guess->utf8)
+      ccsid_guess_feed_utf8(guess, str, len);
+    guess->offset += len;
+    if (nul) {
+      guess->ended = 1;
+      ccsid_guess_finish_utf8(guess);
+    }
+  }
+
+  if (guess->ended)
+    return guess->utf8 ? 819 : 65535;
+  if (!guess->utf8 && !guess->ebcdic)
+    return 65535;
+  return 0;
+}
+
+int __ccsid_guess_end(struct __ccsid_guess *guess, char *errmsg,
+                      size_t er_size) {
+  ccsid_guess_finish_utf8(guess);
+  if (guess->utf8)
+    return 819;
+  if (guess->ebcdic)
+    return 1047;
+
+  if (errmsg) {
+    snprintf(errmsg, er_size,
+             "unicode: %s, ebcdic-1047: Character that does not belong to "
+             "codepage 1047 was found",
+             guess->utf8msg);
+  }
+  return 65535;
+}
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,769 @@
+///////////////////////////////////////////////////////////////////////////////
+// Licensed Materials - Property of IBM
+// ZOSLIB
+// (C) Copyright IBM Corp. 2020. All Rights Reserved.
+// US Government Users Restricted Rights - Use, duplication
+// or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+///////////////////////////////////////////////////////////////////////////////
+
+// Table-driven byte translation and UTF-8 validation with vector registers.
+//
+// For translation, a 256-byte table doesn't fit in one permute, so each
+// kernel splits it into the slices a permute can index, looks every input
+// byte up in each slice and keeps the result from the slice that the high
+// bits of the byte select. The scalar kernel handles the tails and machines
+// without a vector facility.
+//
+// Whether that beats a plain table lookup, or TROO on z/OS, depends on the
+// machine, so the kernel used by __convert_table() is picked by timing each
+// available one over a small buffer the first time it's needed.
+
+#include "zos-convert.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+
+#if defined(__MVS__)
+#include "zos-char-util.h"
+#include "zos-sys-info.h"
+#endif
+
+#if defined(__s390x__) && defined(__VX__)
+#define ZOSLIB_CONVERT_ZVECTOR 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZOSLIB_CONVERT_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define ZOSLIB_CONVERT_NEON 1
+#endif
+
+namespace {
+
+// Below this, setting up the slices costs more than it saves.
+const size_t kMinVectorSize = 64;
+
+void convert_tail(const unsigned char *table, unsigned char *d,
+                  const unsigned char *s, size_t size) {
+  for (size_t i = 0; i < size; ++i)
+    d[i] = table[s[i]];
+}
+
+void *convert_scalar(const unsigned char *table, void *dst, size_t size,
+                     const void *src) {
+  unsigned char *d = (unsigned char *)dst;
+  const unsigned char *s = (const unsigned char *)src;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    unsigned char b0 = table[s[i]], b1 = table[s[i + 1]];
+    unsigned char b2 = table[s[i + 2]], b3 = table[s[i + 3]];
+    unsigned char b4 = table[s[i + 4]], b5 = table[s[i + 5]];
+    unsigned char b6 = table[s[i + 6]], b7 = table[s[i + 7]];
+    d[i] = b0, d[i + 1] = b1, d[i + 2] = b2, d[i + 3] = b3;
+    d[i + 4] = b4, d[i + 5] = b5, d[i + 6] = b6, d[i + 7] = b7;
+  }
+  convert_tail(table, d + i, s + i, size - i);
+  return dst;
+}
+
+#if defined(__MVS__)
+void *convert_troo(const unsigned char *table, void *dst, size_t size,
+                   const void *src) {
+  return __convert_one_to_one(table, dst, size, src);
+}
+#endif
+
+#if defined(ZOSLIB_CONVERT_ZVECTOR)
+typedef unsigned char zvec_u8 __attribute__((vector_size(16)));
+
+// VPERM indexes 32 bytes with the low 5 bits of each byte, so the table is
+// 8 slices selected by the high 3 bits.
+void *convert_zvector(const unsigned char *table, void *dst, size_t size,
+                      const void *src) {
+  unsigned char *d = (unsigned char *)dst;
+  const unsigned char *s = (const unsigned char *)src;
+  if (size < kMinVectorSize)
+    return convert_scalar(table, dst, size, src);
+  zvec_u8 t[16];
+  memcpy(t, table, sizeof(t));
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    zvec_u8 x, r = {0};
+    memcpy(&x, s + i, sizeof(x));
+    zvec_u8 hi = x >> 5;
+    for (int k = 0; k < 8; ++k) {
+      zvec_u8 m = (zvec_u8)(hi == (unsigned char)k);
+      r |= __builtin_s390_vperm(t[2 * k], t[2 * k + 1], x) & m;
+    }
+    memcpy(d + i, &r, sizeof(r));
+  }
+  convert_tail(table, d + i, s + i, size - i);
+  return dst;
+}
+#endif
+
+#if defined(ZOSLIB_CONVERT_X86)
+// PSHUFB indexes 16 bytes with the low 4 bits of each byte and returns 0 for
+// an index with the high bit on, so each half of the table is 8 slices.
+// Looking x - 16 * k up in slice k returns 0 for every k above the high
+// nibble h of x, so XOR-ing the lookups in slices that each hold the XOR of
+// consecutive table rows leaves row h without any compare or select.
+__attribute__((target("ssse3"))) __m128i xor_slice(const unsigned char *table,
+                                                    int k) {
+  __m128i row = _mm_loadu_si128((const __m128i *)(table + 16 * k));
+  if (k & 7)
+    row = _mm_xor_si128(
+        row, _mm_loadu_si128((const __m128i *)(table + 16 * (k - 1))));
+  return row;
+}
+
+__attribute__((target("ssse3"))) void *
+convert_ssse3(const unsigned char *table, void *dst, size_t size,
+              const void *src) {
+  unsigned char *d = (unsigned char *)dst;
+  const unsigned char *s = (const unsigned char *)src;
+  if (size < kMinVectorSize)
+    return convert_scalar(table, dst, size, src);
+  __m128i t[16];
+  for (int k = 0; k < 16; ++k)
+    t[k] = xor_slice(table, k);
+  const __m128i step = _mm_set1_epi8(16);
+  const __m128i high = _mm_set1_epi8((char)0x80);
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i lo = _mm_setzero_si128(), hi = lo;
+    __m128i xlo = x, xhi = _mm_xor_si128(x, high);
+    for (int k = 0; k < 8; ++k) {
+      lo = _mm_xor_si128(lo, _mm_shuffle_epi8(t[k], xlo));
+      hi = _mm_xor_si128(hi, _mm_shuffle_epi8(t[8 + k], xhi));
+      xlo = _mm_sub_epi8(xlo, step);
+      xhi = _mm_sub_epi8(xhi, step);
+    }
+    __m128i m = _mm_cmplt_epi8(x, _mm_setzero_si128());
+    __m128i r = _mm_or_si128(_mm_and_si128(m, hi), _mm_andnot_si128(m, lo));
+    _mm_storeu_si128((__m128i *)(d + i), r);
+  }
+  convert_tail(table, d + i, s + i, size - i);
+  return dst;
+}
+
+// VPSHUFB shuffles within each 128-bit lane, so each slice is loaded into
+// both lanes and 32 bytes are translated per step.
+__attribute__((target("avx2"))) void *
+convert_avx2(const unsigned char *table, void *dst, size_t size,
+             const void *src) {
+  unsigned char *d = (unsigned char *)dst;
+  const unsigned char *s = (const unsigned char *)src;
+  if (size < kMinVectorSize)
+    return convert_scalar(table, dst, size, src);
+  __m256i t[16];
+  for (int k = 0; k < 16; ++k)
+    t[k] = _mm256_broadcastsi128_si256(xor_slice(table, k));
+  const __m256i step = _mm256_set1_epi8(16);
+  const __m256i high = _mm256_set1_epi8((char)0x80);
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i lo = _mm256_setzero_si256(), hi = lo;
+    __m256i xlo = x, xhi = _mm256_xor_si256(x, high);
+    for (int k = 0; k < 8; ++k) {
+      lo = _mm256_xor_si256(lo, _mm256_shuffle_epi8(t[k], xlo));
+      hi = _mm256_xor_si256(hi, _mm256_shuffle_epi8(t[8 + k], xhi));
+      xlo = _mm256_sub_epi8(xlo, step);
+      xhi = _mm256_sub_epi8(xhi, step);
+    }
+    _mm256_storeu_si256((__m256i *)(d + i), _mm256_blendv_epi8(lo, hi, x));
+  }
+  convert_tail(table, d + i, s + i, size - i);
+  return dst;
+}
+#endif
+
+#if defined(ZOSLIB_CONVERT_NEON)
+// TBL/TBX index 64 bytes, so the table is 4 slices; an out-of-range index
+// leaves the byte alone in TBX, which makes the selection free.
+void *convert_neon(const unsigned char *table, void *dst, size_t size,
+                   const void *src) {
+  unsigned char *d = (unsigned char *)dst;
+  const unsigned char *s = (const unsigned char *)src;
+  if (size < kMinVectorSize)
+    return convert_scalar(table, dst, size, src);
+  uint8x16x4_t t[4];
+  for (int k = 0; k < 4; ++k) {
+    t[k].val[0] = vld1q_u8(table + 64 * k);
+    t[k].val[1] = vld1q_u8(table + 64 * k + 16);
+    t[k].val[2] = vld1q_u8(table + 64 * k + 32);
+    t[k].val[3] = vld1q_u8(table + 64 * k + 48);
+  }
+  const uint8x16_t step = vdupq_n_u8(64);
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    uint8x16_t x = vld1q_u8(s + i);
+    uint8x16_t r = vqtbl4q_u8(t[0], x);
+    x = vsubq_u8(x, step);
+    r = vqtbx4q_u8(r, t[1], x);
+    x = vsubq_u8(x, step);
+    r = vqtbx4q_u8(r, t[2], x);
+    x = vsubq_u8(x, step);
+    r = vqtbx4q_u8(r, t[3], x);
+    vst1q_u8(d + i, r);
+  }
+  convert_tail(table, d + i, s + i, size - i);
+  return dst;
+}
+#endif
+
+const int kMaxKernels = 4;
+const size_t kCalibrationSize = 16 * 1024;
+const int kCalibrationRuns = 3;
+
+struct KernelTable {
+  __convert_kernel kernels[kMaxKernels];
+  size_t count;
+  size_t selected;
+
+  KernelTable() : count(0), selected(0) {
+#if defined(ZOSLIB_CONVERT_ZVECTOR)
+#if defined(__MVS__)
+    if (__is_vxf_available())
+#endif
+      add("zvector", convert_zvector);
+#elif defined(ZOSLIB_CONVERT_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      add("avx2", convert_avx2);
+    if (__builtin_cpu_supports("ssse3"))
+      add("ssse3", convert_ssse3);
+#elif defined(ZOSLIB_CONVERT_NEON)
+    add("neon", convert_neon);
+#endif
+#if defined(__MVS__)
+    add("troo", convert_troo);
+#endif
+    add("scalar", convert_scalar);
+    calibrate();
+  }
+
+  void add(const char *name, __convert_kernel_fn fn) {
+    kernels[count].name = name;
+    kernels[count].convert = fn;
+    ++count;
+  }
+
+  // Selects the kernel with the shortest best-of-kCalibrationRuns time.
+  void calibrate() {
+    typedef std::chrono::steady_clock clock;
+    static unsigned char buffer[kCalibrationSize];
+    unsigned char table[256];
+    for (int i = 0; i < 256; ++i)
+      table[i] = (unsigned char)(i * 167 + 13);
+    for (size_t i = 0; i < kCalibrationSize; ++i)
+      buffer[i] = (unsigned char)(i * 31 + (i >> 8));
+
+    clock::duration best = clock::duration::max();
+    for (size_t k = 0; k < count; ++k) {
+      // A first pass so that every kernel is measured warm.
+      kernels[k].convert(table, buffer, kCalibrationSize, buffer);
+      for (int run = 0; run < kCalibrationRuns; ++run) {
+        clock::time_point start = clock::now();
+        kernels[k].convert(table, buffer, kCalibrationSize, buffer);
+        clock::duration elapsed = clock::now() - start;
+        if (elapsed < best) {
+          best = elapsed;
+          selected = k;
+        }
+      }
+    }
+  }
+};
+
+const KernelTable &kernel_table() {
+  static const KernelTable table;
+  return table;
+}
+
+// The byte-at-a-time state machine that __guess_ue() used to run on every
+// buffer. It's now only run once a kernel has found an error, to describe
+// where and what it is; str starts base_offset bytes into line base_line of
+// the text.
+int utf8_scan(const unsigned char *str, size_t size, size_t base_offset,
+              int base_line, char *errmsg, size_t sz) {
+  static const int byte0_next_state[256] = {
+      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+      0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+      0,  0,  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1,  1,  1,  1,  1,  1,
+      1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+      1,  1,  1,  1,  1,  1,  1,  1,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,
+      2,  2,  2,  2,  2,  2,  3,  3,  3,  3,  3,  3,  3,  3,  -1, -1, -1, -1,
+      -1, -1, -1, -1};
+
+  unsigned char onebyte;
+  int state = 0;
+  unsigned int value;
+  unsigned char d[4] = {0};
+  size_t offset = 0;
+  int linenum = base_line;
+  onebyte = 0;
+  while (offset < size && (onebyte = str[offset])) {
+    switch (state) {
+    case 0:
+      state = byte0_next_state[onebyte];
+      if (-1 == state) {
+        snprintf(errmsg, sz,
+                 "Invalid unicode sequence at file offset %lu around line "
+                 "%d, byte 0x%02X malformed, not one of 0xxxxxxx, "
+                 "110xxxxx, 1110xxxx, 11110xxx\n",
+                 base_offset + offset, linenum, onebyte);
+        return -1;
+      }
+      if (state == 0) {
+        if (onebyte == 0x0a)
+          ++linenum;
+        break;
+      } else {
+        d[0] = onebyte;
+      }
+      break;
+    case 1:
+      if ((onebyte & 0xc0) == 0x80) {
+        d[1] = onebyte;
+        value = ((0x1f & d[0]) << 6) | (0x3f & d[1]);
+        if (value < 0x80 || value > 0x7ff) {
+          snprintf(errmsg, sz,
+                   "Invalid unicode sequence at file offset %lu around line "
+                   "%d, 2-byte sequence 0x%02X%02X value U+%04X invalid, range "
+                   "out of U+0080 and U+07FF\n",
+                   base_offset + offset, linenum, d[0], d[1], value);
+          return -1;
+        }
+        state = 0;
+      } else {
+        snprintf(errmsg, sz,
+                 "Invalid unicode sequence at file offset %lu around line "
+                 "%d, 2-byte sequence 0x%02X%02X 2nd byte malformed, not "
+                 "110xxxxx-10xxxxxx\n",
+                 base_offset + offset, linenum, d[0], onebyte);
+        return -1;
+      }
+      break;
+
+    case 2:
+      if ((onebyte & 0xc0) == 0x80) {
+        d[1] = onebyte;
+        state = 22;
+      } else {
+        snprintf(errmsg, sz,
+                 "Invalid unicode sequence at file offset %lu around line "
+                 "%d, 3-byte sequence 0x%02X%02Xxx 2nd byte malformed, not "
+                 "1110xxxx-10xxxxxx-xxxxxxxx\n",
+                 base_offset + offset, linenum, d[0], onebyte);
+        return -1;
+      }
+      break;
+
+    case 3:
+      if ((onebyte & 0xc0) == 0x80) {
+        d[1] = onebyte;
+        state = 33;
+      } else {
+        snprintf(errmsg, sz,
+                 "Invalid unicode sequence at file offset %lu around line "
+                 "%d, 4-byte sequence 0x%02X%02Xxxxx 2nd byte malformed, not "
+                 "11110xxx-10xxxxxx-xxxxxxxx-xxxxxxxx\n",
+                 base_offset + offset, linenum, d[0], onebyte);
+        return -1;
+      }
+      break;
+
+    case 33:
+      if ((onebyte & 0xc0) == 0x80) {
+        d[2] = onebyte;
+        state = 333;
+      } else {
+        snprintf(errmsg, sz,
+                 "Invalid unicode sequence at file offset %lu around line "
+                 "%d, 4-byte sequence 0x%02X%02X%02Xxx 3rd byte malformed, not "
+                 "11110xxx-10xxxxxx-10xxxxxxx-xxxxxxxx\n",
+                 base_offset + offset, linenum, d[0], d[1], onebyte);
+        return -1;
+      }
+      break;
+
+    case 22:
+      if ((onebyte & 0xc0) == 0x80) {
+        d[2] = onebyte;
+        value =
+            ((0x000f & d[0]) << 12) | ((0x003f & d[1]) << 6) | (0x3f & d[2]);
+        if (value < 0x0800 || value > 0x0ffff) {
+          snprintf(errmsg, sz,
+                   "Invalid unicode sequence at file offset %lu around line "
+                   "%d, 3-byte sequence 0x%02X%02X%02X value U+%04X "
+                   "invalid, range "
+                   "out of U+0800 and U+FFFF\n",
+                   base_offset + offset, linenum, d[0], d[1], d[2], value);
+          return -1;
+        }
+        state = 0;
+      } else {
+        snprintf(errmsg, sz,
+                 "Invalid unicode sequence at file offset %lu around line "
+                 "%d, 3-byte sequence 0x%02X%02X%02X 3rd byte malformed, not "
+                 "11110xxx-10xxxxxx-10xxxxxxx\n",
+                 base_offset + offset, linenum, d[0], d[1], onebyte);
+        return -1;
+      }
+      break;
+    case 333:
+      if ((onebyte & 0xc0) == 0x80) {
+        d[3] = onebyte;
+        value = ((0x0007 & d[0]) << 18) | ((0x003f & d[1]) << 12) |
+                ((0x003f & d[2]) << 6) | (0x3f & d[3]);
+        if (value < 0x010000 || value > 0x010ffff) {
+          snprintf(errmsg, sz,
+                   "Invalid unicode sequence at file offset %lu around line "
+                   "%d, 4-byte sequence 0x%02X%02X%02X%02X value U+%05X "
+                   "invalid, range "
+                   "out of U+10000 and U+10FFFF\n",
+                   base_offset + offset, linenum, d[0], d[1], d[2], d[3], value);
+          return -1;
+        }
+        state = 0;
+      } else {
+        snprintf(errmsg, sz,
+                 "Invalid unicode sequence at file offset %lu around line "
+                 "%d, 4-byte sequence 0x%02X%02X%02X%02Xx 4th byte "
+                 "malformed, not "
+                 "11110xxx-10xxxxxx-10xxxxxxx-10xxxxxx\n",
+                 base_offset + offset, linenum, d[0], d[1], d[2], onebyte);
+        return -1;
+      }
+      break;
+    default:
+      snprintf(errmsg, sz,
+               "Invalid unicode sequence at file offset %lu around line "
+               "%d, parser in unknown state %d, byte read 0x%02X\n",
+               base_offset + offset, linenum, state, onebyte);
+      return -1;
+    }
+    ++offset;
+  }
+  if (state != 0) {
+    snprintf(errmsg, sz,
+             "Excepted End of File detected at file offset %lu around line "
+             "%d, parser in state %d, byte read 0x%02X\n",
+             base_offset + offset, linenum, state, onebyte);
+    return -1;
+  }
+  return 0;
+}
+
+// UTF-8 validation. Each kernel checks size bytes and returns 1 if they're
+// well-formed, with one exception kept from utf8_scan(): UTF-16 surrogates
+// encoded as 3-byte sequences are accepted. A NUL is just another ASCII
+// byte to a kernel; __utf8_validate() stops at the first one itself.
+
+// Checks one sequence starting at s[0], which isn't ASCII, and returns its
+// length, or 0 if it's malformed or runs past size.
+size_t utf8_sequence(const unsigned char *s, size_t size) {
+  unsigned char c = s[0], lo = 0x80, hi = 0xbf;
+  size_t len;
+  if (c >= 0xc2 && c <= 0xdf) {
+    len = 2;
+  } else if (c >= 0xe0 && c <= 0xef) {
+    len = 3;
+    if (c == 0xe0)
+      lo = 0xa0;
+  } else if (c >= 0xf0 && c <= 0xf4) {
+    len = 4;
+    if (c == 0xf0)
+      lo = 0x90;
+    else if (c == 0xf4)
+      hi = 0x8f;
+  } else {
+    return 0;
+  }
+  if (size < len || s[1] < lo || s[1] > hi)
+    return 0;
+  for (size_t i = 2; i < len; ++i)
+    if ((s[i] & 0xc0) != 0x80)
+      return 0;
+  return len;
+}
+
+// Skips ASCII 8 bytes at a time, and checks everything else a sequence at a
+// time.
+int utf8_validate_scalar(const unsigned char *s, size_t size) {
+  const uint64_t kHighBits = 0x8080808080808080ULL;
+  size_t i = 0;
+  while (i < size) {
+    if (i + 8 <= size) {
+      uint64_t word;
+      memcpy(&word, s + i, sizeof(word));
+      if ((word & kHighBits) == 0) {
+        i += 8;
+        continue;
+      }
+    }
+    if (s[i] < 0x80) {
+      ++i;
+      continue;
+    }
+    size_t len = utf8_sequence(s + i, size - i);
+    if (len == 0)
+      return 0;
+    i += len;
+  }
+  return 1;
+}
+
+int utf8_validate_scanner(const unsigned char *s, size_t size) {
+  return utf8_scan(s, size, 0, 1, NULL, 0) == 0;
+}
+
+#if defined(ZOSLIB_CONVERT_ZVECTOR) || defined(ZOSLIB_CONVERT_X86) ||          \
+    defined(ZOSLIB_CONVERT_NEON)
+// The lookup algorithm of Keiser and Lemire, "Validating UTF-8 in less than
+// one instruction per byte" (2021). Every byte and the one before it are
+// looked up in three 16-entry tables, indexed by the high and low nibble of
+// the previous byte and the high nibble of the byte; each table entry has a
+// bit for each kind of error that the nibble allows, so the AND of the three
+// is nonzero only where there's an error. Whether the third and fourth bytes
+// of a sequence are continuations is checked by comparing against the bytes
+// two and three back. Blocks of 64 bytes that are all ASCII skip the
+// lookups altogether.
+typedef unsigned char utf8_vec __attribute__((vector_size(16)));
+
+#if defined(ZOSLIB_CONVERT_X86)
+#define ZOSLIB_UTF8_TARGET __attribute__((target("ssse3")))
+#else
+#define ZOSLIB_UTF8_TARGET
+#endif
+
+ZOSLIB_UTF8_TARGET inline utf8_vec utf8_lookup(utf8_vec table,
+                                               utf8_vec index) {
+#if defined(ZOSLIB_CONVERT_ZVECTOR)
+  return __builtin_s390_vperm(table, table, index);
+#elif defined(ZOSLIB_CONVERT_X86)
+  return (utf8_vec)_mm_shuffle_epi8((__m128i)table, (__m128i)index);
+#else
+  return (utf8_vec)vqtbl1q_u8((uint8x16_t)table, (uint8x16_t)index);
+#endif
+}
+
+inline bool utf8_any(utf8_vec v, uint64_t bits) {
+  uint64_t words[2];
+  memcpy(words, &v, sizeof(words));
+  return ((words[0] | words[1]) & bits) != 0;
+}
+
+const unsigned char kTooShort = 1 << 0;
+const unsigned char kTooLong = 1 << 1;
+const unsigned char kOverlong3 = 1 << 2;
+const unsigned char kTooLarge = 1 << 3;
+const unsigned char kOverlong2 = 1 << 5;
+const unsigned char kTooLarge1000 = 1 << 6;
+const unsigned char kOverlong4 = 1 << 6;
+const unsigned char kTwoConts = 1 << 7;
+const unsigned char kCarry = kTooShort | kTooLong | kTwoConts;
+
+struct Utf8Checker {
+  utf8_vec error;
+  utf8_vec prev_input;
+  utf8_vec prev_incomplete;
+
+  Utf8Checker() : error(), prev_input(), prev_incomplete() {}
+
+  ZOSLIB_UTF8_TARGET void check_block(utf8_vec input) {
+    const utf8_vec byte_1_high_table = {
+        kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,
+        kTooLong, kTwoConts, kTwoConts, kTwoConts, kTwoConts,
+        kTooShort | kOverlong2, kTooShort, kTooShort | kOverlong3,
+        kTooShort | kTooLarge | kTooLarge1000 | kOverlong4};
+    const utf8_vec byte_1_low_table = {
+        kCarry | kOverlong3 | kOverlong2 | kOverlong4,
+        kCarry | kOverlong2,
+        kCarry,
+        kCarry,
+        kCarry | kTooLarge,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000};
+    const utf8_vec byte_2_high_table = {
+        kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,
+        kTooShort, kTooShort,
+        kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 |
+            kOverlong4,
+        kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,
+        kTooLong | kOverlong2 | kTwoConts | kTooLarge,
+        kTooLong | kOverlong2 | kTwoConts | kTooLarge,
+        kTooShort, kTooShort, kTooShort, kTooShort};
+    // The last byte of input is a lead byte if it's at least 0xc0, the one
+    // before it if it's at least 0xe0, and the one before that if it's at
+    // least 0xf0.
+    const utf8_vec max_complete = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                                   0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                                   0xff, 0xef, 0xdf, 0xbf};
+
+    utf8_vec prev1 = __builtin_shufflevector(prev_input, input, 15, 16, 17,
+                                             18, 19, 20, 21, 22, 23, 24, 25,
+                                             26, 27, 28, 29, 30);
+    utf8_vec prev2 = __builtin_shufflevector(prev_input, input, 14, 15, 16,
+                                             17, 18, 19, 20, 21, 22, 23, 24,
+                                             25, 26, 27, 28, 29);
+    utf8_vec prev3 = __builtin_shufflevector(prev_input, input, 13, 14, 15,
+                                             16, 17, 18, 19, 20, 21, 22, 23,
+                                             24, 25, 26, 27, 28);
+    utf8_vec special =
+        utf8_lookup(byte_1_high_table, prev1 >> 4) &
+        utf8_lookup(byte_1_low_table, prev1 & 0x0f) &
+        utf8_lookup(byte_2_high_table, input >> 4);
+    utf8_vec must23 = (utf8_vec)((prev2 >= 0xe0) | (prev3 >= 0xf0)) & 0x80;
+    error |= must23 ^ special;
+    prev_incomplete = (utf8_vec)(input > max_complete);
+    prev_input = input;
+  }
+
+  ZOSLIB_UTF8_TARGET void check_ascii(utf8_vec input) {
+    error |= prev_incomplete;
+    prev_incomplete = utf8_vec();
+    prev_input = input;
+  }
+};
+
+ZOSLIB_UTF8_TARGET int utf8_validate_vector(const unsigned char *s,
+                                            size_t size) {
+  const uint64_t kHighBits = 0x8080808080808080ULL;
+  const uint64_t kAllBits = ~0ULL;
+  Utf8Checker checker;
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    utf8_vec block[4];
+    memcpy(block, s + i, sizeof(block));
+    if (!utf8_any(block[0] | block[1] | block[2] | block[3], kHighBits)) {
+      checker.check_ascii(block[3]);
+      continue;
+    }
+    for (int k = 0; k < 4; ++k)
+      checker.check_block(block[k]);
+    if (utf8_any(checker.error, kAllBits))
+      return 0;
+  }
+  for (; i + 16 <= size; i += 16) {
+    utf8_vec block;
+    memcpy(&block, s + i, sizeof(block));
+    checker.check_block(block);
+  }
+  if (i < size) {
+    // The zeros after the tail are ASCII, so a sequence cut short by the end
+    // shows up as an error in this block.
+    utf8_vec block = utf8_vec();
+    memcpy(&block, s + i, size - i);
+    checker.check_block(block);
+  } else {
+    checker.error |= checker.prev_incomplete;
+  }
+  return !utf8_any(checker.error, kAllBits);
+}
+#endif
+
+const int kMaxUtf8Kernels = 3;
+
+struct Utf8KernelTable {
+  __utf8_kernel kernels[kMaxUtf8Kernels];
+  size_t count;
+
+  Utf8KernelTable() : count(0) {
+#if defined(ZOSLIB_CONVERT_ZVECTOR)
+#if defined(__MVS__)
+    if (__is_vxf_available())
+#endif
+      add("zvector", utf8_validate_vector);
+#elif defined(ZOSLIB_CONVERT_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+      add("ssse3", utf8_validate_vector);
+#elif defined(ZOSLIB_CONVERT_NEON)
+    add("neon", utf8_validate_vector);
+#endif
+    add("scalar", utf8_validate_scalar);
+    add("scanner", utf8_validate_scanner);
+  }
+
+  void add(const char *name, __utf8_kernel_fn fn) {
+    kernels[count].name = name;
+    kernels[count].validate = fn;
+    ++count;
+  }
+};
+
+const Utf8KernelTable &utf8_kernel_table() {
+  static const Utf8KernelTable table;
+  return table;
+}
+
+} // namespace
+
+extern "C" {
+
+const struct __convert_kernel *__convert_kernels(size_t *count) {
+  const KernelTable &table = kernel_table();
+  if (count)
+    *count = table.count;
+  return table.kernels;
+}
+
+const struct __convert_kernel *__convert_kernel_selected(void) {
+  const KernelTable &table = kernel_table();
+  return &table.kernels[table.selected];
+}
+
+void *__convert_table(const unsigned char *table, void *dst, size_t size,
+                      const void *src) {
+  // Selected once; after that a conversion is one indirect call.
+  static const __convert_kernel_fn fn = __convert_kernel_selected()->convert;
+  return fn(table, dst, size, src);
+}
+
+const struct __utf8_kernel *__utf8_kernels(size_t *count) {
+  const Utf8KernelTable &table = utf8_kernel_table();
+  if (count)
+    *count = table.count;
+  return table.kernels;
+}
+
+int __utf8_validate(const void *src, size_t size, char *errmsg,
+                    size_t errmsg_size) {
+  return __utf8_validate_at(src, size, 0, 1, errmsg, errmsg_size);
+}
+
+int __utf8_validate_at(const void *src, size_t size, size_t offset, int line,
+                       char *errmsg, size_t errmsg_size) {
+  static const __utf8_kernel_fn fn = utf8_kernel_table().kernels[0].validate;
+  const unsigned char *str = (const unsigned char *)src;
+  const unsigned char *nul = (const unsigned char *)memchr(str, 0, size);
+  if (fn(str, nul ? nul - str : size))
+    return 0;
+  return utf8_scan(str, size, offset, line, errmsg, errmsg_size);
+}
+
+} // extern "C"
@@ -8,6 +8,7 @@
 
 #define _AE_BIMODAL 1
 #include "zos-base.h"
+#include "zos-memlog.h"
 
 #include <_Ccsid.h>
 #include <errno.h>
@@ -18,23 +19,70 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/inotify.h>
 #include <sys/file.h>
+#include <time.h>
 #include <utmpx.h>
 
+#include <atomic>
+
 namespace {
 const char MEMLOG_LEVEL_WARNING = '1';
 const char MEMLOG_LEVEL_ALL = '2';
 
 char __gMemoryUsageLogFile[PATH_MAX] = "";
 size_t __gLogMemoryInc = 0u;
+// As given by __MEMORY_EVENT_LOG_FILE; %PID% and %PPID% are replaced when the
+// file is opened, which a forked child does again.
+char __gMemoryEventLogFile[PATH_MAX] = "";
+bool __gLogMemoryEvents = false;
+FILE *fp_memevents = nullptr;
+pthread_mutex_t memevents_open_lock = PTHREAD_MUTEX_INITIALIZER;
+struct timeval memevents_start;
+// The sampler thread started for __MEMORY_SAMPLE_FILE appends to
+// fp_memsamples until memsamples_gen changes, which tells it to stop.
+FILE *fp_memsamples = nullptr;
+unsigned int memsamples_gen = 0;
+unsigned int memsamples_interval = 1000; // milliseconds
+pthread_mutex_t memsamples_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t memsamples_once = PTHREAD_ONCE_INIT;
 bool __gLogMemoryUsage = false;
 bool __gLogMemoryAll = false;
 bool __gLogMemoryWarning = false;
 bool __gLogMemoryShowPid = true;
 FILE *fp_memprintf = nullptr;
+
+// __memprintf() formats each message on the calling thread and appends it to
+// a ring buffer owned by that thread, without taking any lock. A background
+// thread drains all the rings to the log file, so the allocator doesn't wait
+// for file I/O. A message that doesn't fit in its ring is dropped and counted,
+// and the drops are reported in the log. The records of the binary event log
+// go through the same rings, flagged in their length.
+const size_t kMemLogRingSize = 256 * 1024; // a power of 2
+const unsigned int kMemLogDrainMillis = 20;
+const unsigned int kMemLogEventFlag = 0x80000000u;
+
+struct __memlog_ring {
+  std::atomic<size_t> head; // bytes ever written, updated by the owner
+  std::atomic<size_t> tail; // bytes ever drained, updated by the drainer
+  std::atomic<size_t> dropped;
+  std::atomic<size_t> dropped_events;
+  std::atomic<bool> in_use; // owned by a live thread
+  __memlog_ring *next;      // rings are never freed, only reused
+  char data[kMemLogRingSize];
+};
+
+std::atomic<__memlog_ring *> memlog_rings(nullptr);
+pthread_key_t memlog_key;
+pthread_once_t memlog_once = PTHREAD_ONCE_INIT;
+// Held while draining, so each ring has a single consumer.
+pthread_mutex_t memlog_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t memlog_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t memlog_wait_cond = PTHREAD_COND_INITIALIZER;
+std::atomic<bool> memlog_drainer_running(false);
 }
 
 #ifdef __cplusplus
@@ -91,9 +139,7 @@ int __console_printf(const char *fmt, ...) {
   va_copy(ap1, ap);
   va_copy(ap2, ap);
   int bytes;
-  int ccsid;
-  int am;
-  strlen_ae((const unsigned char *)fmt, &ccsid, strlen(fmt) + 1, &am);
+  int ccsid = __classify_ae((const unsigned char *)fmt, strlen(fmt) + 1, NULL);
   int mode;
   if (ccsid == 819) {
     mode = __ae_thread_swapmode(__AE_ASCII_MODE);
@@ -122,9 +168,7 @@ int __console_printf(const char *fmt, ...) {
 }
 
 int vdprintf(int fd, const char *fmt, va_list ap) {
-  int ccsid;
-  int am;
-  strlen_ae((const unsigned char *)fmt, &ccsid, strlen(fmt) + 1, &am);
+  int ccsid = __classify_ae((const unsigned char *)fmt, strlen(fmt) + 1, NULL);
   int mode;
   int len;
   int bytes;
@@ -160,9 +204,7 @@ int dprintf(int fd, const char *fmt, ...) {
   va_copy(ap1, ap);
   va_copy(ap2, ap);
   int bytes;
-  int ccsid;
-  int am;
-  strlen_ae((const unsigned char *)fmt, &ccsid, strlen(fmt) + 1, &am);
+  int ccsid = __classify_ae((const unsigned char *)fmt, strlen(fmt) + 1, NULL);
   int mode;
   if (ccsid == 819) {
     mode = __ae_thread_swapmode(__AE_ASCII_MODE);
@@ -753,12 +795,305 @@ int __getfdccsid(int fd) {
 }
 
 int __getLogMemoryFileNo() {
-  static int fn = fileno(fp_memprintf);
-  return fn;
+  // Callers write to the file directly, so put out what's buffered first.
+  __memprintf_flush();
+  return fp_memprintf ? fileno(fp_memprintf) : -1;
 }
 
 // Defined in zos.cc, no need to expose it:
 extern void __setLogMemoryUsage(bool value);
+extern bool __zoslib_terminated;
+
+static void memlog_ring_release(void *ring) {
+  ((__memlog_ring *)ring)->in_use.store(false, std::memory_order_release);
+}
+
+static void memlog_lock_for_fork() { pthread_mutex_lock(&memlog_drain_lock); }
+static void memlog_unlock_after_fork() {
+  pthread_mutex_unlock(&memlog_drain_lock);
+}
+static void memlog_child_after_fork() {
+  // The parent writes out what was buffered before the fork, and only the
+  // forking thread is copied into the child, so the rings of the other
+  // threads are free to be reused.
+  __memlog_ring *mine = (__memlog_ring *)pthread_getspecific(memlog_key);
+  for (__memlog_ring *r = memlog_rings.load(std::memory_order_relaxed); r;
+       r = r->next) {
+    r->tail.store(r->head.load(std::memory_order_relaxed),
+                  std::memory_order_relaxed);
+    r->dropped = r->dropped_events = 0u;
+    r->in_use = r == mine;
+  }
+  // Start an event log of the child's own, under its own name if the name
+  // has %PID% in it.
+  if (fp_memevents) {
+    fclose(fp_memevents);
+    fp_memevents = nullptr;
+  }
+  pthread_mutex_unlock(&memlog_drain_lock);
+  // The drainer thread isn't copied into the child; restart it on demand.
+  memlog_drainer_running = false;
+}
+
+static void memlog_init() {
+  pthread_key_create(&memlog_key, memlog_ring_release);
+  pthread_atfork(memlog_lock_for_fork, memlog_unlock_after_fork,
+                 memlog_child_after_fork);
+}
+
+static void memlog_copy_out(const __memlog_ring *r, size_t pos, void *out,
+                            size_t len) {
+  size_t off = pos & (kMemLogRingSize - 1);
+  size_t n = kMemLogRingSize - off < len ? kMemLogRingSize - off : len;
+  memcpy(out, r->data + off, n);
+  memcpy((char *)out + n, r->data, len - n);
+}
+
+static void memlog_copy_in(__memlog_ring *r, size_t pos, const void *in,
+                           size_t len) {
+  size_t off = pos & (kMemLogRingSize - 1);
+  size_t n = kMemLogRingSize - off < len ? kMemLogRingSize - off : len;
+  memcpy(r->data + off, in, n);
+  memcpy(r->data, (const char *)in + n, len - n);
+}
+
+static void memlog_fill_event(zoslib_memlog_event *ev, int op, uint64_t addr,
+                              uint64_t size, uint32_t stack) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  ev->time = (tv.tv_sec - memevents_start.tv_sec) * 1000000LL +
+             (tv.tv_usec - memevents_start.tv_usec);
+  ev->addr = addr;
+  ev->size = size;
+  ev->thread = gettid();
+  ev->op = op;
+  ev->reserved = 0;
+  ev->stack = stack;
+  ev->pid = getpid();
+}
+
+// Writes every message buffered so far to the log files, and returns true if
+// there were any.
+static bool memlog_drain() {
+  pthread_mutex_lock(&memlog_drain_lock);
+  bool wrote = false;
+  // The event log is unbuffered and written in batches of whole events, so
+  // each batch is appended in a single write even when other processes
+  // append to the same file.
+  static char events[64 * 1024];
+  size_t nevents = 0;
+  for (__memlog_ring *r = memlog_rings.load(std::memory_order_acquire); r;
+       r = r->next) {
+    size_t tail = r->tail.load(std::memory_order_relaxed);
+    size_t head = r->head.load(std::memory_order_acquire);
+    while (tail != head) {
+      char buf[PATH_MAX * 2 + 64];
+      unsigned int len;
+      memlog_copy_out(r, tail, &len, sizeof(len));
+      if (len & kMemLogEventFlag) {
+        len &= ~kMemLogEventFlag;
+        if (nevents + len > sizeof(events)) {
+          if (fp_memevents)
+            fwrite(events, 1, nevents, fp_memevents);
+          nevents = 0;
+        }
+        memlog_copy_out(r, tail + sizeof(len), events + nevents, len);
+        nevents += len;
+      } else {
+        memlog_copy_out(r, tail + sizeof(len), buf, len);
+        if (fp_memprintf)
+          fwrite(buf, 1, len, fp_memprintf);
+      }
+      tail += sizeof(len) + len;
+      wrote = true;
+    }
+    r->tail.store(tail, std::memory_order_release);
+    size_t dropped = r->dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped && fp_memprintf) {
+      fprintf(fp_memprintf, "p=%d WARNING: %zu memory log messages were " \
+              "dropped because the log buffer was full\n", getpid(), dropped);
+      wrote = true;
+    }
+    dropped = r->dropped_events.exchange(0, std::memory_order_relaxed);
+    if (dropped) {
+      if (nevents + sizeof(zoslib_memlog_event) > sizeof(events)) {
+        if (fp_memevents)
+          fwrite(events, 1, nevents, fp_memevents);
+        nevents = 0;
+      }
+      memlog_fill_event((zoslib_memlog_event *)(events + nevents),
+                        ZOSLIB_MEMLOG_DROPPED, 0, dropped, 0);
+      nevents += sizeof(zoslib_memlog_event);
+      wrote = true;
+    }
+  }
+  // Messages and events buffered before their log was closed by
+  // update_memlogging() or update_memlogging_events() are dropped.
+  if (nevents && fp_memevents)
+    fwrite(events, 1, nevents, fp_memevents);
+  if (wrote && fp_memprintf)
+    fflush(fp_memprintf);
+  pthread_mutex_unlock(&memlog_drain_lock);
+  return wrote;
+}
+
+static void *memlog_drainer(void *) {
+  while (!__zoslib_terminated) {
+    // Keep going while there's something to write, then wait a little.
+    if (memlog_drain())
+      continue;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct timespec ts;
+    ts.tv_sec = tv.tv_sec;
+    ts.tv_nsec = tv.tv_usec * 1000L + kMemLogDrainMillis * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec += 1;
+      ts.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&memlog_wait_lock);
+    pthread_cond_timedwait(&memlog_wait_cond, &memlog_wait_lock, &ts);
+    pthread_mutex_unlock(&memlog_wait_lock);
+  }
+  return nullptr;
+}
+
+static __memlog_ring *memlog_get_ring() {
+  pthread_once(&memlog_once, memlog_init);
+  __memlog_ring *r = (__memlog_ring *)pthread_getspecific(memlog_key);
+  if (r)
+    return r;
+  // Reuse the ring of a thread that has ended, if any.
+  for (r = memlog_rings.load(std::memory_order_acquire); r; r = r->next) {
+    bool expected = false;
+    if (r->in_use.compare_exchange_strong(expected, true,
+                                          std::memory_order_acquire))
+      break;
+  }
+  if (!r) {
+    r = (__memlog_ring *)malloc(sizeof(__memlog_ring));
+    if (!r)
+      return nullptr;
+    r->head = r->tail = r->dropped = r->dropped_events = 0u;
+    r->in_use = true;
+    r->next = memlog_rings.load(std::memory_order_relaxed);
+    while (!memlog_rings.compare_exchange_weak(r->next, r,
+                                               std::memory_order_release))
+      ;
+  }
+  pthread_setspecific(memlog_key, r);
+  return r;
+}
+
+static void memlog_start_drainer() {
+  bool expected = false;
+  if (memlog_drainer_running.load(std::memory_order_relaxed) ||
+      !memlog_drainer_running.compare_exchange_strong(expected, true))
+    return;
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, memlog_drainer, NULL) == 0)
+    pthread_detach(tid);
+  else
+    memlog_drainer_running = false;
+}
+
+void __memprintf_flush() {
+  if (fp_memprintf || fp_memevents)
+    memlog_drain();
+}
+
+// Appends a record of len bytes to the ring of the calling thread (for the
+// event log if event is true), or writes it directly once the process is
+// terminating.
+static void memlog_put(const void *data, unsigned int len, bool event) {
+  FILE *fp = event ? fp_memevents : fp_memprintf;
+  // Once the process is terminating, the drainer may no longer run, so
+  // write directly.
+  __memlog_ring *r = __zoslib_terminated ? nullptr : memlog_get_ring();
+  if (!r) {
+    fwrite(data, 1, len, fp);
+    if (fp != stderr)
+      fflush(fp);
+    return;
+  }
+  unsigned int tagged = event ? len | kMemLogEventFlag : len;
+  size_t head = r->head.load(std::memory_order_relaxed);
+  size_t used = head - r->tail.load(std::memory_order_acquire);
+  // The caller may be allocating, or hold the lock of the profiler's
+  // stacks, so it never drains the rings itself: a record that doesn't fit
+  // is dropped, and the events dropped are reported in the event log.
+  if (kMemLogRingSize - used < sizeof(len) + len) {
+    (event ? r->dropped_events : r->dropped)
+        .fetch_add(1, std::memory_order_relaxed);
+  } else {
+    memlog_copy_in(r, head, &tagged, sizeof(tagged));
+    memlog_copy_in(r, head + sizeof(tagged), data, len);
+    r->head.store(head + sizeof(tagged) + len, std::memory_order_release);
+    used += sizeof(tagged) + len;
+  }
+  memlog_start_drainer();
+  // Wake the drainer early when the ring is getting full.
+  if (used > kMemLogRingSize / 2)
+    pthread_cond_signal(&memlog_wait_cond);
+}
+
+static void getMemUsageLogFilename(char* outName, const char *nameInEnv,
+                                   size_t maxlen, bool *has_pid = nullptr);
+
+// Opens the event log and writes its header, the first time an event is
+// logged; returns false if it can't be opened.
+static bool memlog_open_events() {
+  if (fp_memevents)
+    return true;
+  pthread_mutex_lock(&memevents_open_lock);
+  if (!fp_memevents && __gLogMemoryEvents) {
+    char fname[PATH_MAX];
+    getMemUsageLogFilename(fname, __gMemoryEventLogFile, sizeof(fname));
+    FILE *fp = fopen(fname, "ab");
+    if (fp) {
+      setvbuf(fp, NULL, _IONBF, 0);
+      zoslib_memlog_header h;
+      static const unsigned char magic[] = ZOSLIB_MEMLOG_MAGIC;
+      memcpy(h.magic, magic, sizeof(h.magic));
+      h.byte_order = ZOSLIB_MEMLOG_BYTE_ORDER;
+      h.version = ZOSLIB_MEMLOG_VERSION;
+      h.pid = getpid();
+      h.ppid = getppid();
+      gettimeofday(&memevents_start, NULL);
+      h.start_time = memevents_start.tv_sec * 1000000ULL +
+                     memevents_start.tv_usec;
+      fwrite(&h, 1, sizeof(h), fp);
+      fp_memevents = fp;
+    } else {
+      perror(fname);
+      __gLogMemoryEvents = false;
+    }
+  }
+  pthread_mutex_unlock(&memevents_open_lock);
+  return fp_memevents != nullptr;
+}
+
+void __memlog_event(int op, const void *addr, size_t size,
+                    unsigned int stack) {
+  if (!__doLogMemoryEvents() || !memlog_open_events())
+    return;
+  zoslib_memlog_event ev;
+  memlog_fill_event(&ev, op, (uintptr_t)addr, size, stack);
+  memlog_put(&ev, sizeof(ev), true);
+}
+
+void __memlog_stack(unsigned int id, const char *stack) {
+  if (!__doLogMemoryEvents() || !memlog_open_events())
+    return;
+  char buf[sizeof(zoslib_memlog_event) + ZOSLIB_MEMLOG_MAX_STACK];
+  size_t len = strlen(stack);
+  if (len > ZOSLIB_MEMLOG_MAX_STACK)
+    len = ZOSLIB_MEMLOG_MAX_STACK;
+  memlog_fill_event((zoslib_memlog_event *)buf, ZOSLIB_MEMLOG_STACK, id, len,
+                    0);
+  memcpy(buf + sizeof(zoslib_memlog_event), stack, len);
+  memlog_put(buf, sizeof(zoslib_memlog_event) + len, true);
+}
 
 void __memprintf(const char *format, ...) {
   if (!__doLogMemoryUsage())
@@ -767,12 +1102,11 @@ void __memprintf(const char *format, ...) {
   va_list args;
   va_start(args, format);
 
-  static const char *fname = __getMemoryUsageLogFile();
-  static bool isstderr = !strcmp(fname, "stderr");
-  static bool isstdout = !strcmp(fname, "stdout");
+  // Closed by update_memlogging() when the file changes.
+  const char *fname = __getMemoryUsageLogFile();
   if (!fp_memprintf) {
-    fp_memprintf = isstderr ? stderr : \
-                   isstdout ? stdout : \
+    fp_memprintf = !strcmp(fname, "stderr") ? stderr : \
+                   !strcmp(fname, "stdout") ? stdout : \
                    fopen(fname, "a+");
   }
   if (!fp_memprintf) {
@@ -781,12 +1115,14 @@ void __memprintf(const char *format, ...) {
     __setLogMemoryUsage(false);
     return;
   }
-  char buf[PATH_MAX*2];
-  vsnprintf(buf, sizeof(buf), format, args);
+  char buf[PATH_MAX*2 + 64];
+  int n = snprintf(buf, sizeof(buf), "p=%d t=%d ", getpid(), gettid());
+  int m = vsnprintf(buf + n, sizeof(buf) - n, format, args);
   va_end(args);
-  fprintf(fp_memprintf, "p=%d t=%d %s", getpid(), gettid(), buf);
-  if (fp_memprintf != stderr)
-    fflush(fp_memprintf);
+  unsigned int len = m < 0 ? n : n + m;
+  if (len >= sizeof(buf))
+    len = sizeof(buf) - 1;
+  memlog_put(buf, len, false);
 }
 
 // C Library Overrides
@@ -992,12 +1328,13 @@ int __flock(int fd, int operation) {
 }
 
 static void getMemUsageLogFilename(char* outName, const char *nameInEnv,
-                                   size_t maxlen) {
+                                   size_t maxlen, bool *has_pid) {
   std::string str(nameInEnv);
   size_t s = str.find("%PID%");
   if (s != std::string::npos) {
     str.replace(s, 5, std::to_string(getpid()));
-    __gLogMemoryShowPid = false;
+    if (has_pid)
+      *has_pid = true;
   }
   s = str.find("%PPID%");
   if (s != std::string::npos)
@@ -1010,11 +1347,25 @@ void update_memlogging(__zinit *zinit_ptr, const char *envar) {
     return;
   zoslib_config_t &config = zinit_ptr->config;
 
-  char *p;
-  if (envar)
-    getMemUsageLogFilename(__gMemoryUsageLogFile, envar, sizeof(__gMemoryUsageLogFile));
-  else if (p = getenv(config.MEMORY_USAGE_LOG_FILE_ENVAR))
-    getMemUsageLogFilename(__gMemoryUsageLogFile, p, sizeof(__gMemoryUsageLogFile));
+  // Write out the messages so far, and open the log again for the next one.
+  if (fp_memprintf) {
+    memlog_drain();
+    pthread_mutex_lock(&memlog_drain_lock);
+    if (fp_memprintf != stderr && fp_memprintf != stdout)
+      fclose(fp_memprintf);
+    fp_memprintf = nullptr;
+    pthread_mutex_unlock(&memlog_drain_lock);
+  }
+
+  // envar is the name of the envar that changed, not the file name.
+  char *p = getenv(config.MEMORY_USAGE_LOG_FILE_ENVAR);
+  bool has_pid = false;
+  if (p)
+    getMemUsageLogFilename(__gMemoryUsageLogFile, p, sizeof(__gMemoryUsageLogFile), &has_pid);
+  else
+    *__gMemoryUsageLogFile = 0;
+  if (has_pid)
+    __gLogMemoryShowPid = false;
 
   if (*__gMemoryUsageLogFile)
     __gLogMemoryUsage = true;
@@ -1022,12 +1373,134 @@ void update_memlogging(__zinit *zinit_ptr, const char *envar) {
     __gLogMemoryUsage = false;
 }
 
+void update_memlogging_events(__zinit *zinit_ptr, const char *envar) {
+  if (!zinit_ptr)
+    return;
+  zoslib_config_t &config = zinit_ptr->config;
+
+  // Write out the events so far, and open the log again for the next event.
+  char *p = getenv(config.MEMORY_EVENT_LOG_FILE_ENVAR);
+  if (fp_memevents) {
+    memlog_drain();
+    pthread_mutex_lock(&memlog_drain_lock);
+    fclose(fp_memevents);
+    fp_memevents = nullptr;
+    pthread_mutex_unlock(&memlog_drain_lock);
+  }
+  pthread_mutex_lock(&memevents_open_lock);
+  if (p && *p) {
+    strncpy(__gMemoryEventLogFile, p, sizeof(__gMemoryEventLogFile) - 1);
+    __gLogMemoryEvents = true;
+  } else {
+    __gLogMemoryEvents = false;
+  }
+  pthread_mutex_unlock(&memevents_open_lock);
+}
+
+static void memsample_write(FILE *fp) {
+  struct zalloc_stats st;
+  if (__zalloc_stats(&st) != 0)
+    return;
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  fprintf(fp, "%llu,%d,%zu,%zu,%zu,%zu,%zu,%zu,%zu\n",
+          (unsigned long long)tv.tv_sec * 1000 + tv.tv_usec / 1000, getpid(),
+          st.current31, st.max31, st.current64, st.max64, st.segments,
+          st.live31, st.live64);
+  fflush(fp);
+}
+
+static void *memsample_thread(void *arg) {
+  unsigned int gen = (unsigned int)(unsigned long)arg;
+  for (;;) {
+    unsigned int interval;
+    pthread_mutex_lock(&memsamples_lock);
+    if (gen != memsamples_gen) {
+      pthread_mutex_unlock(&memsamples_lock);
+      return nullptr;
+    }
+    memsample_write(fp_memsamples);
+    interval = memsamples_interval;
+    pthread_mutex_unlock(&memsamples_lock);
+    struct timespec ts = {(time_t)(interval / 1000),
+                          (long)(interval % 1000) * 1000000L};
+    nanosleep(&ts, nullptr);
+  }
+}
+
+static void memsample_lock_for_fork() {
+  pthread_mutex_lock(&memsamples_lock);
+}
+static void memsample_unlock_after_fork() {
+  pthread_mutex_unlock(&memsamples_lock);
+}
+static void memsample_child_after_fork() {
+  // The sampler thread isn't copied into the child, which samples only once
+  // the envar is updated or after an exec.
+  if (fp_memsamples) {
+    fclose(fp_memsamples);
+    fp_memsamples = nullptr;
+  }
+  ++memsamples_gen;
+  pthread_mutex_unlock(&memsamples_lock);
+}
+static void memsample_init() {
+  pthread_atfork(memsample_lock_for_fork, memsample_unlock_after_fork,
+                 memsample_child_after_fork);
+}
+
+void update_memory_sampler(__zinit *zinit_ptr, const char *envar) {
+  if (!zinit_ptr)
+    return;
+  zoslib_config_t &config = zinit_ptr->config;
+  pthread_once(&memsamples_once, memsample_init);
+
+  char *p = getenv(config.MEMORY_SAMPLE_FILE_ENVAR);
+  char *pi = getenv(config.MEMORY_SAMPLE_INTERVAL_ENVAR);
+  int interval = pi ? atoi(pi) : 0;
+
+  // Stop the current sampler, if any, and start one with the new settings.
+  pthread_mutex_lock(&memsamples_lock);
+  ++memsamples_gen;
+  memsamples_interval = interval > 0 ? interval : 1000;
+  if (fp_memsamples) {
+    fclose(fp_memsamples);
+    fp_memsamples = nullptr;
+  }
+  if (p && *p) {
+    char fname[PATH_MAX];
+    getMemUsageLogFilename(fname, p, sizeof(fname));
+    fp_memsamples = fopen(fname, "a");
+    if (fp_memsamples == nullptr) {
+      perror(fname);
+    } else {
+      // The position of a stream opened for appending isn't defined until
+      // the first write, so ask the file how big it is.
+      struct stat st;
+      if (fstat(fileno(fp_memsamples), &st) == 0 && st.st_size == 0) {
+        fprintf(fp_memsamples, "time_ms,pid,current31,max31,current64,"
+                               "max64,segments,live31,live64\n");
+      }
+      pthread_t tid;
+      if (pthread_create(&tid, NULL, memsample_thread,
+                         (void *)(unsigned long)memsamples_gen) == 0) {
+        pthread_detach(tid);
+      } else {
+        fclose(fp_memsamples);
+        fp_memsamples = nullptr;
+      }
+    }
+  }
+  pthread_mutex_unlock(&memsamples_lock);
+}
+
 void update_memlogging_level(__zinit *zinit_ptr, const char *envar) {
   if (!zinit_ptr)
     return;
   zoslib_config_t &config = zinit_ptr->config;
 
   char *penv = getenv(config.MEMORY_USAGE_LOG_LEVEL_ENVAR);
+  __gLogMemoryAll = __gLogMemoryWarning = false;
   if (penv && __doLogMemoryUsage()) {
     // Errors and start/terminating messages are always displayed.
     if (*penv == MEMLOG_LEVEL_ALL)
@@ -1066,6 +1539,8 @@ char *__getMemoryUsageLogFile() { return __gMemoryUsageLogFile; }
 
 bool __doLogMemoryAll() { return __gLogMemoryAll; }
 
+bool __doLogMemoryEvents() { return __gLogMemoryEvents; }
+
 bool __doLogMemoryWarning() {
   return __gLogMemoryAll || __gLogMemoryWarning;
 }
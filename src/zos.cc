@@ -14,6 +14,7 @@
 #define __ZOS_CC
 #include "edcwccwi.h"
 #include "zos-getentropy.h"
+#include "zos-memlog.h"
 #include "zos.h"
 
 #include <_Ccsid.h>
@@ -27,6 +28,7 @@
 #include <fcntl.h>
 #include <iconv.h>
 #include <libgen.h>
+#include <limits.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
@@ -47,7 +49,9 @@
 #include <sys/eventfd.h>
 #include <sys/inotify.h>
 
+#include <atomic>
 #include <exception>
+#include <map>
 #include <mutex>
 #include <sstream>
 #include <unordered_map>
@@ -116,6 +120,8 @@ extern "C" void __set_ccsid_guess_buf_size(int nbytes);
 extern "C" void update_memlogging(__zinit *, const char *envar);
 extern "C" void update_memlogging_level(__zinit *, const char *envar);
 extern "C" void update_memlogging_inc(__zinit *, const char *envar);
+extern "C" void update_memlogging_events(__zinit *, const char *envar);
+extern "C" void update_memory_sampler(__zinit *, const char *envar);
 
 #ifndef max
 #define max(a, b) (((a) > (b)) ? (a) : (b))
@@ -452,6 +458,47 @@ extern "C" void __display_backtrace(int fd) {
   backtrace_symbols_fd(buffer, nptrs, fd);
 }
 
+// Returns the entry names of up to max_frames callers, outermost first and
+// separated by ';' (the folded-stack format), leaving out the innermost
+// frames up to the last one whose name starts with skip_prefix. The names
+// are resolved now, as backtrace() only records stack frame addresses.
+static std::string __folded_stack(int max_frames, const char *skip_prefix) {
+  __tf_parms_t tbck_parms;
+  char pu_name[256];
+  char entry_name[256];
+  char stmt_id[256];
+  _FEEDBACK fc;
+  std::vector<std::string> names;
+  int mode = __ae_thread_swapmode(__AE_ASCII_MODE);
+  init_tf_parms_t(&tbck_parms, pu_name, 256, entry_name, 256, stmt_id, 256);
+  while ((int)names.size() < max_frames && !tbck_parms.__tf_is_main) {
+    ____le_traceback_a(__TRACEBACK_FIELDS, &tbck_parms, &fc);
+    if (fc.tok_sev >= 2)
+      break;
+    rbracket_entry_name(entry_name, sizeof(entry_name));
+    names.push_back(entry_name[0] ? entry_name : "??");
+    tbck_parms.__tf_dsa_addr = tbck_parms.__tf_caller_dsa_addr;
+    tbck_parms.__tf_call_instruction = tbck_parms.__tf_caller_call_instruction;
+  }
+  __ae_thread_swapmode(mode);
+
+  size_t skip = 0;
+  size_t plen = strlen(skip_prefix);
+  while (skip < names.size() && names[skip].compare(0, plen, skip_prefix) != 0)
+    ++skip;
+  if (skip == names.size())
+    skip = 0;
+  while (skip < names.size() && names[skip].compare(0, plen, skip_prefix) == 0)
+    ++skip;
+  std::string folded;
+  for (size_t i = names.size(); i > skip; --i) {
+    if (!folded.empty())
+      folded += ';';
+    folded += names[i - 1];
+  }
+  return folded.empty() ? "??" : folded;
+}
+
 void __abend(int comp_code, unsigned reason_code, int flat_byte, void *plist) {
   unsigned long r15 = reason_code;
   unsigned long r1;
@@ -1114,8 +1161,19 @@ unsigned long getipttoken(void) {
          << 32;
 }
 
+// Fixed large frames that can back a segment (see __MEMORY_LARGE_FRAMES).
+static const size_t kLargeFrames1M = kMegaByte;
+static const size_t kLargeFrames2G = 2 * kGigaByte;
+
+// The first guard_segs segments of the memory object are guard area, which
+// has no frames and can't be referenced until it's converted by
+// __iarv64_changeguard(). If frame_size is kLargeFrames1M or kLargeFrames2G,
+// the object is backed by fixed frames of that size, and the request fails
+// if they're not available; otherwise it's backed by pageable 1MB frames if
+// the system has them, and 4K frames if not.
 static void *__iarv64_alloc(int segs, const char *token,
-                            long long *prc, long long *preason) {
+                            long long *prc, long long *preason,
+                            size_t guard_segs = 0, size_t frame_size = 0) {
   if (segs == 0) {
     // process gets killed if __iarv64(&parm,..) is called with parm.xsegments=0
     if (__doLogMemoryWarning()) {
@@ -1137,11 +1195,27 @@ static void *__iarv64_alloc(int segs, const char *token,
   parm.xdump = 32;
   parm.xusertkn = getipttoken();
   parm.xsadmp_no = 1;
-  parm.xpageframesize_pageable1meg = 1;
+  if (frame_size == kLargeFrames2G) {
+    // 2G frames are obtained in 2G units rather than in segments.
+    parm.xsegments = 0;
+    parm.keyused_units = 1;
+    parm.xunits = (unsigned long long)segs * kMegaByte / kLargeFrames2G;
+    parm.xunitsize_2g = 1;
+    parm.xpageframesize_2g = 1;
+    parm.xtype_fixed = 1;
+  } else if (frame_size == kLargeFrames1M) {
+    parm.xpageframesize_1meg = 1;
+  } else {
+    parm.xpageframesize_pageable1meg = 1;
+  }
   parm.xuse2gto64g_yes = 1;
   parm.xexecutable_yes = 1;
   parm.keyused_ttoken = 1;
   memcpy(&parm.xttoken, token, 16);
+  if (guard_segs) {
+    parm.keyused_guardsize64 = 1;
+    parm.xguardsize64 = guard_segs;
+  }
   *prc = __iarv64(&parm, preason);
   if (*prc == 0)
     return parm.xorigin;
@@ -1163,6 +1237,43 @@ static long long __iarv64_free(void *ptr, const char *token,
   return __iarv64(&parm, preason);
 }
 
+// Releases the real frames backing the given segments without detaching
+// them; the pages read as zeros when next referenced.
+static long long __iarv64_discard(void *ptr, size_t segs, long long *preason) {
+  struct {
+    unsigned long long start;
+    unsigned long long pages; // number of 4K pages
+  } range __attribute__((__aligned__(16)));
+  range.start = (unsigned long long)ptr;
+  range.pages = segs * (kMegaByte / 4096);
+  struct iarv64parm parm __attribute__((__aligned__(16)));
+  memset(&parm, 0, sizeof(parm));
+  parm.xversion = 5;
+  parm.xrequest = 7; // DISCARDDATA, CLEAR=YES
+  parm.xranglist = &range;
+  parm.xnumrange = 1;
+  return __iarv64(&parm, preason);
+}
+
+// Converts the given segments from guard area to usable storage, or back to
+// guard area (which releases their frames).
+static long long __iarv64_changeguard(void *ptr, size_t segs, bool toguard,
+                                      long long *preason) {
+  struct iarv64parm parm __attribute__((__aligned__(16)));
+  memset(&parm, 0, sizeof(parm));
+  parm.xversion = 5;
+  parm.xrequest = 13; // CHANGEGUARD
+  if (toguard)
+    parm.xconvert_toguard = 1;
+  else
+    parm.xconvert_fromguard = 1;
+  parm.keyused_convertstart = 1;
+  parm.xconvertstart = (unsigned long long)ptr;
+  parm.keyused_convertsize64 = 1;
+  parm.xconvertsize64 = segs;
+  return __iarv64(&parm, preason);
+}
+
 #if !__USE_IARV64
 static void *__mo_alloc(int segs) {
   __mopl_t moparm;
@@ -1218,16 +1329,1215 @@ struct __hash_func {
 typedef std::unordered_map<key_type, value_type, __hash_func>::const_iterator
     mem_cursor_t;
 
+// Registry entries hold the size of the block, which for a segment is a
+// megabyte multiple, so the low bits of a segment's entry record whether it's
+// backed by fixed large frames.
+static const value_type kSegFrames1M = 1;
+static const value_type kSegFrames2G = 2;
+static const value_type kSegFramesMask = 3;
+
+// Size of a cache line on z, used to keep the registry shards and the memory
+// counters from sharing lines between CPUs.
+static const size_t kCacheLineSize = 256;
+
+// Released segments of up to kSegPoolBuckets megabytes are kept in a pool of
+// at most __MEMORY_SEGMENT_POOL_MAX megabytes (default kSegPoolDefaultMax),
+// and are detached once they've been unused for kSegPoolIdleSecs.
+static const int kSegPoolBuckets = 16;
+static const int kSegPoolDefaultMax = 64;
+static const unsigned int kSegPoolIdleSecs = 2;
+
+#if __USE_IARV64
+static void *__seg_pool_trimmer(void *);
+#endif
+
+// While __MEMORY_PRESSURE_FRAMES or __MEMORY_PRESSURE_LIMIT is set, the
+// available frames and the memory allocated by __zalloc() are sampled every
+// kPressureIntervalSecs; under pressure, the allocator's caches are trimmed,
+// and the callbacks registered with __zalloc_pressure_register() are called
+// each time the state changes.
+static const unsigned int kPressureIntervalSecs = 1;
+static const int kMaxPressureCallbacks = 16;
+
+static void *__memory_pressure_monitor(void *);
+
+// Watermarks registered with __zalloc_watermark_register(); a level is
+// reported again once usage has fallen 1/kWatermarkRearmDiv of it below.
+static const int kMaxWatermarks = 16;
+static const size_t kWatermarkRearmDiv = 8;
+static void __tcache_thread_exit(void *);
+
+// Small below-the-bar blocks are carved out of kSlabSpanSize spans, each
+// dedicated to one size class, instead of getting their own __malloc31 block.
+// Spans are aligned on their size and obtained kSlabSpansPerChunk at a time,
+// so the span holding any below-the-bar address is found by indexing a table
+// with the address, and no per-block registry entry is needed.
+static const size_t kSlabSpanShift = 16;
+static const size_t kSlabSpanSize = 1UL << kSlabSpanShift;
+static const int kSlabSpansPerChunk = 16;
+static const size_t kSlabMaxSize = 16 * 1024;
+static const size_t kSlabClassSizes[] = {16,   32,   64,   128,  256,
+                                         512,  1024, 2048, 4096, 8192,
+                                         12288, 16384};
+static const int kSlabNumClasses =
+    sizeof(kSlabClassSizes) / sizeof(kSlabClassSizes[0]);
+static const unsigned int kSlabNoClass = ~0u;
+// Blocks in a span of the smallest class.
+static const size_t kSlabMaxBlocks = kSlabSpanSize / 16;
+
+// Each thread keeps up to kTCacheClassBytes of released slab blocks of each
+// size class (at least kTCacheMinBlocks and at most kTCacheMaxBlocks of them)
+// and hands them out again without taking the lock of the class. An empty
+// cache is refilled, and a full one drained, by half of its blocks in one
+// batch; everything goes back to the slabs when the thread ends, or at its
+// next call after the caches are trimmed.
+static const size_t kTCacheClassBytes = 64 * 1024;
+static const int kTCacheMinBlocks = 4;
+static const int kTCacheMaxBlocks = 64;
+
+class __SlabAllocator {
+  struct __chunk;
+
+  struct __span {
+    __span *next;
+    __span *prev;
+    __chunk *chunk;
+    char *base;
+    void *free_list;    // released blocks, linked through their first word
+    unsigned int cls;   // index into kSlabClassSizes, or kSlabNoClass
+    unsigned int nobjs;
+    unsigned int nused;
+    unsigned int nbump; // blocks nbump..nobjs-1 have never been handed out
+    // A bit per block, set from when __zalloc() returns it until __zfree()
+    // releases it; a block in a thread cache isn't allocated.
+    std::atomic<unsigned long> allocated[kSlabMaxBlocks / 64];
+  };
+
+  struct __chunk {
+    void *mem; // as returned by __malloc31
+    int nfree;
+    __span spans[kSlabSpansPerChunk];
+  };
+
+  struct __class {
+    std::mutex lock;
+    __span *partial; // spans of this class with at least one free block
+  } __attribute__((aligned(kCacheLineSize)));
+
+  __class classes[kSlabNumClasses];
+  // Indexed by (below-the-bar address >> kSlabSpanShift).
+  std::atomic<__span *> *span_map;
+  std::mutex span_lock;
+  __span *free_spans; // guarded by span_lock
+  int nfree_spans;
+
+  static void unlink(__span **head, __span *sp) {
+    if (sp->prev)
+      sp->prev->next = sp->next;
+    else
+      *head = sp->next;
+    if (sp->next)
+      sp->next->prev = sp->prev;
+    sp->next = sp->prev = nullptr;
+  }
+  static void push(__span **head, __span *sp) {
+    sp->prev = nullptr;
+    sp->next = *head;
+    if (*head)
+      (*head)->prev = sp;
+    *head = sp;
+  }
+
+  __span *get_span() {
+    std::lock_guard<std::mutex> guard(span_lock);
+    if (!free_spans) {
+      __chunk *c = (__chunk *)calloc(1, sizeof(__chunk));
+      if (!c)
+        return nullptr;
+      c->mem = __malloc31(kSlabSpansPerChunk * kSlabSpanSize +
+                          kSlabSpanSize - 8);
+      if (!c->mem) {
+        free(c);
+        return nullptr;
+      }
+      char *base = (char *)__round_up((size_t)c->mem, kSlabSpanSize);
+      for (int i = 0; i < kSlabSpansPerChunk; ++i) {
+        __span *sp = &c->spans[i];
+        sp->chunk = c;
+        sp->base = base + i * kSlabSpanSize;
+        sp->cls = kSlabNoClass;
+        span_map[(unsigned long)sp->base >> kSlabSpanShift].store(
+            sp, std::memory_order_release);
+        push(&free_spans, sp);
+      }
+      c->nfree = kSlabSpansPerChunk;
+      nfree_spans += kSlabSpansPerChunk;
+    }
+    __span *sp = free_spans;
+    unlink(&free_spans, sp);
+    --sp->chunk->nfree;
+    --nfree_spans;
+    return sp;
+  }
+
+  void put_span(__span *sp) {
+    __chunk *release = nullptr;
+    {
+      std::lock_guard<std::mutex> guard(span_lock);
+      sp->cls = kSlabNoClass;
+      push(&free_spans, sp);
+      ++nfree_spans;
+      __chunk *c = sp->chunk;
+      // Return a chunk to the heap once all of its spans are unused, unless
+      // it's the only one holding free spans.
+      if (++c->nfree == kSlabSpansPerChunk &&
+          nfree_spans > kSlabSpansPerChunk) {
+        for (int i = 0; i < kSlabSpansPerChunk; ++i) {
+          unlink(&free_spans, &c->spans[i]);
+          span_map[(unsigned long)c->spans[i].base >> kSlabSpanShift].store(
+              nullptr, std::memory_order_relaxed);
+        }
+        nfree_spans -= kSlabSpansPerChunk;
+        release = c;
+      }
+    }
+    if (release) {
+      free(release->mem);
+      free(release);
+    }
+  }
+
+  // Takes a block of class cls, with the lock of the class held.
+  void *alloc_locked(__class &c, int cls) {
+    __span *sp = c.partial;
+    if (!sp) {
+      sp = get_span();
+      if (!sp)
+        return nullptr;
+      sp->cls = cls;
+      sp->nobjs = kSlabSpanSize / kSlabClassSizes[cls];
+      sp->nused = sp->nbump = 0;
+      sp->free_list = nullptr;
+      push(&c.partial, sp);
+    }
+    void *p;
+    if (sp->free_list) {
+      p = sp->free_list;
+      sp->free_list = *(void **)p;
+    } else {
+      p = sp->base + sp->nbump++ * kSlabClassSizes[cls];
+    }
+    if (++sp->nused == sp->nobjs)
+      unlink(&c.partial, sp);
+    return p;
+  }
+
+  // Returns ptr to its span, with the lock of the class held, and returns
+  // true if the span is now unused and is to be released with put_span().
+  static bool dealloc_locked(__class &c, __span *sp, const void *ptr) {
+    *(void **)ptr = sp->free_list;
+    sp->free_list = (void *)ptr;
+    if (sp->nused-- == sp->nobjs)
+      push(&c.partial, sp);
+    // Keep the last partially used span of a class even when it empties,
+    // so a single alloc/free loop doesn't keep getting and putting a span.
+    if (sp->nused == 0 && (sp != c.partial || sp->next)) {
+      unlink(&c.partial, sp);
+      return true;
+    }
+    return false;
+  }
+
+  __span *span_of(const void *ptr) const {
+    unsigned long k = (unsigned long)ptr;
+    if (0 != (k & 0xffffffff80000000UL))
+      return nullptr;
+    return span_map[k >> kSlabSpanShift].load(std::memory_order_acquire);
+  }
+
+public:
+  // Returns every chunk whose spans are all unused to the heap, including the
+  // one put_span() keeps and the empty spans kept by dealloc(), and returns
+  // the number of bytes released.
+  size_t trim() {
+    for (int i = 0; i < kSlabNumClasses; ++i) {
+      __class &c = classes[i];
+      __span *empty = nullptr;
+      {
+        std::lock_guard<std::mutex> guard(c.lock);
+        if (c.partial && c.partial->nused == 0 && !c.partial->next) {
+          empty = c.partial;
+          unlink(&c.partial, empty);
+        }
+      }
+      if (empty)
+        put_span(empty);
+    }
+    std::vector<__chunk *> release;
+    {
+      std::lock_guard<std::mutex> guard(span_lock);
+      for (__span *sp = free_spans; sp; sp = sp->next) {
+        __chunk *c = sp->chunk;
+        if (c->nfree == kSlabSpansPerChunk && sp == &c->spans[0])
+          release.push_back(c);
+      }
+      for (__chunk *c : release) {
+        for (int i = 0; i < kSlabSpansPerChunk; ++i) {
+          unlink(&free_spans, &c->spans[i]);
+          span_map[(unsigned long)c->spans[i].base >> kSlabSpanShift].store(
+              nullptr, std::memory_order_relaxed);
+        }
+        nfree_spans -= kSlabSpansPerChunk;
+      }
+    }
+    for (__chunk *c : release) {
+      free(c->mem);
+      free(c);
+    }
+    return release.size() * kSlabSpansPerChunk * kSlabSpanSize;
+  }
+
+  __SlabAllocator() : free_spans(nullptr), nfree_spans(0) {
+    for (int i = 0; i < kSlabNumClasses; ++i)
+      classes[i].partial = nullptr;
+    span_map = new std::atomic<__span *>[(2UL * kGigaByte) >> kSlabSpanShift]();
+  }
+
+  // Returns the size class for a request, or -1 if it isn't served by slabs.
+  static int size_class(size_t len, size_t alignment) {
+    if (len > kSlabMaxSize || alignment > PAGE_SIZE)
+      return -1;
+    // Spans are page aligned, so a block size that's a multiple of the
+    // alignment keeps every block in the span aligned.
+    for (int i = 0; i < kSlabNumClasses; ++i) {
+      if (kSlabClassSizes[i] >= len &&
+          (alignment == 0 || kSlabClassSizes[i] % alignment == 0))
+        return i;
+    }
+    return -1;
+  }
+
+  void *alloc(int cls) {
+    __class &c = classes[cls];
+    std::lock_guard<std::mutex> guard(c.lock);
+    return alloc_locked(c, cls);
+  }
+
+  // Takes up to n blocks of class cls under a single lock, and returns how
+  // many were stored in ptrs.
+  int alloc_batch(int cls, void **ptrs, int n) {
+    __class &c = classes[cls];
+    std::lock_guard<std::mutex> guard(c.lock);
+    int i = 0;
+    while (i < n && (ptrs[i] = alloc_locked(c, cls)) != nullptr)
+      ++i;
+    return i;
+  }
+
+  // Returns true if ptr is in the storage of a slab span.
+  bool contains(const void *ptr) const {
+    unsigned long k = (unsigned long)ptr;
+    return 0 == (k & 0xffffffff80000000UL) &&
+           span_map[k >> kSlabSpanShift].load(std::memory_order_relaxed);
+  }
+
+  // Sets *base and *len to the block containing ptr and returns true, if
+  // ptr is in an allocated block.
+  bool find(const void *ptr, void **base, size_t *len) {
+    unsigned long k = (unsigned long)ptr;
+    if (0 != (k & 0xffffffff80000000UL))
+      return false;
+    __span *sp = span_map[k >> kSlabSpanShift].load(std::memory_order_acquire);
+    if (!sp)
+      return false;
+    unsigned int cls = sp->cls;
+    if (cls == kSlabNoClass)
+      return false;
+    size_t size = kSlabClassSizes[cls];
+    std::lock_guard<std::mutex> guard(classes[cls].lock);
+    size_t i = (k - (unsigned long)sp->base) / size;
+    if (sp->cls != cls || i >= sp->nbump ||
+        !(sp->allocated[i / 64].load(std::memory_order_relaxed) &
+          (1UL << (i % 64))))
+      return false;
+    *base = sp->base + i * size;
+    *len = size;
+    return true;
+  }
+
+  // Returns the size class of the block at ptr, or -1 if ptr isn't in a
+  // slab.
+  int block_class(const void *ptr) const {
+    __span *sp = span_of(ptr);
+    if (!sp || sp->cls == kSlabNoClass)
+      return -1;
+    return sp->cls;
+  }
+
+  // Marks the block at ptr, which is in a slab, as allocated.
+  void mark_allocated(const void *ptr) {
+    __span *sp = span_of(ptr);
+    size_t i = ((unsigned long)ptr - (unsigned long)sp->base) /
+               kSlabClassSizes[sp->cls];
+    sp->allocated[i / 64].fetch_or(1UL << (i % 64), std::memory_order_relaxed);
+  }
+
+  // Marks the block at ptr, which is in a slab, as no longer allocated, and
+  // returns false if it wasn't: it's been released already, or ptr isn't
+  // the start of a block.
+  bool mark_released(const void *ptr) {
+    __span *sp = span_of(ptr);
+    unsigned int cls = sp->cls;
+    if (cls == kSlabNoClass)
+      return false;
+    size_t off = (unsigned long)ptr - (unsigned long)sp->base;
+    if (off % kSlabClassSizes[cls])
+      return false;
+    size_t i = off / kSlabClassSizes[cls];
+    unsigned long bit = 1UL << (i % 64);
+    return (sp->allocated[i / 64].fetch_and(~bit, std::memory_order_relaxed) &
+            bit) != 0;
+  }
+
+  // Calls fn(addr, size) for each allocated block; only for exit time, as
+  // it takes no lock.
+  template <typename F> void for_each_allocated(F fn) const {
+    for (size_t k = 0; k < ((2UL * kGigaByte) >> kSlabSpanShift); ++k) {
+      __span *sp = span_map[k].load(std::memory_order_relaxed);
+      if (!sp || sp->cls == kSlabNoClass)
+        continue;
+      size_t size = kSlabClassSizes[sp->cls];
+      for (size_t i = 0; i < sp->nbump; ++i) {
+        if (sp->allocated[i / 64].load(std::memory_order_relaxed) &
+            (1UL << (i % 64)))
+          fn(sp->base + i * size, size);
+      }
+    }
+  }
+
+  // Returns the size of the released block, or 0 if ptr isn't in a slab.
+  size_t dealloc(const void *ptr) {
+    __span *sp = span_of(ptr);
+    if (!sp || sp->cls == kSlabNoClass)
+      return 0;
+    __class &c = classes[sp->cls];
+    size_t size = kSlabClassSizes[sp->cls];
+    bool release;
+    {
+      std::lock_guard<std::mutex> guard(c.lock);
+      release = dealloc_locked(c, sp, ptr);
+    }
+    if (release)
+      put_span(sp);
+    return size;
+  }
+
+  // Releases n (at most kTCacheMaxBlocks) blocks of class cls under a single
+  // lock.
+  void dealloc_batch(int cls, void *const *ptrs, int n) {
+    __class &c = classes[cls];
+    __span *release[kTCacheMaxBlocks];
+    int nrelease = 0;
+    {
+      std::lock_guard<std::mutex> guard(c.lock);
+      for (int i = 0; i < n; ++i) {
+        __span *sp = span_of(ptrs[i]);
+        if (dealloc_locked(c, sp, ptrs[i]))
+          release[nrelease++] = sp;
+      }
+    }
+    for (int i = 0; i < nrelease; ++i)
+      put_span(release[i]);
+  }
+};
+
+// When __malloc31 fails, requests of up to kSubSegMaxBlock bytes are carved
+// out of shared 1MB segments with a first-fit allocator, rather than each
+// taking a whole segment. The segment header is at its start, so the segment
+// owning a block is found by masking the block address, and a block address
+// is never megabyte aligned, which tells it apart from a whole segment.
+static const size_t kSubSegMaxBlock = 256 * 1024;
+static const size_t kSubSegHeaderSize = 256;
+static const size_t kSubSegGranule = 16;
+
+class __SegSubAllocator {
+  // Every block starts with a 16-byte header; a free block also holds its
+  // links in the free list of its segment.
+  struct __blk {
+    size_t prev_size; // 0 for the first block in the segment
+    size_t size;      // including the header; low bit set while in use
+    __blk *next_free;
+    __blk *prev_free;
+  };
+  static const size_t kBlkHeaderSize = 2 * sizeof(size_t);
+  static const size_t kMinBlock = kBlkHeaderSize + 2 * sizeof(__blk *);
+
+  struct __seg {
+    __seg *next;
+    __seg *prev;
+    __blk *free_list;
+    size_t free_bytes;
+    size_t nused;
+    char *clean; // the segment is known to be zero from here to its end
+  };
+
+  std::mutex lock;
+  __seg *segs;
+  std::unordered_map<key_type, __seg *, __hash_func> seg_map;
+
+  static size_t blk_size(const __blk *b) { return b->size & ~1UL; }
+  static bool blk_used(const __blk *b) { return b->size & 1UL; }
+  static char *seg_end(__seg *s) { return (char *)s + kMegaByte; }
+  static __blk *next_blk(__seg *s, __blk *b) {
+    char *n = (char *)b + blk_size(b);
+    return n < seg_end(s) ? (__blk *)n : nullptr;
+  }
+
+  static void push_free(__seg *s, __blk *b) {
+    b->prev_free = nullptr;
+    b->next_free = s->free_list;
+    if (s->free_list)
+      s->free_list->prev_free = b;
+    s->free_list = b;
+  }
+  static void unlink_free(__seg *s, __blk *b) {
+    if (b->prev_free)
+      b->prev_free->next_free = b->next_free;
+    else
+      s->free_list = b->next_free;
+    if (b->next_free)
+      b->next_free->prev_free = b->prev_free;
+  }
+  // Sets the size of b and the back link of the block after it.
+  static void set_size(__seg *s, __blk *b, size_t size, bool used) {
+    b->size = size | (used ? 1UL : 0UL);
+    __blk *n = next_blk(s, b);
+    if (n)
+      n->prev_size = size;
+  }
+
+  // On success, *dirty is set to the length of the block's leading part
+  // that may have been written before; the rest of the block is zero.
+  static void *alloc_in(__seg *s, size_t len, size_t alignment,
+                        size_t *dirty) {
+    size_t need = __round_up(len, kSubSegGranule) + kBlkHeaderSize;
+    if (s->free_bytes < need)
+      return nullptr;
+    for (__blk *b = s->free_list; b; b = b->next_free) {
+      size_t size = blk_size(b);
+      if (size < need)
+        continue;
+      // Place the block so that its user area is aligned, leaving any gap
+      // in front of it large enough to remain a free block of its own.
+      char *user = (char *)__round_up((size_t)b + kBlkHeaderSize, alignment);
+      size_t gap = user - kBlkHeaderSize - (char *)b;
+      while (gap != 0 && gap < kMinBlock) {
+        user += alignment;
+        gap += alignment;
+      }
+      if (gap + need > size)
+        continue;
+      __blk *ub = (__blk *)(user - kBlkHeaderSize);
+      if (gap) {
+        set_size(s, b, gap, false);
+        ub->prev_size = gap;
+        size -= gap;
+      } else {
+        unlink_free(s, b);
+      }
+      // Everything up to the end of the block, or to the end of the header
+      // and free-list links of a block split off after it, counts as written
+      // from now on.
+      char *written = (char *)ub + size;
+      if (size - need >= kMinBlock) {
+        __blk *tail = (__blk *)((char *)ub + need);
+        ub->size = need;
+        tail->prev_size = need;
+        set_size(s, tail, size - need, false);
+        push_free(s, tail);
+        written = (char *)tail + kMinBlock;
+      } else {
+        need = size;
+      }
+      set_size(s, ub, need, true);
+      s->free_bytes -= need;
+      ++s->nused;
+      *dirty = s->clean > user ? MIN((size_t)(s->clean - user), len) : 0;
+      if (written > s->clean)
+        s->clean = written;
+      return user;
+    }
+    return nullptr;
+  }
+
+  void add_seg(void *mem) {
+    __seg *s = (__seg *)mem;
+    s->prev = nullptr;
+    s->next = segs;
+    if (segs)
+      segs->prev = s;
+    segs = s;
+    __blk *b = (__blk *)((char *)mem + kSubSegHeaderSize);
+    b->prev_size = 0;
+    b->size = kMegaByte - kSubSegHeaderSize;
+    s->free_list = nullptr;
+    push_free(s, b);
+    s->free_bytes = b->size;
+    s->nused = 0;
+    s->clean = (char *)b + kMinBlock;
+    seg_map[(key_type)mem] = s;
+  }
+
+public:
+  __SegSubAllocator() : segs(nullptr) {}
+
+  // Returns true if a request is small enough to be sub-allocated.
+  static bool fits(size_t len, size_t alignment) {
+    return alignment <= PAGE_SIZE && len + alignment <= kSubSegMaxBlock;
+  }
+
+  // Allocates from new_seg, a fresh 1MB segment (which must be zero), if
+  // it isn't null, and otherwise from the first existing segment with room
+  // for the block. Only the first *dirty bytes of the block need zeroing.
+  void *alloc(size_t len, size_t alignment, void *new_seg, size_t *dirty) {
+    if (alignment < kSubSegGranule)
+      alignment = kSubSegGranule;
+    std::lock_guard<std::mutex> guard(lock);
+    if (new_seg) {
+      add_seg(new_seg);
+      return alloc_in(segs, len, alignment, dirty);
+    }
+    for (__seg *s = segs; s; s = s->next) {
+      void *p = alloc_in(s, len, alignment, dirty);
+      if (p)
+        return p;
+    }
+    return nullptr;
+  }
+
+  // Releases a block and returns its size, or 0 if ptr isn't a block. When
+  // this empties its segment, the segment is dropped and returned in *empty.
+  size_t dealloc(const void *ptr, void **empty) {
+    *empty = nullptr;
+    key_type base = (key_type)ptr & ~(kMegaByte - 1);
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = seg_map.find(base);
+    if (it == seg_map.end())
+      return 0;
+    __seg *s = it->second;
+    __blk *b = (__blk *)((char *)ptr - kBlkHeaderSize);
+    if ((char *)b < (char *)s + kSubSegHeaderSize || !blk_used(b))
+      return 0;
+    size_t size = blk_size(b);
+    s->free_bytes += size;
+    if (--s->nused == 0) {
+      if (s->prev)
+        s->prev->next = s->next;
+      else
+        segs = s->next;
+      if (s->next)
+        s->next->prev = s->prev;
+      seg_map.erase(it);
+      *empty = s;
+      return size;
+    }
+    // Coalesce with the free neighbours.
+    size_t merged = size;
+    __blk *n = next_blk(s, b);
+    if (n && !blk_used(n)) {
+      unlink_free(s, n);
+      merged += blk_size(n);
+    }
+    if (b->prev_size) {
+      __blk *p = (__blk *)((char *)b - b->prev_size);
+      if (!blk_used(p)) {
+        unlink_free(s, p);
+        merged += blk_size(p);
+        b = p;
+      }
+    }
+    set_size(s, b, merged, false);
+    push_free(s, b);
+    return size;
+  }
+};
+
+// Records the call stack of about one allocation per __MEMORY_PROFILE_RATE
+// bytes allocated (every allocation that crosses a multiple of the rate), and
+// keeps it while the block is live, for __zalloc_heap_profile().
+static const int kHeapProfileMaxFrames = 32;
+static const int kHeapProfileShards = 16;
+
+class __HeapProfiler {
+  struct __sample {
+    size_t len;
+    unsigned int stack; // index into stacks
+  };
+  struct __shard {
+    std::mutex lock;
+    std::unordered_map<key_type, __sample, __hash_func> samples;
+  } __attribute__((aligned(kCacheLineSize)));
+
+  std::atomic<size_t> rate;
+  std::atomic<long> countdown;
+  __shard shards[kHeapProfileShards];
+  std::mutex stacks_lock;
+  std::vector<std::string> stacks;
+  std::unordered_map<std::string, unsigned int> stack_ids;
+
+  __shard &get_shard(key_type k) {
+    return shards[(k * 0x9e3779b97f4a7c15UL) >> 60];
+  }
+
+public:
+  __HeapProfiler() : rate(0), countdown(0) {}
+
+  bool active() { return rate.load(std::memory_order_relaxed) != 0; }
+
+  // A rate of 0 stops profiling and drops the samples taken so far.
+  void setRate(size_t bytes) {
+    rate = bytes;
+    countdown = (long)bytes;
+    if (bytes == 0) {
+      for (int i = 0; i < kHeapProfileShards; ++i) {
+        std::lock_guard<std::mutex> guard(shards[i].lock);
+        shards[i].samples.clear();
+      }
+    }
+  }
+
+  // Returns the ID of the stack recorded for the event log (its index in
+  // stacks plus 1), or 0 if the allocation isn't sampled.
+  unsigned int recordAlloc(const void *p, size_t len) {
+    size_t r = rate.load(std::memory_order_relaxed);
+    if (r == 0)
+      return 0;
+    // Take len off the countdown; if that crosses the next sampling point,
+    // this allocation is sampled and the point moves past its end. Both are
+    // worked out from the value replaced, so exactly one allocation gets
+    // each sampling point and the countdown always stays positive.
+    long cur = countdown.load(std::memory_order_relaxed);
+    long left;
+    long next;
+    do {
+      left = cur - (long)len;
+      next = left > 0 ? left : left + (long)(r + ((size_t)-left / r) * r);
+    } while (!countdown.compare_exchange_weak(cur, next,
+                                              std::memory_order_relaxed));
+    if (left > 0)
+      return 0;
+    std::string folded = __folded_stack(kHeapProfileMaxFrames, "__zalloc");
+    unsigned int id;
+    {
+      std::lock_guard<std::mutex> guard(stacks_lock);
+      auto it = stack_ids.find(folded);
+      if (it == stack_ids.end()) {
+        id = stacks.size();
+        stacks.push_back(folded);
+        stack_ids[folded] = id;
+        if (__doLogMemoryEvents())
+          __memlog_stack(id + 1, folded.c_str());
+      } else {
+        id = it->second;
+      }
+    }
+    key_type k = (key_type)p;
+    __shard &s = get_shard(k);
+    std::lock_guard<std::mutex> guard(s.lock);
+    s.samples[k] = {len, id};
+    return id + 1;
+  }
+
+  void recordFree(const void *p) {
+    if (!active())
+      return;
+    key_type k = (key_type)p;
+    __shard &s = get_shard(k);
+    std::lock_guard<std::mutex> guard(s.lock);
+    s.samples.erase(k);
+  }
+
+  // Writes one line per stack, in folded-stack format, with the estimated
+  // number of live bytes allocated from it: a sampled block of len bytes
+  // stands for max(len, rate) bytes.
+  int dump(int fd) {
+    size_t r = rate.load(std::memory_order_relaxed);
+    std::unordered_map<unsigned int, size_t> bytes;
+    for (int i = 0; i < kHeapProfileShards; ++i) {
+      std::lock_guard<std::mutex> guard(shards[i].lock);
+      for (auto &e : shards[i].samples)
+        bytes[e.second.stack] += e.second.len > r ? e.second.len : r;
+    }
+    std::lock_guard<std::mutex> guard(stacks_lock);
+    for (auto &e : bytes) {
+      if (dprintf(fd, "%s %zu\n", stacks[e.first].c_str(), e.second) < 0)
+        return -1;
+    }
+    return 0;
+  }
+};
+
+// Allocator for the nodes of the index maps, which keeps the nodes freed by
+// a map on a list and hands them back before asking for more, so that the
+// index doesn't call malloc() once it has as many nodes as blocks. The list
+// is guarded by the lock of the map; std::map allocates nothing but nodes,
+// all of one size.
+template <class T> struct __index_alloc {
+  typedef T value_type;
+  void **free_nodes;
+
+  explicit __index_alloc(void **list) : free_nodes(list) {}
+  template <class U>
+  __index_alloc(const __index_alloc<U> &other) : free_nodes(other.free_nodes) {}
+  T *allocate(size_t n) {
+    if (n == 1 && *free_nodes) {
+      void *p = *free_nodes;
+      *free_nodes = *(void **)p;
+      return (T *)p;
+    }
+    return (T *)::operator new(n * sizeof(T));
+  }
+  void deallocate(T *p, size_t n) {
+    if (n == 1) {
+      *(void **)p = *free_nodes;
+      *free_nodes = p;
+      return;
+    }
+    ::operator delete(p);
+  }
+  template <class U> bool operator==(const __index_alloc<U> &other) const {
+    return free_nodes == other.free_nodes;
+  }
+  template <class U> bool operator!=(const __index_alloc<U> &other) const {
+    return free_nodes != other.free_nodes;
+  }
+};
+
+// Ordered index of the blocks returned by __zalloc(), other than slab blocks
+// (found through the span map), so that __zalloc_find() can map an address
+// to the block containing it. Blocks are sorted into classes by length:
+// class c holds the blocks of at most 1MB << c bytes, and they are kept in
+// maps selected by the granule of 1MB << c bytes their start address is in,
+// so threads allocating in different parts of memory rarely share a lock.
+// Such a block extends into the next granule at most, so an address is
+// looked up in its own granule and the one before it, for each class that
+// holds blocks. Nearly all the blocks are in class 0, which is always
+// looked at; the others are counted, and skipped while they're empty.
+static const size_t kIndexStripeShift = 20;
+static const int kIndexStripes = 64;
+static const int kIndexClasses = 64 - kIndexStripeShift + 1;
+
+class __IntervalIndex {
+  typedef std::pair<int, key_type> index_key; // class, start
+  typedef __index_alloc<std::pair<const index_key, size_t>> node_alloc;
+
+  struct __stripe {
+    std::mutex lock;
+    void *free_nodes;
+    std::map<index_key, size_t, std::less<index_key>, node_alloc> blocks;
+
+    __stripe() : free_nodes(nullptr), blocks(node_alloc(&free_nodes)) {}
+  } __attribute__((aligned(kCacheLineSize)));
+
+  __stripe stripes[kIndexStripes];
+  std::atomic<size_t> nlarge[kIndexClasses];
+
+  static int class_of(size_t len) {
+    int c = 0;
+    while (c < kIndexClasses - 1 && len > (1UL << (kIndexStripeShift + c)))
+      ++c;
+    return c;
+  }
+  __stripe &stripe_of(int c, key_type k) {
+    return stripes[((k >> (kIndexStripeShift + c)) + c) % kIndexStripes];
+  }
+  bool find_in(int c, key_type k, key_type granule, void **base,
+               size_t *len) {
+    __stripe &s = stripe_of(c, granule);
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto it = s.blocks.upper_bound(index_key(c, k));
+    if (it == s.blocks.begin())
+      return false;
+    --it;
+    if (it->first.first != c || k - it->first.second >= it->second)
+      return false;
+    *base = (void *)it->first.second;
+    *len = it->second;
+    return true;
+  }
+  bool erase_in(int c, key_type k) {
+    if (c > 0 && nlarge[c].load(std::memory_order_relaxed) == 0)
+      return false;
+    __stripe &s = stripe_of(c, k);
+    std::lock_guard<std::mutex> guard(s.lock);
+    if (s.blocks.erase(index_key(c, k)) == 0)
+      return false;
+    if (c > 0)
+      nlarge[c].fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+public:
+  __IntervalIndex() {
+    for (int c = 0; c < kIndexClasses; ++c)
+      nlarge[c] = 0;
+  }
+  void insert(const void *p, size_t len) {
+    key_type k = (key_type)p;
+    if (len == 0)
+      len = 1;
+    int c = class_of(len);
+    if (c > 0)
+      nlarge[c].fetch_add(1, std::memory_order_relaxed);
+    __stripe &s = stripe_of(c, k);
+    std::lock_guard<std::mutex> guard(s.lock);
+    s.blocks[index_key(c, k)] = len;
+  }
+  // The length passed to __zfree() picks the class to look in first, but
+  // isn't relied on.
+  void erase(const void *p, size_t len) {
+    key_type k = (key_type)p;
+    int first = class_of(len ? len : 1);
+    if (erase_in(first, k))
+      return;
+    for (int c = 0; c < kIndexClasses; ++c) {
+      if (c != first && erase_in(c, k))
+        return;
+    }
+  }
+  bool find(const void *p, void **base, size_t *len) {
+    key_type k = (key_type)p;
+    for (int c = 0; c < kIndexClasses; ++c) {
+      if (c > 0 && nlarge[c].load(std::memory_order_relaxed) == 0)
+        continue;
+      key_type size = 1UL << (kIndexStripeShift + c);
+      if (find_in(c, k, k, base, len) ||
+          (k >= size && find_in(c, k, k - size, base, len)))
+        return true;
+    }
+    return false;
+  }
+};
+
+#if (__TARGET_LIB__ < 0x43010000)
+static size_t __trim_aligned_pool();
+#endif
+static size_t __zarena_allocs();
+
+// Blocks from __malloc31 are preceded by this header, so that __zfree() can
+// release them without looking them up. The size is a multiple of 8; its low
+// bit is set if the block is also in the registry.
+struct __blk31_header {
+  size_t size;
+  void *mem; // as returned by __malloc31
+};
+static const size_t kBlk31Tracked = 1;
+
 class __Cache {
-  std::unordered_map<key_type, value_type, __hash_func> cache;
-  std::mutex access_lock;
+  // The registry of allocated blocks is split into kNumShards independently
+  // locked maps selected by a hash of the block address, so threads that
+  // allocate or free different blocks rarely contend on the same lock. It
+  // holds every segment, but blocks from __malloc31 only while memory
+  // warnings are logged, as they carry their own header.
+  static const int kShardBits = 6;
+  static const int kNumShards = 1 << kShardBits;
+
+  struct __shard {
+    std::mutex access_lock;
+    std::unordered_map<key_type, value_type, __hash_func> cache;
+  } __attribute__((aligned(kCacheLineSize)));
+
+  __shard shards[kNumShards];
   char xttoken[16];
   unsigned short asid;
   int oktouse;
-  size_t curmem31;
-  size_t curmem64;
-  size_t maxmem31;
-  size_t maxmem64;
+  // The counters are updated without holding any lock; the max values are
+  // raised with a compare-and-swap only when a new peak is reached. Usage
+  // is kept in single counters, as every allocation and release checks it
+  // against the watermarks.
+  std::atomic<size_t> curmem31 __attribute__((aligned(kCacheLineSize)));
+  std::atomic<size_t> curmem64;
+  std::atomic<size_t> maxmem31;
+  std::atomic<size_t> maxmem64;
+  std::atomic<size_t> segments;
+  // Totals of the arenas created by __zarena_create() that still exist;
+  // their allocations are counted by each arena, see __zarena_allocs().
+  std::atomic<size_t> arenas;
+  std::atomic<size_t> arena_bytes;
+  // Counts of __zalloc() and __zfree() calls, for __zalloc_stats(). They're
+  // split into kNumCounterShards selected by the calling thread, so threads
+  // rarely update the same cache line, and summed when read.
+  static const int kCounterShardBits = 4;
+  static const int kNumCounterShards = 1 << kCounterShardBits;
+  struct __counters {
+    std::atomic<size_t> allocs31;
+    std::atomic<size_t> frees31;
+    std::atomic<size_t> allocs64;
+    std::atomic<size_t> frees64;
+    std::atomic<size_t> fallbacks64;
+    std::atomic<size_t> failures;
+    std::atomic<size_t> size_hist[ZALLOC_STATS_SIZE_CLASSES];
+  } __attribute__((aligned(kCacheLineSize)));
+  __counters counters[kNumCounterShards];
+  __SlabAllocator slabs;
+  // Per-thread caches of slab blocks, reached through tcache_key. Their hit
+  // and miss counts are kept in the cache and added to the totals whenever
+  // the cache goes to the slabs, so the totals stay off the fast path.
+  struct __tcache {
+    unsigned int gen; // value of tcache_gen when the cache was last emptied
+    size_t hits;
+    size_t misses;
+    int count[kSlabNumClasses];
+    void *blocks[kSlabNumClasses][kTCacheMaxBlocks];
+  };
+  pthread_key_t tcache_key;
+  bool tcache_enabled;
+  std::atomic<unsigned int> tcache_gen;
+  std::atomic<size_t> tcache_hits;
+  std::atomic<size_t> tcache_misses;
+  // Accounting of the memory allocated by __zalloc_tagged(), by tag; tag 0
+  // is untagged memory, which isn't tracked. The tag of each live tagged
+  // block is in a map split into kNumShards like the registry, and __zfree()
+  // looks at the shard of a block only while it holds tagged blocks.
+  struct __tag {
+    std::atomic<size_t> current;
+    std::atomic<size_t> max;
+    std::atomic<size_t> allocs;
+    std::atomic<size_t> denied;
+    std::atomic<size_t> limit; // 0 if there's none
+    std::atomic<bool> fail_over_limit;
+    std::atomic<bool> over_limit; // reported since it last got under
+    char name[ZALLOC_TAG_NAME_MAX]; // guarded by tag_lock
+  } __attribute__((aligned(kCacheLineSize)));
+  __tag tags[ZALLOC_MAX_TAGS];
+  std::mutex tag_lock; // guards the names
+  struct __tag_shard {
+    std::mutex lock;
+    std::unordered_map<key_type, std::pair<int, size_t>, __hash_func> blocks;
+    std::atomic<size_t> count;
+  } __attribute__((aligned(kCacheLineSize)));
+  __tag_shard tag_shards[kNumShards];
+  __SegSubAllocator subsegs;
+  __IntervalIndex index;
+
+public:
+  __HeapProfiler profiler;
+
+private:
+  struct __pressure_callback {
+    zalloc_pressure_callback_t fn;
+    void *arg;
+  };
+  std::mutex pressure_lock;
+  __pressure_callback pressure_callbacks[kMaxPressureCallbacks];
+  int npressure_callbacks;
+  int pressure_min_frames;   // 0 if frames aren't monitored
+  size_t pressure_max_bytes; // 0 if usage isn't monitored
+  bool pressure_monitor_running;
+  bool under_pressure;
+
+  struct __watermark {
+    zalloc_watermark_callback_t fn;
+    void *arg;
+    int area;
+    size_t bytes;       // 0 for a growth rate
+    size_t growth_rate; // 0 for a level
+    bool fired;         // a level reported and not yet rearmed
+    size_t base;        // a growth rate's usage at the start of its window
+    unsigned long base_time; // __clock() time of the start of the window
+  };
+  std::mutex watermark_lock;
+  __watermark watermarks[kMaxWatermarks];
+  int nwatermarks;
+  // checkWatermarks() has nothing to do while the usage of an area is in
+  // [watermark_low, watermark_high).
+  std::atomic<size_t> watermark_low[2];
+  std::atomic<size_t> watermark_high[2];
+
+#if __USE_IARV64
+  struct __pooled_seg {
+    void *ptr;
+    unsigned long freed_at; // __clock() time
+  };
+  std::mutex pool_lock;
+  // Bucket i holds segments of i+1 megabytes, oldest first.
+  std::vector<__pooled_seg> seg_pool[kSegPoolBuckets];
+  size_t pool_max;
+  size_t pool_bytes;
+  bool pool_trimmer_running;
+  std::atomic<size_t> pool_hits;
+  std::atomic<size_t> pool_misses;
+  // Frame size requested by __MEMORY_LARGE_FRAMES (0 for the default), and
+  // whether a request for large frames has failed since it was set.
+  std::atomic<size_t> large_frames;
+  std::atomic<bool> large_frames_failed;
+
+  // Tries to get the segments backed by fixed large frames, 2G frames only
+  // when the size is a multiple of 2G, and returns the frame tag for the
+  // registry entry in *tag.
+  void *alloc_large_frames(size_t segs, value_type *tag) {
+    size_t frames = large_frames.load(std::memory_order_relaxed);
+    if (frames == 0 || large_frames_failed.load(std::memory_order_relaxed))
+      return nullptr;
+    long long rc, reason;
+    void *p = nullptr;
+    if (frames == kLargeFrames2G && (segs * kMegaByte) % kLargeFrames2G == 0) {
+      p = __iarv64_alloc(segs, xttoken, &rc, &reason, 0, kLargeFrames2G);
+      *tag = kSegFrames2G;
+    }
+    if (!p) {
+      p = __iarv64_alloc(segs, xttoken, &rc, &reason, 0, kLargeFrames1M);
+      *tag = kSegFrames1M;
+    }
+    if (!p) {
+      // Don't keep asking for frames the system doesn't have configured.
+      large_frames_failed = true;
+      if (__doLogMemoryWarning()) {
+        __memprintf("WARNING: size=%zu: large frames are not available, " \
+                    "rc=%llx, reason=%llx; using 4K/pageable 1M frames\n",
+                    segs * kMegaByte, rc, reason);
+      }
+    }
+    return p;
+  }
+
+  // Ranges reserved by __zreserve(), keyed by their start address. A segment
+  // is either committed (usable) or guard area.
+  struct __reservation {
+    size_t segs;
+    std::vector<bool> committed;
+  };
+  std::mutex resv_lock;
+  std::map<key_type, __reservation> reservations;
+
+  // Returns the reservation containing [k, k+len), or end() if there's none.
+  std::map<key_type, __reservation>::iterator find_reservation(key_type k,
+                                                               size_t len) {
+    auto it = reservations.upper_bound(k);
+    if (it == reservations.begin())
+      return reservations.end();
+    --it;
+    if (k + len > it->first + it->second.segs * kMegaByte || k + len < k)
+      return reservations.end();
+    return it;
+  }
+
+  void *pool_get(size_t segs) {
+    if (segs > kSegPoolBuckets)
+      return nullptr;
+    std::lock_guard<std::mutex> guard(pool_lock);
+    if (pool_max == 0)
+      return nullptr;
+    std::vector<__pooled_seg> &bucket = seg_pool[segs - 1];
+    if (bucket.empty()) {
+      pool_misses.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    void *p = bucket.back().ptr;
+    bucket.pop_back();
+    pool_bytes -= segs * kMegaByte;
+    pool_hits.fetch_add(1, std::memory_order_relaxed);
+    return p;
+  }
+  bool pool_put(void *ptr, size_t size) {
+    size_t segs = size / kMegaByte;
+    if (segs == 0 || segs > kSegPoolBuckets)
+      return false;
+    {
+      std::lock_guard<std::mutex> guard(pool_lock);
+      if (pool_bytes + size > pool_max)
+        return false;
+    }
+    // Give the frames back to the system now, so a pooled segment costs
+    // only virtual storage and is zero when it's handed out again.
+    long long reason;
+    if (__iarv64_discard(ptr, segs, &reason) != 0)
+      return false;
+    std::lock_guard<std::mutex> guard(pool_lock);
+    if (pool_bytes + size > pool_max)
+      return false;
+    seg_pool[segs - 1].push_back({ptr, __clock()});
+    pool_bytes += size;
+    if (!pool_trimmer_running) {
+      pthread_t tid;
+      pool_trimmer_running =
+          pthread_create(&tid, NULL, __seg_pool_trimmer, NULL) == 0;
+      if (pool_trimmer_running)
+        pthread_detach(tid);
+    }
+    return true;
+  }
+#endif
+
+  __tag_shard &get_tag_shard(unsigned long k) {
+    return tag_shards[(k * 0x9e3779b97f4a7c15UL) >> (64 - kShardBits)];
+  }
+
+  __shard &get_shard(unsigned long k) {
+    // Blocks are at least 8-byte aligned, so mix all the address bits and
+    // take the top ones.
+    return shards[(k * 0x9e3779b97f4a7c15UL) >> (64 - kShardBits)];
+  }
+  __counters &get_counters() {
+    return counters[(gettid() * 0x9e3779b97f4a7c15UL) >>
+                    (64 - kCounterShardBits)];
+  }
+  size_t sum(std::atomic<size_t> __counters::*counter) {
+    size_t n = 0;
+    for (int i = 0; i < kNumCounterShards; ++i)
+      n += (counters[i].*counter).load(std::memory_order_relaxed);
+    return n;
+  }
+  static void raise_max(std::atomic<size_t> &max, size_t now) {
+    size_t peak = max.load(std::memory_order_relaxed);
+    while (now > peak &&
+           !max.compare_exchange_weak(peak, now, std::memory_order_relaxed))
+      ;
+  }
+  static size_t add_mem(std::atomic<size_t> &cur, std::atomic<size_t> &max,
+                        size_t v) {
+    size_t now = cur.fetch_add(v, std::memory_order_relaxed) + v;
+    raise_max(max, now);
+    return now;
+  }
+  static size_t sub_mem(std::atomic<size_t> &cur, size_t v) {
+    return cur.fetch_sub(v, std::memory_order_relaxed) - v;
+  }
+
+  static int tcache_limit(int cls) {
+    size_t n = kTCacheClassBytes / kSlabClassSizes[cls];
+    return n < kTCacheMinBlocks   ? kTCacheMinBlocks
+           : n > kTCacheMaxBlocks ? kTCacheMaxBlocks
+                                  : (int)n;
+  }
+  void publish_tcache_counts(__tcache *tc) {
+    tcache_hits.fetch_add(tc->hits, std::memory_order_relaxed);
+    tcache_misses.fetch_add(tc->misses, std::memory_order_relaxed);
+    tc->hits = tc->misses = 0;
+  }
+  // Returns the cache of the calling thread, or nullptr if it can't have
+  // one, after emptying it if the caches were trimmed since its last use.
+  __tcache *get_tcache() {
+    if (!tcache_enabled)
+      return nullptr;
+    __tcache *tc = (__tcache *)pthread_getspecific(tcache_key);
+    if (!tc) {
+      tc = (__tcache *)calloc(1, sizeof(__tcache));
+      if (!tc)
+        return nullptr;
+      if (pthread_setspecific(tcache_key, tc) != 0) {
+        free(tc);
+        return nullptr;
+      }
+      tc->gen = tcache_gen.load(std::memory_order_relaxed);
+    }
+    unsigned int gen = tcache_gen.load(std::memory_order_relaxed);
+    if (tc->gen != gen) {
+      flushTCache(tc);
+      tc->gen = gen;
+    }
+    return tc;
+  }
 
 public:
   __Cache() {
@@ -1239,82 +2549,847 @@ public:
         (*(int *)(80 + ((char ****__ptr32 *)1208)[0][11][1][123]) >= 0x04020200);
     // LE level is 220 or above
     curmem31 = curmem64 = maxmem31 = maxmem64 = 0u;
+    segments = 0u;
+    arenas = arena_bytes = 0u;
+    for (__counters &c : counters) {
+      c.allocs31 = c.frees31 = c.allocs64 = c.frees64 = 0u;
+      c.fallbacks64 = c.failures = 0u;
+      for (int i = 0; i < ZALLOC_STATS_SIZE_CLASSES; ++i)
+        c.size_hist[i] = 0u;
+    }
+    npressure_callbacks = 0;
+    pressure_min_frames = 0;
+    pressure_max_bytes = 0u;
+    pressure_monitor_running = under_pressure = false;
+    nwatermarks = 0;
+    for (int i = 0; i < 2; ++i) {
+      watermark_low[i] = 0u;
+      watermark_high[i] = ~0UL;
+    }
+    tcache_enabled =
+        pthread_key_create(&tcache_key, __tcache_thread_exit) == 0;
+    tcache_gen = 0u;
+    tcache_hits = tcache_misses = 0u;
+    for (int i = 0; i < ZALLOC_MAX_TAGS; ++i) {
+      __tag &t = tags[i];
+      t.current = t.max = t.allocs = t.denied = t.limit = 0u;
+      t.fail_over_limit = t.over_limit = false;
+      t.name[0] = '\0';
+    }
+    for (int i = 0; i < kNumShards; ++i)
+      tag_shards[i].count = 0u;
+#if __USE_IARV64
+    pool_max = kSegPoolDefaultMax * kMegaByte;
+    pool_bytes = 0u;
+    pool_trimmer_running = false;
+    pool_hits = pool_misses = 0u;
+    large_frames = 0u;
+    large_frames_failed = false;
+#endif
   }
 
-  size_t getCurrentMem31() { return curmem31; }
-  size_t getCurrentMem64() { return curmem64; }
-  size_t getMaxMem31() { return maxmem31; }
-  size_t getMaxMem64() { return maxmem64; }
+  size_t getCurrentMem31() { return curmem31.load(std::memory_order_relaxed); }
+  size_t getCurrentMem64() { return curmem64.load(std::memory_order_relaxed); }
+  size_t getMaxMem31() { return maxmem31.load(std::memory_order_relaxed); }
+  size_t getMaxMem64() { return maxmem64.load(std::memory_order_relaxed); }
 
-  void addptr31(const void *ptr, size_t v) {
-    unsigned long k = (unsigned long)ptr;
-    std::lock_guard<std::mutex> guard(access_lock);
-    cache[k] = (unsigned long)v;
-    curmem31 += v;
-    maxmem31 = max(maxmem31, curmem31);
+  void countAlloc(const void *p, size_t len) {
+    __counters &c = get_counters();
+    if (p == nullptr) {
+      c.failures.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    if (0 != ((unsigned long)p & 0xffffffff80000000UL))
+      c.allocs64.fetch_add(1, std::memory_order_relaxed);
+    else
+      c.allocs31.fetch_add(1, std::memory_order_relaxed);
+    int i = 0;
+    while (i < ZALLOC_STATS_SIZE_CLASSES - 1 && (16UL << i) < len)
+      ++i;
+    c.size_hist[i].fetch_add(1, std::memory_order_relaxed);
+  }
+  void countFree(const void *p) {
+    __counters &c = get_counters();
+    if (0 != ((unsigned long)p & 0xffffffff80000000UL))
+      c.frees64.fetch_add(1, std::memory_order_relaxed);
+    else
+      c.frees31.fetch_add(1, std::memory_order_relaxed);
+  }
+  void countFallback() {
+    get_counters().fallbacks64.fetch_add(1, std::memory_order_relaxed);
+  }
+  // Slab blocks are found through the span map and are left out of the
+  // index, which keeps the common small allocations off its locks.
+  void indexBlock(const void *p, size_t len) {
+    if (!slabs.contains(p))
+      index.insert(p, len);
+  }
+  void unindexBlock(const void *p, size_t len) {
+    if (!slabs.contains(p))
+      index.erase(p, len);
+  }
+  bool findBlock(const void *p, void **base, size_t *len) {
+    if (slabs.find(p, base, len) || index.find(p, base, len))
+      return true;
+#if __USE_IARV64
+    std::lock_guard<std::mutex> guard(resv_lock);
+    auto it = find_reservation((key_type)p, 1);
+    if (it != reservations.end()) {
+      *base = (void *)it->first;
+      *len = it->second.segs * kMegaByte;
+      return true;
+    }
+#endif
+    return false;
+  }
+  // The deltas are added to the arena totals; bytes are those of the chunks
+  // the arenas hold.
+  void countArena(long narenas, long bytes) {
+    arenas.fetch_add(narenas, std::memory_order_relaxed);
+    arena_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  // Each counter is read on its own, without a lock, so the values may be
+  // a little out of step with each other while other threads allocate.
+  void getStats(struct zalloc_stats *st) {
+    st->current31 = getCurrentMem31();
+    st->max31 = getMaxMem31();
+    st->current64 = getCurrentMem64();
+    st->max64 = getMaxMem64();
+    st->allocs31 = sum(&__counters::allocs31);
+    st->frees31 = sum(&__counters::frees31);
+    st->allocs64 = sum(&__counters::allocs64);
+    st->frees64 = sum(&__counters::frees64);
+    // A free can be counted before the matching allocation is seen here.
+    st->live31 = st->allocs31 > st->frees31 ? st->allocs31 - st->frees31 : 0;
+    st->live64 = st->allocs64 > st->frees64 ? st->allocs64 - st->frees64 : 0;
+    st->fallbacks64 = sum(&__counters::fallbacks64);
+    st->failures = sum(&__counters::failures);
+#if __USE_IARV64
+    st->segpool_hits = getSegPoolHits();
+    st->segpool_misses = getSegPoolMisses();
+#else
+    st->segpool_hits = st->segpool_misses = 0;
+#endif
+    for (int i = 0; i < ZALLOC_STATS_SIZE_CLASSES; ++i) {
+      st->size_classes[i] = 0;
+      for (const __counters &c : counters)
+        st->size_classes[i] += c.size_hist[i].load(std::memory_order_relaxed);
+    }
+    st->arenas = arenas.load(std::memory_order_relaxed);
+    st->arena_bytes = arena_bytes.load(std::memory_order_relaxed);
+    st->arena_allocs = __zarena_allocs();
+    st->tcache_hits = tcache_hits.load(std::memory_order_relaxed);
+    st->tcache_misses = tcache_misses.load(std::memory_order_relaxed);
+    st->segments = segments.load(std::memory_order_relaxed);
+  }
+
+  void setTag(int tag, const char *name, size_t limit, bool fail) {
+    __tag &t = tags[tag];
+    if (name) {
+      std::lock_guard<std::mutex> guard(tag_lock);
+      snprintf(t.name, sizeof(t.name), "%s", name);
+    }
+    t.fail_over_limit.store(fail, std::memory_order_relaxed);
+    t.limit.store(limit, std::memory_order_relaxed);
+    if (limit == 0 || t.current.load(std::memory_order_relaxed) <= limit)
+      t.over_limit.store(false, std::memory_order_relaxed);
+  }
+
+  void getTagStats(int tag, struct zalloc_tag_stats *st) {
+    __tag &t = tags[tag];
+    {
+      std::lock_guard<std::mutex> guard(tag_lock);
+      memcpy(st->name, t.name, sizeof(st->name));
+    }
+    st->current = t.current.load(std::memory_order_relaxed);
+    st->max = t.max.load(std::memory_order_relaxed);
+    st->allocs = t.allocs.load(std::memory_order_relaxed);
+    st->denied = t.denied.load(std::memory_order_relaxed);
+    st->limit = t.limit.load(std::memory_order_relaxed);
+  }
+
+  // Charges an allocation of len bytes to tag before it's made, and returns
+  // false, with errno set, if it's to fail because of the soft limit of the
+  // tag; if it's made and fails, the charge is taken back with
+  // unchargeTagged(). When over the limit fails, the bytes are reserved with
+  // a compare-exchange, so concurrent allocations can't all get under it.
+  bool chargeTagged(int tag, size_t len) {
+    __tag &t = tags[tag];
+    size_t limit = t.limit.load(std::memory_order_relaxed);
+    bool fail = limit && t.fail_over_limit.load(std::memory_order_relaxed);
+    size_t cur;
+    if (fail) {
+      cur = t.current.load(std::memory_order_relaxed);
+      do {
+        if (cur + len > limit)
+          break;
+      } while (!t.current.compare_exchange_weak(cur, cur + len,
+                                                std::memory_order_relaxed));
+      if (cur + len <= limit) {
+        raise_max(t.max, cur + len);
+        return true;
+      }
+      t.denied.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      cur = add_mem(t.current, t.max, len);
+      if (limit == 0 || cur <= limit)
+        return true;
+    }
+    // Without failing, only the first allocation over the limit is reported
+    // until the tag gets under it again.
+    if ((fail || !t.over_limit.exchange(true, std::memory_order_relaxed)) &&
+        __doLogMemoryWarning()) {
+      struct zalloc_tag_stats st;
+      getTagStats(tag, &st);
+      __memprintf("WARNING: size=%zu, tag=%d(%s): over the soft limit of %zu " \
+                  "(current=%zu)%s\n", len, tag, st.name, limit, cur,
+                  fail ? ", allocation failed" : "");
+    }
+    if (fail)
+      errno = ENOMEM;
+    return !fail;
+  }
+
+  void unchargeTagged(int tag, size_t len) {
+    __tag &t = tags[tag];
+    size_t cur = sub_mem(t.current, len);
+    size_t limit = t.limit.load(std::memory_order_relaxed);
+    if (limit && cur <= limit)
+      t.over_limit.store(false, std::memory_order_relaxed);
+  }
+
+  // Records the tag of a block allocated after chargeTagged().
+  void countTagged(const void *p, int tag, size_t len) {
+    tags[tag].allocs.fetch_add(1, std::memory_order_relaxed);
+    __tag_shard &s = get_tag_shard((key_type)p);
+    std::lock_guard<std::mutex> guard(s.lock);
+    s.blocks[(key_type)p] = std::make_pair(tag, len);
+    s.count.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void uncountTagged(const void *p) {
+    __tag_shard &s = get_tag_shard((key_type)p);
+    // Only frees that hash to a shard holding tagged blocks take its lock.
+    if (s.count.load(std::memory_order_relaxed) == 0)
+      return;
+    int tag;
+    size_t len;
+    {
+      std::lock_guard<std::mutex> guard(s.lock);
+      auto it = s.blocks.find((key_type)p);
+      if (it == s.blocks.end())
+        return;
+      tag = it->second.first;
+      len = it->second.second;
+      s.blocks.erase(it);
+      s.count.fetch_sub(1, std::memory_order_relaxed);
+    }
+    unchargeTagged(tag, len);
+  }
+
+  void displayArenas() {
+    size_t n = arenas.load(std::memory_order_relaxed);
+    if (n == 0)
+      return;
+    __memprintf("arenas=%zu: bytes=%zu, allocs=%zu\n", n,
+                arena_bytes.load(std::memory_order_relaxed),
+                __zarena_allocs());
+  }
+
+  void displayTags() {
+    for (int i = 1; i < ZALLOC_MAX_TAGS; ++i) {
+      struct zalloc_tag_stats st;
+      getTagStats(i, &st);
+      if (st.allocs == 0 && st.denied == 0)
+        continue;
+      __memprintf("tag=%d(%s): current=%zu, max=%zu, allocs=%zu, " \
+                  "denied=%zu, limit=%zu\n", i, st.name, st.current, st.max,
+                  st.allocs, st.denied, st.limit);
+    }
+  }
+
+  void releaseTCache(void *tc) {
+    flushTCache((__tcache *)tc);
+    free(tc);
+  }
+
+  // Returns all the blocks held by a thread cache to the slabs.
+  void flushTCache(__tcache *tc) {
+    for (int i = 0; i < kSlabNumClasses; ++i) {
+      if (tc->count[i]) {
+        slabs.dealloc_batch(i, tc->blocks[i], tc->count[i]);
+        tc->count[i] = 0;
+      }
+    }
+    publish_tcache_counts(tc);
+  }
+
+  int addWatermark(int area, size_t bytes, size_t growth_rate,
+                   zalloc_watermark_callback_t fn, void *arg) {
+    std::lock_guard<std::mutex> guard(watermark_lock);
+    if (nwatermarks == kMaxWatermarks) {
+      errno = ENOMEM;
+      return -1;
+    }
+    size_t cur = area ? getCurrentMem64() : getCurrentMem31();
+    // A level that's already reached is reported at the next change.
+    watermarks[nwatermarks++] = {fn,    arg, area, bytes, growth_rate,
+                                 false, cur, __clock()};
+    updateWatermarkRange(area);
+    return 0;
+  }
+
+  int removeWatermarks(zalloc_watermark_callback_t fn, void *arg) {
+    std::lock_guard<std::mutex> guard(watermark_lock);
+    int n = nwatermarks;
+    for (int i = 0; i < nwatermarks;) {
+      if (watermarks[i].fn == fn && watermarks[i].arg == arg)
+        watermarks[i] = watermarks[--nwatermarks];
+      else
+        ++i;
+    }
+    if (n == nwatermarks) {
+      errno = ENOENT;
+      return -1;
+    }
+    updateWatermarkRange(0);
+    updateWatermarkRange(1);
+    return 0;
+  }
+
+  // Sets the range of usage of an area in which no watermark of it is
+  // crossed, with watermark_lock held.
+  void updateWatermarkRange(int area) {
+    size_t low = 0u, high = ~0UL;
+    for (int i = 0; i < nwatermarks; ++i) {
+      __watermark &w = watermarks[i];
+      if (w.area != area)
+        continue;
+      size_t rearm = w.bytes - w.bytes / kWatermarkRearmDiv;
+      if (w.growth_rate && w.base + w.growth_rate < high)
+        high = w.base + w.growth_rate;
+      else if (!w.growth_rate && !w.fired && w.bytes < high)
+        high = w.bytes;
+      else if (!w.growth_rate && w.fired && rearm > low)
+        low = rearm;
+    }
+    watermark_low[area].store(low, std::memory_order_relaxed);
+    watermark_high[area].store(high, std::memory_order_relaxed);
+  }
+
+  // Called after each allocation and release in an area, without any lock
+  // held, and calls the callbacks of the watermarks crossed.
+  void checkWatermarks(int area) {
+    size_t cur = area ? getCurrentMem64() : getCurrentMem31();
+    if (cur >= watermark_low[area].load(std::memory_order_relaxed) &&
+        cur < watermark_high[area].load(std::memory_order_relaxed))
+      return;
+    __watermark fired[kMaxWatermarks];
+    int nfired = 0;
+    {
+      std::lock_guard<std::mutex> guard(watermark_lock);
+      unsigned long now = __clock();
+      for (int i = 0; i < nwatermarks; ++i) {
+        __watermark &w = watermarks[i];
+        if (w.area != area)
+          continue;
+        if (w.growth_rate) {
+          // The window restarts from usage seen to have fallen below its
+          // start, and from usage that grew by the rate, whether or not it
+          // grew fast enough.
+          if (cur < w.base) {
+            w.base = cur;
+          } else if (cur - w.base >= w.growth_rate) {
+            if (now - w.base_time < 1000000000UL)
+              fired[nfired++] = w;
+            w.base = cur;
+            w.base_time = now;
+          }
+        } else if (!w.fired && cur >= w.bytes) {
+          w.fired = true;
+          fired[nfired++] = w;
+        } else if (w.fired && cur < w.bytes - w.bytes / kWatermarkRearmDiv) {
+          w.fired = false;
+        }
+      }
+      updateWatermarkRange(area);
+    }
+    for (int i = 0; i < nfired; ++i) {
+      struct zalloc_watermark info = {area, fired[i].bytes,
+                                      fired[i].growth_rate, cur};
+      if (__doLogMemoryAll()) {
+        __memprintf("watermark: area=%d, bytes=%zu, growth-rate=%zu, " \
+                    "current=%zu\n", area, info.bytes, info.growth_rate, cur);
+      }
+      fired[i].fn(&info, fired[i].arg);
+    }
+  }
+
+  // Sets the thresholds of the memory-pressure monitor, and starts it if one
+  // of them is set; it stops by itself once both are cleared.
+  void setPressureLimits(int min_frames, size_t max_bytes) {
+    std::lock_guard<std::mutex> guard(pressure_lock);
+    pressure_min_frames = min_frames;
+    pressure_max_bytes = max_bytes;
+    if ((min_frames || max_bytes) && !pressure_monitor_running) {
+      pthread_t tid;
+      pressure_monitor_running =
+          pthread_create(&tid, NULL, __memory_pressure_monitor, NULL) == 0;
+      if (pressure_monitor_running)
+        pthread_detach(tid);
+    }
+  }
+
+  int addPressureCallback(zalloc_pressure_callback_t fn, void *arg) {
+    std::lock_guard<std::mutex> guard(pressure_lock);
+    if (npressure_callbacks == kMaxPressureCallbacks) {
+      errno = ENOMEM;
+      return -1;
+    }
+    pressure_callbacks[npressure_callbacks++] = {fn, arg};
+    return 0;
+  }
+
+  int removePressureCallback(zalloc_pressure_callback_t fn, void *arg) {
+    std::lock_guard<std::mutex> guard(pressure_lock);
+    for (int i = 0; i < npressure_callbacks; ++i) {
+      if (pressure_callbacks[i].fn == fn && pressure_callbacks[i].arg == arg) {
+        pressure_callbacks[i] = pressure_callbacks[--npressure_callbacks];
+        return 0;
+      }
+    }
+    errno = ENOENT;
+    return -1;
+  }
+
+  // Releases the memory the allocator holds for reuse: empty slab chunks,
+  // empty chunks of the __aligned_malloc() pool and pooled segments. The
+  // thread caches of other threads are emptied at their next allocation or
+  // release, so their blocks are released by a later trim.
+  void trimCaches() {
+    tcache_gen.fetch_add(1, std::memory_order_relaxed);
+    if (tcache_enabled && pthread_getspecific(tcache_key))
+      get_tcache();
+    size_t chunk_bytes = slabs.trim();
+#if (__TARGET_LIB__ < 0x43010000)
+    chunk_bytes += __trim_aligned_pool();
+#endif
+#if __USE_IARV64
+    trimSegPool(0);
+#endif
+    if (chunk_bytes && __doLogMemoryAll()) {
+      __memprintf("size=%zu: released unused slab chunks\n", chunk_bytes);
+    }
+  }
+
+  // Takes one sample for the memory-pressure monitor, and returns false if
+  // the monitor is to stop.
+  bool checkPressure() {
+    int min_frames;
+    size_t max_bytes;
+    {
+      std::lock_guard<std::mutex> guard(pressure_lock);
+      min_frames = pressure_min_frames;
+      max_bytes = pressure_max_bytes;
+      if (min_frames == 0 && max_bytes == 0) {
+        pressure_monitor_running = false;
+        under_pressure = false;
+        return false;
+      }
+    }
+    struct zalloc_pressure info;
+    info.available_frames = __get_num_frames();
+    info.current31 = getCurrentMem31();
+    info.current64 = getCurrentMem64();
+    info.under_pressure =
+        (min_frames && info.available_frames < min_frames) ||
+        (max_bytes && info.current31 + info.current64 > max_bytes);
+    if (info.under_pressure)
+      trimCaches();
+
+    __pressure_callback callbacks[kMaxPressureCallbacks];
+    int ncallbacks;
+    {
+      std::lock_guard<std::mutex> guard(pressure_lock);
+      if (under_pressure == (info.under_pressure != 0))
+        return true;
+      under_pressure = info.under_pressure;
+      ncallbacks = npressure_callbacks;
+      memcpy(callbacks, pressure_callbacks, sizeof(callbacks));
+    }
+    if (__doLogMemoryWarning()) {
+      __memprintf("%s: available-frames=%d, current31=%zu, current64=%zu\n",
+                  info.under_pressure ? "WARNING: memory pressure"
+                                      : "memory pressure relieved",
+                  info.available_frames, info.current31, info.current64);
+    }
+    for (int i = 0; i < ncallbacks; ++i)
+      callbacks[i].fn(&info, callbacks[i].arg);
+    return true;
+  }
+
+#if __USE_IARV64
+  size_t getSegPoolHits() { return pool_hits.load(std::memory_order_relaxed); }
+  size_t getSegPoolMisses() {
+    return pool_misses.load(std::memory_order_relaxed);
+  }
+
+  // Sets the size of the fixed frames to back new segments with:
+  // kLargeFrames1M, kLargeFrames2G, or 0 for the default frames.
+  void setLargeFrames(size_t frame_size) {
+    large_frames = frame_size;
+    large_frames_failed = false;
+  }
+
+  void setSegPoolMax(size_t bytes) {
+    {
+      std::lock_guard<std::mutex> guard(pool_lock);
+      pool_max = bytes;
+      if (pool_bytes <= pool_max)
+        return;
+    }
+    trimSegPool(0);
+  }
+
+  // Detaches the pooled segments that have been unused for at least
+  // idle_secs seconds, and returns true if the pool is now empty.
+  bool trimSegPool(unsigned int idle_secs) {
+    std::vector<__pooled_seg> expired;
+    bool empty;
+    {
+      unsigned long cutoff = __clock() - idle_secs * 1000000000UL;
+      std::lock_guard<std::mutex> guard(pool_lock);
+      for (int i = 0; i < kSegPoolBuckets; ++i) {
+        std::vector<__pooled_seg> &bucket = seg_pool[i];
+        size_t n = 0;
+        while (n < bucket.size() && bucket[n].freed_at <= cutoff)
+          ++n;
+        if (n == 0)
+          continue;
+        expired.insert(expired.end(), bucket.begin(), bucket.begin() + n);
+        bucket.erase(bucket.begin(), bucket.begin() + n);
+        pool_bytes -= n * (i + 1) * kMegaByte;
+      }
+      empty = pool_bytes == 0;
+      if (empty)
+        pool_trimmer_running = false;
+    }
+    for (const __pooled_seg &seg : expired) {
+      long long reason;
+      long long rc = __iarv64_free(seg.ptr, xttoken, &reason);
+      if (rc != 0 && __doLogMemoryUsage()) {
+        __memprintf("VERROR addr=%p iarv64_free of pooled segment failed " \
+                    "rc=%llx, reason=%llx\n", seg.ptr, rc, reason);
+      }
+    }
+    return empty;
+  }
+
+  void *reserve(size_t len) {
+    long long rc, reason;
+    size_t segs = __round_up(len, kMegaByte) / kMegaByte;
+    void *p = __iarv64_alloc(segs, xttoken, &rc, &reason, segs);
+    if (p == nullptr) {
+      if (__doLogMemoryUsage()) {
+        __memprintf("ERROR: size=%zu: iarv64_reserve failed, rc=%llx, " \
+                    "reason=%llx\n", segs * kMegaByte, rc, reason);
+      }
+      errno = ENOMEM;
+      return nullptr;
+    }
+    {
+      std::lock_guard<std::mutex> guard(resv_lock);
+      reservations[(key_type)p] = {segs, std::vector<bool>(segs, false)};
+    }
+    if (__doLogMemoryAll()) {
+      __memprintf("addr=%p, size=%zu: iarv64_reserve OK\n", p,
+                  segs * kMegaByte);
+    }
+    return p;
+  }
+  // Commits (or decommits) the segments overlapping (or covered by) the given
+  // range of a reservation. Segments already in the requested state are left
+  // alone.
+  int change_reservation(void *addr, size_t len, bool commit) {
+    key_type k = (key_type)addr;
+    std::lock_guard<std::mutex> guard(resv_lock);
+    auto it = find_reservation(k, len);
+    if (it == reservations.end()) {
+      errno = EINVAL;
+      return -1;
+    }
+    size_t off = k - it->first;
+    size_t first = commit ? off / kMegaByte
+                          : __round_up(off, kMegaByte) / kMegaByte;
+    size_t last = commit ? __round_up(off + len, kMegaByte) / kMegaByte
+                         : (off + len) / kMegaByte;
+    std::vector<bool> &committed = it->second.committed;
+    for (size_t i = first; i < last;) {
+      if (committed[i] == commit) {
+        ++i;
+        continue;
+      }
+      size_t n = 1;
+      while (i + n < last && committed[i + n] != commit)
+        ++n;
+      char *start = (char *)it->first + i * kMegaByte;
+      long long reason;
+      long long rc = __iarv64_changeguard(start, n, !commit, &reason);
+      if (rc != 0) {
+        if (__doLogMemoryUsage()) {
+          __memprintf("ERROR: addr=%p, size=%zu: iarv64 %s failed, " \
+                      "rc=%llx, reason=%llx\n", start, n * kMegaByte,
+                      commit ? "commit" : "decommit", rc, reason);
+        }
+        errno = commit ? ENOMEM : EINVAL;
+        return -1;
+      }
+      for (size_t j = i; j < i + n; ++j)
+        committed[j] = commit;
+      size_t cur = commit ? add_mem(curmem64, maxmem64, n * kMegaByte)
+                          : sub_mem(curmem64, n * kMegaByte);
+      if (__doLogMemoryAll()) {
+        __memprintf("addr=%p, size=%zu: iarv64 %s OK (v64=%zu)\n", start,
+                    n * kMegaByte, commit ? "commit" : "decommit", cur);
+      }
+      i += n;
+    }
+    return 0;
+  }
+  int release(void *addr) {
+    size_t size, committed = 0;
+    {
+      std::lock_guard<std::mutex> guard(resv_lock);
+      auto it = reservations.find((key_type)addr);
+      if (it == reservations.end()) {
+        errno = EINVAL;
+        return -1;
+      }
+      size = it->second.segs * kMegaByte;
+      for (bool c : it->second.committed)
+        committed += c ? kMegaByte : 0;
+      reservations.erase(it);
+    }
+    long long reason;
+    long long rc = __iarv64_free(addr, xttoken, &reason);
+    if (rc != 0) {
+      if (__doLogMemoryUsage()) {
+        __memprintf("VERROR addr=%p size=%zu iarv64_release failed " \
+                    "rc=%llx, reason=%llx\n", addr, size, rc, reason);
+      }
+      errno = EINVAL;
+      return -1;
+    }
+    size_t cur = sub_mem(curmem64, committed);
+    if (__doLogMemoryAll()) {
+      __memprintf("addr=%p size=%zu iarv64_release OK (v64=%zu)\n", addr,
+                  size, cur);
+    }
+    return 0;
+  }
+#endif
+
+  void *alloc_slab(int cls) {
+    void *p;
+    __tcache *tc = get_tcache();
+    if (tc) {
+      if (tc->count[cls]) {
+        ++tc->hits;
+      } else {
+        ++tc->misses;
+        tc->count[cls] =
+            slabs.alloc_batch(cls, tc->blocks[cls], tcache_limit(cls) / 2);
+        publish_tcache_counts(tc);
+      }
+      p = tc->count[cls] ? tc->blocks[cls][--tc->count[cls]] : nullptr;
+    } else {
+      p = slabs.alloc(cls);
+    }
+    if (p) {
+      slabs.mark_allocated(p);
+      size_t size = kSlabClassSizes[cls];
+      size_t cur = add_mem(curmem31, maxmem31, size);
+      if (__doLogMemoryAll()) {
+        __memprintf("addr=%p, size=%zu: slab31 OK (current=%zu, max=%zu)\n",
+                    p, size, cur, getMaxMem31());
+      }
+    }
+    return p;
+  }
+  // Returns false if ptr isn't in a slab. Otherwise sets *rc to 0 if the
+  // block is released, or to -1 if it isn't allocated, such as when it's
+  // released twice; handing it out again would give it to two owners.
+  bool free_slab(const void *ptr, size_t reqsize, int *rc) {
+    int cls = slabs.block_class(ptr);
+    if (cls < 0)
+      return false;
+    if (!slabs.mark_released(ptr)) {
+      if (__doLogMemoryWarning()) {
+        __memprintf("WARNING: addr=%p, req-size=%zu: slab31 free of a block " \
+                    "that isn't allocated, ignored\n", ptr, reqsize);
+      }
+      errno = EINVAL;
+      *rc = -1;
+      return true;
+    }
+    *rc = 0;
+    size_t size = kSlabClassSizes[cls];
+    __tcache *tc = get_tcache();
+    if (tc) {
+      // When the cache is full, return its older half, which is the least
+      // likely to still be in the processor cache.
+      int limit = tcache_limit(cls);
+      if (tc->count[cls] == limit) {
+        int n = limit / 2;
+        slabs.dealloc_batch(cls, tc->blocks[cls], n);
+        memmove(tc->blocks[cls], tc->blocks[cls] + n,
+                (limit - n) * sizeof(void *));
+        tc->count[cls] -= n;
+        publish_tcache_counts(tc);
+      }
+      tc->blocks[cls][tc->count[cls]++] = (void *)ptr;
+    } else {
+      slabs.dealloc(ptr);
+    }
+    size_t cur = sub_mem(curmem31, size);
+    if (__doLogMemoryUsage()) {
+      const char *w = size < reqsize ? " WARNING: size vs req-size" : "";
+      if (__doLogMemoryAll() || (*w && __doLogMemoryWarning()))
+        __memprintf("addr=%p, size=%zu, req-size=%zu: slab31 free OK " \
+                    "(current=%zu)%s\n", ptr, size, reqsize, cur, w);
+    }
+    return true;
+  }
+
+  // Only the first *dirty bytes of the returned block may be non-zero.
+  void *alloc_sub(size_t len, size_t alignment, size_t *dirty) {
+    void *p = subsegs.alloc(len, alignment, nullptr, dirty);
+    if (!p) {
+      void *seg = alloc_seg(1);
+      if (!seg)
+        return nullptr;
+      p = subsegs.alloc(len, alignment, seg, dirty);
+    }
+    if (__doLogMemoryAll()) {
+      __memprintf("addr=%p, size=%zu, dirty=%zu: subseg64 OK (v64=%zu)\n", p,
+                  len, *dirty, getCurrentMem64());
+    }
+    return p;
+  }
+  int free_sub(void *ptr, size_t reqsize) {
+    void *empty;
+    size_t size = subsegs.dealloc(ptr, &empty);
+    if (size == 0) {
+      if (__doLogMemoryWarning()) {
+        __memprintf("WARNING: addr=%p, req-size=%zu: not a subseg64 block\n",
+                    ptr, reqsize);
+      }
+      return -1;
+    }
+    if (__doLogMemoryAll()) {
+      __memprintf("addr=%p, size=%zu, req-size=%zu: subseg64 free OK%s\n",
+                  ptr, size, reqsize, empty ? ", segment released" : "");
+    }
+    return empty ? free_seg(empty, kMegaByte) : 0;
+  }
+
+  // Blocks from __malloc31 carry their size in a header (see __blk31_header),
+  // so they're entered in the registry only if tracked is set, to cross-check
+  // frees and to list the debris at exit.
+  void addptr31(const void *ptr, size_t v, bool tracked) {
+    if (tracked) {
+      unsigned long k = (unsigned long)ptr;
+      __shard &s = get_shard(k);
+      std::lock_guard<std::mutex> guard(s.access_lock);
+      s.cache[k] = (unsigned long)v;
+    }
+    size_t cur = add_mem(curmem31, maxmem31, v);
     if (__doLogMemoryAll()) {
       __memprintf("addr=%p, size=%zu: malloc31 OK (current=%zu, max=%zu)\n",
-                  ptr, v, curmem31, maxmem31);
+                  ptr, v, cur, getMaxMem31());
     }
   }
 #if __USE_IARV64
   void *alloc_seg(size_t segs) {
     long long rc, reason;
-    std::lock_guard<std::mutex> guard(access_lock);
-    void *p = __iarv64_alloc(segs, xttoken, &rc, &reason);
+    value_type tag = 0;
+    void *p = alloc_large_frames(segs, &tag);
+    bool pooled = false;
+    if (!p) {
+      tag = 0;
+      p = pool_get(segs);
+      pooled = p != nullptr;
+      if (!pooled)
+        p = __iarv64_alloc(segs, xttoken, &rc, &reason);
+    }
     size_t size = segs * kMegaByte;
     if (p) {
       unsigned long k = (unsigned long)p;
-      cache[k] = size;
-      curmem64 += size;
-      maxmem64 = max(maxmem64, curmem64);
+      __shard &s = get_shard(k);
+      std::lock_guard<std::mutex> guard(s.access_lock);
+      s.cache[k] = size | tag;
+      segments.fetch_add(1, std::memory_order_relaxed);
+      size_t cur = add_mem(curmem64, maxmem64, size);
       if (__doLogMemoryAll()) {
-        __memprintf("addr=%p, size=%zu: iarv64_alloc OK (current=%zu, " \
-                    "max=%zu)\n", p, size, curmem64, maxmem64);
+        const char *frames = tag == kSegFrames2G   ? "2G"
+                             : tag == kSegFrames1M ? "1M"
+                                                   : "4K/pageable 1M";
+        __memprintf("addr=%p, size=%zu: iarv64_alloc OK%s, frames=%s " \
+                    "(current=%zu, max=%zu)\n", p, size,
+                    pooled ? " from pool" : "", frames, cur, getMaxMem64());
       }
     } else if (__doLogMemoryUsage()) {
       __memprintf("ERROR: size=%zu: iarv64_alloc failed, rc=%llx, " \
                   "reason=%llx (current=%zu, max=%zu)\n",
-                  size, rc, reason, curmem64, maxmem64);
+                  size, rc, reason, getCurrentMem64(), getMaxMem64());
     }
     return p;
   }
   int free_seg(void *ptr, size_t reqsize) {
     unsigned long k = (unsigned long)ptr;
     long long rc, reason;
+    size_t size;
+    bool fixed;
     {
-      std::lock_guard<std::mutex> guard(access_lock);
-      mem_cursor_t c = cache.find(k);
-      if (c != cache.end()) {
-        size_t size = c->second;
-        cache.erase(c);
-        rc = __iarv64_free(ptr, xttoken, &reason);
-        if (rc == 0) {
-          curmem64 -= size;
-          if (__doLogMemoryUsage()) {
-            const char *w = size != reqsize ? " VWARN size vs req-size" : "";
-            if (__doLogMemoryAll() || (*w && __doLogMemoryWarning()))
-              __memprintf("addr=%p size=%zu req-size=%zu iarv64_free OK " \
-                          "(v64=%zu)%s\n", ptr, size, reqsize, curmem64, w);
-          }
-        } else if (__doLogMemoryUsage()) {
-          __memprintf("VERROR addr=%p size=%zu iarv64_free failed " \
-                      "rc=%llx, reason=%llx (v64=%zu)\n", ptr, size,
-                      rc, reason, curmem64);
-        }
-        return rc;
+      __shard &s = get_shard(k);
+      std::lock_guard<std::mutex> guard(s.access_lock);
+      mem_cursor_t c = s.cache.find(k);
+      if (c == s.cache.end())
+        return -1;
+      size = c->second & ~kSegFramesMask;
+      // Fixed frames can't be discarded, so such segments aren't pooled.
+      fixed = (c->second & kSegFramesMask) != 0;
+      s.cache.erase(c);
+      segments.fetch_sub(1, std::memory_order_relaxed);
+    }
+    bool pooled = !fixed && pool_put(ptr, size);
+    rc = pooled ? 0 : __iarv64_free(ptr, xttoken, &reason);
+    if (rc == 0) {
+      size_t cur = sub_mem(curmem64, size);
+      if (__doLogMemoryUsage()) {
+        const char *w = size != reqsize ? " VWARN size vs req-size" : "";
+        if (__doLogMemoryAll() || (*w && __doLogMemoryWarning()))
+          __memprintf("addr=%p size=%zu req-size=%zu iarv64_free OK%s " \
+                      "(v64=%zu)%s\n", ptr, size, reqsize,
+                      pooled ? " to pool" : "", cur, w);
       }
+    } else if (__doLogMemoryUsage()) {
+      __memprintf("VERROR addr=%p size=%zu iarv64_free failed " \
+                  "rc=%llx, reason=%llx (v64=%zu)\n", ptr, size,
+                  rc, reason, getCurrentMem64());
     }
-
-    return -1;
+    return rc;
   }
 #else
   void *alloc_seg(int segs) {
     void *p = __mo_alloc(segs);
-    std::lock_guard<std::mutex> guard(access_lock);
     if (p) {
       unsigned long k = (unsigned long)p;
-      cache[k] = (unsigned long)segs * kMegaByte;
+      __shard &s = get_shard(k);
+      std::lock_guard<std::mutex> guard(s.access_lock);
+      s.cache[k] = (unsigned long)segs * kMegaByte;
+      segments.fetch_add(1, std::memory_order_relaxed);
       if (mem_account())
         dprintf(2, "MEM_CACHE INSERTED: @%lx size %lu RMODE64\n", k,
                 (unsigned long)segs * kMegaByte);
@@ -1324,58 +3399,68 @@ public:
   int free_seg(void *ptr) {
     unsigned long k = (unsigned long)ptr;
     int rc = __mo_free(ptr);
-    std::lock_guard<std::mutex> guard(access_lock);
     if (rc == 0) {
-      mem_cursor_t c = cache.find(k);
-      if (c != cache.end()) {
-        unsigned long s = c->second;
-        cache.erase(c);
+      __shard &s = get_shard(k);
+      std::lock_guard<std::mutex> guard(s.access_lock);
+      mem_cursor_t c = s.cache.find(k);
+      if (c != s.cache.end()) {
+        unsigned long size = c->second;
+        s.cache.erase(c);
+        segments.fetch_sub(1, std::memory_order_relaxed);
         if (mem_account()) {
-          dprintf(2, "MEM_CACHE DELETED: @%lx size %lu RMODE64\n", k, s);
+          dprintf(2, "MEM_CACHE DELETED: @%lx size %lu RMODE64\n", k, size);
         }
       }
     }
     return rc;
   }
-#endif
-  int is_rmode64(const void *ptr) {
-    unsigned long k = (unsigned long)ptr;
-    std::lock_guard<std::mutex> guard(access_lock);
-    mem_cursor_t c = cache.find(k);
-    if (c != cache.end()) {
-      if (0 != (k & 0xffffffff80000000UL))
-        return 1;
-      else
-        return 0;
-    }
-    return 0;
-  }
-  void freeptr31(const void *ptr, size_t reqsize) {
-    unsigned long k = (unsigned long)ptr;
-    std::lock_guard<std::mutex> guard(access_lock);
-    mem_cursor_t c = cache.find(k);
-    if (c != cache.end()) {
-      curmem31 -= c->second;
-      if (__doLogMemoryUsage()) {
-        const char *w = c->second != reqsize ? " WARNING: size vs req-size" : "";
-        if (__doLogMemoryAll() || (*w && __doLogMemoryWarning()))
-          __memprintf("addr=%p, size=%zu, req-size=%zu: free31 OK " \
-                    "(current=%zu)%s\n", ptr, c->second, reqsize, curmem31, w);
-      }
-      cache.erase(c);
-    } else {
-      if (__doLogMemoryWarning()) {
-        __memprintf("WARNING: addr=%p, req-size=%zu free31 OK but not found " \
-                    "in cache\n", ptr, reqsize);
+#endif
+  void freeptr31(const void *ptr, size_t size, size_t reqsize, bool tracked) {
+    if (tracked) {
+      unsigned long k = (unsigned long)ptr;
+      __shard &s = get_shard(k);
+      std::lock_guard<std::mutex> guard(s.access_lock);
+      mem_cursor_t c = s.cache.find(k);
+      if (c == s.cache.end()) {
+        if (__doLogMemoryWarning()) {
+          __memprintf("WARNING: addr=%p, req-size=%zu free31 OK but not " \
+                      "found in cache\n", ptr, reqsize);
+        }
+      } else {
+        if (c->second != size && __doLogMemoryWarning()) {
+          __memprintf("WARNING: addr=%p, size=%zu, cache-size=%zu: free31 " \
+                      "header doesn't match cache\n", ptr, size, c->second);
+        }
+        s.cache.erase(c);
       }
     }
+    size_t cur = sub_mem(curmem31, size);
+    if (__doLogMemoryUsage()) {
+      const char *w = size != reqsize ? " WARNING: size vs req-size" : "";
+      if (__doLogMemoryAll() || (*w && __doLogMemoryWarning()))
+        __memprintf("addr=%p, size=%zu, req-size=%zu: free31 OK " \
+                    "(current=%zu)%s\n", ptr, size, reqsize, cur, w);
+    }
   }
   void displayDebris() {
     // This should only be called during exit-time, so there's no lock.
-    for (mem_cursor_t it = cache.begin(); it != cache.end(); ++it) {
-      __memprintf("WARNING: addr=%lx, size=%lu: DEBRIS (allocated but not " \
-                  "freed)\n", it->first, it->second);
+    for (int i = 0; i < kNumShards; ++i) {
+      for (mem_cursor_t it = shards[i].cache.begin();
+           it != shards[i].cache.end(); ++it) {
+        __memprintf("WARNING: addr=%lx, size=%lu: DEBRIS (allocated but not " \
+                    "freed)\n", it->first, it->second & ~kSegFramesMask);
+      }
+    }
+    slabs.for_each_allocated([](const void *p, size_t size) {
+      __memprintf("WARNING: addr=%lx, size=%zu: DEBRIS (allocated but not " \
+                  "freed)\n", (unsigned long)p, size);
+    });
+#if __USE_IARV64
+    for (auto &r : reservations) {
+      __memprintf("WARNING: addr=%lx, size=%zu: DEBRIS (reserved but not " \
+                  "released)\n", r.first, r.second.segs * kMegaByte);
     }
+#endif
   }
   ~__Cache() {
     // This should never be called as we deliberately don't destroy it.
@@ -1391,7 +3476,34 @@ static __Cache * __get_galloc_info() {
   return __galloc_info;
 }
 
-extern "C" void *__zalloc(size_t len, size_t alignment) {
+#if __USE_IARV64
+static void *__seg_pool_trimmer(void *) {
+  // Runs while the segment pool isn't empty; restarted by the next release
+  // of a segment into the pool.
+  do {
+    sleep(kSegPoolIdleSecs);
+  } while (!__get_galloc_info()->trimSegPool(kSegPoolIdleSecs));
+  return nullptr;
+}
+#endif
+
+// Runs when a thread that has a cache ends. A thread cache created again by a
+// later key destructor is released in the next round of destructors.
+static void __tcache_thread_exit(void *tc) {
+  __get_galloc_info()->releaseTCache(tc);
+}
+
+static void *__memory_pressure_monitor(void *) {
+  do {
+    sleep(kPressureIntervalSecs);
+  } while (__get_galloc_info()->checkPressure());
+  return nullptr;
+}
+
+// Segments are always zero when they're handed out: new ones come zeroed from
+// the system, and pooled ones had their frames discarded. Only blocks that
+// may have been used before are cleared, and only if zero is set.
+static void *__zalloc_block(size_t len, size_t alignment, bool zero) {
   if (len % kMegaByte == 0) {
     size_t request_size = len / kMegaByte;
     return __get_galloc_info()->alloc_seg(request_size);
@@ -1406,17 +3518,35 @@ extern "C" void *__zalloc(size_t len, size_t alignment) {
     // STORAGE OBTAIN,LENGTH=(%2),BNDRY=PAGE,COND=YES,ADDR=(%0),RTCD=(%1),LOC=(31,64)
     len = (len + 7) &(-8);
 
-    size_t extra_size = alignment - 1 + sizeof(void *);
+    int cls = __SlabAllocator::size_class(len, alignment);
+    if (cls >= 0 && (p = __get_galloc_info()->alloc_slab(cls)) != nullptr) {
+      if (zero)
+        memset(p, 0, len);
+      return p;
+    }
+
+    size_t extra_size = alignment - 1 + sizeof(__blk31_header);
 
     // Allocate the required size and a bit extra
     void *mem_default = __malloc31(len + extra_size);
     if (mem_default == NULL) {
+      __get_galloc_info()->countFallback();
       if (__doLogMemoryUsage()) {
         __memprintf("ERROR: size=%zu: malloc31 failed, errno=%d " \
                    "(current=%zu), will try to allocate from virtual storage\n",
                    len + extra_size, errno,
                    __get_galloc_info()->getCurrentMem31());
       }
+      // Share segments between small requests rather than spending a whole
+      // segment on each one.
+      size_t dirty;
+      if (__SegSubAllocator::fits(len, alignment) &&
+          (p = __get_galloc_info()->alloc_sub(len, alignment, &dirty)) !=
+              nullptr) {
+        if (zero && dirty)
+          memset(p, 0, dirty);
+        return p;
+      }
       size_t up_size = __round_up(len + extra_size, kMegaByte);
       size_t request_size = up_size / kMegaByte;
       return __get_galloc_info()->alloc_seg(request_size);
@@ -1424,35 +3554,413 @@ extern "C" void *__zalloc(size_t len, size_t alignment) {
 
     void **mem_aligned = (void **)(((size_t)(mem_default) +
                                              extra_size) & ~(alignment - 1));
-    mem_aligned[-1] = mem_default;
+    __blk31_header *h = (__blk31_header *)mem_aligned - 1;
+    h->mem = mem_default;
+    bool tracked = __doLogMemoryWarning();
+    h->size = len | (tracked ? kBlk31Tracked : 0);
 
     p = (void *)mem_aligned;
-    __get_galloc_info()->addptr31(p, len);
-    memset(p, 0, len);
+    __get_galloc_info()->addptr31(p, len, tracked);
+    if (zero)
+      memset(p, 0, len);
     return p;
   }
 }
 
+static void *__zalloc_internal(size_t len, size_t alignment, bool zero,
+                               int tag = 0) {
+  void *p;
+  if (tag == 0)
+    p = __zalloc_block(len, alignment, zero);
+  else if (!__get_galloc_info()->chargeTagged(tag, len))
+    p = nullptr;
+  else if ((p = __zalloc_block(len, alignment, zero)) == nullptr)
+    __get_galloc_info()->unchargeTagged(tag, len);
+  __get_galloc_info()->countAlloc(p, len);
+  unsigned int stack = 0;
+  if (p) {
+    if (tag)
+      __get_galloc_info()->countTagged(p, tag, len);
+    __get_galloc_info()->indexBlock(p, len);
+    stack = __get_galloc_info()->profiler.recordAlloc(p, len);
+  }
+  if (__doLogMemoryEvents()) {
+    __memlog_event(p ? ZOSLIB_MEMLOG_ALLOC : ZOSLIB_MEMLOG_ALLOC_FAILED, p,
+                   len, stack);
+  }
+  if (p) {
+    __get_galloc_info()->checkWatermarks(
+        0 != ((unsigned long)p & 0xffffffff80000000UL));
+  }
+  return p;
+}
+
+extern "C" void *__zalloc(size_t len, size_t alignment) {
+  return __zalloc_internal(len, alignment, true);
+}
+
+extern "C" void *__zalloc_nozero(size_t len, size_t alignment) {
+  return __zalloc_internal(len, alignment, false);
+}
+
+extern "C" void *__zalloc_tagged(size_t len, size_t alignment, int tag) {
+  if (tag < 0 || tag >= ZALLOC_MAX_TAGS) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  return __zalloc_internal(len, alignment, true, tag);
+}
+
 void *anon_mmap(void *_, size_t len) {
   void *p = __zalloc(len, PAGE_SIZE);
   return (p == nullptr) ? MAP_FAILED : p;
 }
 
-extern "C" int __zfree(void *addr, int len) {
-  if (__get_galloc_info()->is_rmode64(addr)) {
-    return __get_galloc_info()->free_seg(addr, len);
+static int __zfree_block(void *addr, int len) {
+  // Only segments and blocks carved out of them are above the bar; segments
+  // are megabyte aligned and blocks never are. free_seg() and free_sub() fail
+  // if addr isn't one of theirs.
+  if (0 != ((unsigned long)addr & 0xffffffff80000000UL)) {
+    int rc = ((unsigned long)addr & (kMegaByte - 1))
+                 ? __get_galloc_info()->free_sub(addr, len)
+                 : __get_galloc_info()->free_seg(addr, len);
+    if (rc == 0)
+      __get_galloc_info()->countFree(addr);
+    return rc;
+  }
+  int rc;
+  if (__get_galloc_info()->free_slab(addr, len, &rc)) {
+    if (rc == 0)
+      __get_galloc_info()->countFree(addr);
+    return rc;
   }
+  __get_galloc_info()->countFree(addr);
+  // Anything else below the bar came from __malloc31, with a header in front.
+  // Drop the block from the registry before releasing it, otherwise another
+  // thread could get the same address from __malloc31 and register it before
+  // this entry is removed.
+  __blk31_header *h = (__blk31_header *)addr - 1;
+  __get_galloc_info()->freeptr31(addr, h->size & ~kBlk31Tracked, len,
+                                 (h->size & kBlk31Tracked) != 0);
   // Free the original unaligned memory returned by __malloc31. Since free()
   // doesn't return a value, simply return 0.
-  free(((void **)addr)[-1]);
-  __get_galloc_info()->freeptr31(addr, len);
+  free(h->mem);
   return 0;
 }
 
+extern "C" int __zfree(void *addr, int len) {
+  __get_galloc_info()->profiler.recordFree(addr);
+  __get_galloc_info()->uncountTagged(addr);
+  // Like the registry entry, the index entry goes before the block does, and
+  // so does the event, which the event log readers rely on.
+  __get_galloc_info()->unindexBlock(addr, len);
+  if (__doLogMemoryEvents())
+    __memlog_event(ZOSLIB_MEMLOG_FREE, addr, len, 0);
+  int rc = __zfree_block(addr, len);
+  if (rc == 0)
+    __get_galloc_info()->checkWatermarks(
+        0 != ((unsigned long)addr & 0xffffffff80000000UL));
+  return rc;
+}
+
 int anon_munmap(void *addr, size_t len) {
   return __zfree(addr, len);
 }
 
+extern "C" int __zalloc_heap_profile(int fd) {
+  return __get_galloc_info()->profiler.dump(fd);
+}
+
+// An arena bump-allocates from chunks obtained with __zalloc(), and releases
+// them all at once. The arena itself lives at the start of its first chunk,
+// which is kept across resets. Each arena counts its own allocations, which
+// are summed over the list of arenas when the stats are read, so allocating
+// from an arena doesn't touch any shared counter.
+struct __zarena_chunk {
+  __zarena_chunk *next;
+  size_t size;
+  size_t used;  // offset of the first free byte
+  size_t clean; // the chunk is known to be zero from this offset on
+} __attribute__((aligned(16)));
+
+struct __zarena {
+  __zarena_chunk *first;  // holds the arena
+  __zarena_chunk *chunks; // the chunk being allocated from comes first
+  size_t chunk_size;
+  size_t bytes;               // in chunks
+  std::atomic<size_t> allocs; // since the last reset
+  __zarena *next;             // in __zarena_list
+  __zarena *prev;
+};
+
+static const size_t kZarenaDefaultChunk = kMegaByte;
+
+static std::mutex __zarena_lock;
+static __zarena *__zarena_list = nullptr; // guarded by __zarena_lock
+
+// Returns the number of blocks allocated from the arenas that exist since
+// they were last reset.
+static size_t __zarena_allocs() {
+  std::lock_guard<std::mutex> guard(__zarena_lock);
+  size_t n = 0;
+  for (__zarena *a = __zarena_list; a != nullptr; a = a->next)
+    n += a->allocs.load(std::memory_order_relaxed);
+  return n;
+}
+
+static __zarena_chunk *__zarena_new_chunk(size_t size) {
+  // Chunks that aren't a megabyte multiple come from below the bar.
+  __zarena_chunk *c = (__zarena_chunk *)__zalloc(size, PAGE_SIZE);
+  if (c == nullptr)
+    return nullptr;
+  c->next = nullptr;
+  c->size = size;
+  c->used = c->clean = sizeof(__zarena_chunk);
+  return c;
+}
+
+// Returns len bytes aligned on alignment from c, or null if they don't fit.
+static void *__zarena_bump(__zarena_chunk *c, size_t len, size_t alignment) {
+  size_t start = __round_up((size_t)c + c->used, alignment) - (size_t)c;
+  if (start + len > c->size || start + len < start)
+    return nullptr;
+  void *p = (char *)c + start;
+  if (c->clean > start)
+    memset(p, 0, MIN(c->clean, start + len) - start);
+  c->used = start + len;
+  if (c->used > c->clean)
+    c->clean = c->used;
+  return p;
+}
+
+extern "C" __zarena_t *__zarena_create(size_t chunk_size) {
+  if (chunk_size == 0)
+    chunk_size = kZarenaDefaultChunk;
+  if (chunk_size < sizeof(__zarena_chunk) + sizeof(__zarena)) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  __zarena_chunk *c = __zarena_new_chunk(chunk_size);
+  if (c == nullptr)
+    return nullptr;
+  __zarena *a = new (__zarena_bump(c, sizeof(__zarena), alignof(__zarena)))
+      __zarena;
+  a->first = a->chunks = c;
+  a->chunk_size = chunk_size;
+  a->bytes = chunk_size;
+  a->allocs = 0;
+  {
+    std::lock_guard<std::mutex> guard(__zarena_lock);
+    a->prev = nullptr;
+    a->next = __zarena_list;
+    if (__zarena_list)
+      __zarena_list->prev = a;
+    __zarena_list = a;
+  }
+  __get_galloc_info()->countArena(1, chunk_size);
+  if (__doLogMemoryAll()) {
+    __memprintf("arena=%p, chunk-size=%zu: arena created\n", a, chunk_size);
+  }
+  return a;
+}
+
+extern "C" void *__zarena_alloc(__zarena_t *a, size_t len, size_t alignment) {
+  if (alignment < sizeof(void *))
+    alignment = sizeof(void *);
+  void *p = __zarena_bump(a->chunks, len, alignment);
+  if (p == nullptr) {
+    // A block that needs more than a quarter of a chunk gets a chunk of its
+    // own, behind the current one, so the rest of the current one isn't
+    // wasted.
+    size_t need = sizeof(__zarena_chunk) + len + alignment;
+    bool own = need > a->chunk_size / 4;
+    size_t size = own ? need : a->chunk_size;
+    if (own && a->chunk_size % kMegaByte == 0)
+      size = __round_up(size, kMegaByte);
+    __zarena_chunk *c = __zarena_new_chunk(size);
+    if (c == nullptr)
+      return nullptr;
+    if (own) {
+      c->next = a->chunks->next;
+      a->chunks->next = c;
+    } else {
+      c->next = a->chunks;
+      a->chunks = c;
+    }
+    a->bytes += size;
+    __get_galloc_info()->countArena(0, size);
+    p = __zarena_bump(c, len, alignment);
+  }
+  // Only this thread updates the count; the stats read it concurrently.
+  a->allocs.store(a->allocs.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+  return p;
+}
+
+// Releases every chunk but the first, and returns the number of bytes freed.
+static size_t __zarena_release_chunks(__zarena *a) {
+  size_t freed = 0;
+  for (__zarena_chunk *c = a->chunks, *next; c != nullptr; c = next) {
+    next = c->next;
+    if (c != a->first) {
+      freed += c->size;
+      __zfree(c, c->size);
+    }
+  }
+  a->chunks = a->first;
+  a->first->next = nullptr;
+  return freed;
+}
+
+extern "C" void __zarena_reset(__zarena_t *a) {
+  size_t freed = __zarena_release_chunks(a);
+  size_t allocs = a->allocs.exchange(0, std::memory_order_relaxed);
+  a->first->used = (char *)(a + 1) - (char *)a->first;
+  a->bytes -= freed;
+  __get_galloc_info()->countArena(0, -(long)freed);
+  if (__doLogMemoryAll()) {
+    __memprintf("arena=%p, size=%zu, allocs=%zu: arena reset (size=%zu)\n",
+                a, a->bytes + freed, allocs, a->bytes);
+  }
+}
+
+extern "C" void __zarena_destroy(__zarena_t *a) {
+  __zarena_release_chunks(a);
+  size_t bytes = a->bytes, allocs = a->allocs.load(std::memory_order_relaxed);
+  __zarena_chunk *first = a->first;
+  {
+    std::lock_guard<std::mutex> guard(__zarena_lock);
+    if (a->prev)
+      a->prev->next = a->next;
+    else
+      __zarena_list = a->next;
+    if (a->next)
+      a->next->prev = a->prev;
+  }
+  __get_galloc_info()->countArena(-1, -(long)bytes);
+  if (__doLogMemoryAll()) {
+    __memprintf("arena=%p, size=%zu, allocs=%zu: arena destroyed\n", a,
+                bytes, allocs);
+  }
+  __zfree(first, first->size);
+}
+
+extern "C" int __zalloc_stats(struct zalloc_stats *stats) {
+  if (stats == nullptr) {
+    errno = EINVAL;
+    return -1;
+  }
+  __get_galloc_info()->getStats(stats);
+  return 0;
+}
+
+extern "C" int __zalloc_watermark_register(int area, size_t bytes,
+                                           size_t growth_rate,
+                                           zalloc_watermark_callback_t callback,
+                                           void *arg) {
+  if ((area != ZALLOC_WATERMARK_31 && area != ZALLOC_WATERMARK_64) ||
+      (bytes == 0) == (growth_rate == 0) || callback == nullptr) {
+    errno = EINVAL;
+    return -1;
+  }
+  return __get_galloc_info()->addWatermark(area, bytes, growth_rate, callback,
+                                           arg);
+}
+
+extern "C" int
+__zalloc_watermark_unregister(zalloc_watermark_callback_t callback,
+                              void *arg) {
+  return __get_galloc_info()->removeWatermarks(callback, arg);
+}
+
+extern "C" int __zalloc_tag_config(int tag, const char *name,
+                                   size_t soft_limit, int flags) {
+  if (tag <= 0 || tag >= ZALLOC_MAX_TAGS) {
+    errno = EINVAL;
+    return -1;
+  }
+  __get_galloc_info()->setTag(tag, name, soft_limit,
+                              (flags & ZALLOC_TAG_FAIL_OVER_LIMIT) != 0);
+  return 0;
+}
+
+extern "C" int __zalloc_tag_stats(int tag, struct zalloc_tag_stats *stats) {
+  if (tag <= 0 || tag >= ZALLOC_MAX_TAGS || stats == nullptr) {
+    errno = EINVAL;
+    return -1;
+  }
+  __get_galloc_info()->getTagStats(tag, stats);
+  return 0;
+}
+
+extern "C" int __zalloc_find(const void *ptr, void **base, size_t *len) {
+  void *b;
+  size_t l;
+  if (!__get_galloc_info()->findBlock(ptr, &b, &l)) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (base)
+    *base = b;
+  if (len)
+    *len = l;
+  return 0;
+}
+
+extern "C" int __zalloc_pressure_register(zalloc_pressure_callback_t callback,
+                                          void *arg) {
+  if (callback == nullptr) {
+    errno = EINVAL;
+    return -1;
+  }
+  return __get_galloc_info()->addPressureCallback(callback, arg);
+}
+
+extern "C" int
+__zalloc_pressure_unregister(zalloc_pressure_callback_t callback, void *arg) {
+  return __get_galloc_info()->removePressureCallback(callback, arg);
+}
+
+extern "C" void *__zreserve(size_t len) {
+#if __USE_IARV64
+  if (len == 0) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  return __get_galloc_info()->reserve(len);
+#else
+  errno = ENOSYS;
+  return nullptr;
+#endif
+}
+
+extern "C" int __zcommit(void *addr, size_t len) {
+#if __USE_IARV64
+  return __get_galloc_info()->change_reservation(addr, len, true);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+extern "C" int __zdecommit(void *addr, size_t len) {
+#if __USE_IARV64
+  return __get_galloc_info()->change_reservation(addr, len, false);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+extern "C" int __zrelease(void *addr) {
+#if __USE_IARV64
+  return __get_galloc_info()->release(addr);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
 extern "C" int execvpe(const char *name, char *const argv[],
                        char *const envp[]) {
   // Absolute or Relative Path Name
@@ -2152,8 +4660,8 @@ unsigned long long __registerProduct(const char *major_version,
   return ifausage_rc;
 }
 
-extern "C" void *__zalloc_for_fd(size_t len, const char *filename, int fd,
-                                  off_t offset) {
+static void *__zalloc_for_fd_internal(size_t len, const char *filename,
+                                      int fd, off_t offset, int tag) {
   // Allocate memory to read contents of given file at the given offset;
   // handles conversion if file contains EBCDIC data.
   // TODO(gabylb): mmap() could be used and the mapped memory contents converted
@@ -2172,16 +4680,19 @@ extern "C" void *__zalloc_for_fd(size_t len, const char *filename, int fd,
   }
   static const int pgsize = sysconf(_SC_PAGESIZE);
   size_t size = __round_up(len, pgsize);
-  void *memory = __zalloc(size, pgsize);
+  // The first len bytes are read from the file, so only the rest of the last
+  // page needs clearing.
+  void *memory = __zalloc_internal(size, pgsize, false, tag);
   if (memory == nullptr) {
     return memory;
   }
   size_t nread = read(fd, memory, len);
   if (nread != len) {
     perror("read");
-    __zfree(memory, len);
+    __zfree(memory, size);
     return nullptr;
   }
+  memset((char *)memory + len, 0, size - len);
   if (st.st_tag.ft_txtflag == 0 && st.st_tag.ft_ccsid == 0) {
     __file_needs_conversion_init(filename, fd);
     if (__file_needs_conversion(fd)) {
@@ -2191,6 +4702,20 @@ extern "C" void *__zalloc_for_fd(size_t len, const char *filename, int fd,
   return memory;
 }
 
+extern "C" void *__zalloc_for_fd(size_t len, const char *filename, int fd,
+                                  off_t offset) {
+  return __zalloc_for_fd_internal(len, filename, fd, offset, 0);
+}
+
+extern "C" void *__zalloc_for_fd_tagged(size_t len, const char *filename,
+                                        int fd, off_t offset, int tag) {
+  if (tag < 0 || tag >= ZALLOC_MAX_TAGS) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  return __zalloc_for_fd_internal(len, filename, fd, offset, tag);
+}
+
 extern "C" void *roanon_mmap(void *_, size_t len, int prot, int flags,
                              const char *filename, int fd, off_t offset) {
   void *p = __zalloc_for_fd(len, filename, fd, offset);
@@ -2290,6 +4815,53 @@ int __update_envar_settings(const char *envar) {
   if (force_update_all || strcmp(envar, config.MEMORY_USAGE_LOG_INC_ENVAR) == 0)
     update_memlogging_inc(zinit_ptr, envar);
 
+  if (force_update_all ||
+      strcmp(envar, config.MEMORY_EVENT_LOG_FILE_ENVAR) == 0)
+    update_memlogging_events(zinit_ptr, envar);
+
+  if (force_update_all ||
+      strcmp(envar, config.MEMORY_SAMPLE_FILE_ENVAR) == 0 ||
+      strcmp(envar, config.MEMORY_SAMPLE_INTERVAL_ENVAR) == 0)
+    update_memory_sampler(zinit_ptr, envar);
+
+#if __USE_IARV64
+  if (force_update_all ||
+      strcmp(envar, config.MEMORY_SEGMENT_POOL_MAX_ENVAR) == 0) {
+    char *sp = __getenv_a(config.MEMORY_SEGMENT_POOL_MAX_ENVAR);
+    int mb = sp ? __atoi_a(sp) : kSegPoolDefaultMax;
+    __get_galloc_info()->setSegPoolMax(mb > 0 ? mb * kMegaByte : 0);
+  }
+
+  if (force_update_all ||
+      strcmp(envar, config.MEMORY_LARGE_FRAMES_ENVAR) == 0) {
+    char *lf = __getenv_a(config.MEMORY_LARGE_FRAMES_ENVAR);
+    size_t frame_size = 0;
+    if (lf && (!strcmp(lf, "1M") || !strcmp(lf, "1m")))
+      frame_size = kLargeFrames1M;
+    else if (lf && (!strcmp(lf, "2G") || !strcmp(lf, "2g")))
+      frame_size = kLargeFrames2G;
+    __get_galloc_info()->setLargeFrames(frame_size);
+  }
+#endif
+
+  if (force_update_all ||
+      strcmp(envar, config.MEMORY_PROFILE_RATE_ENVAR) == 0) {
+    char *pr = __getenv_a(config.MEMORY_PROFILE_RATE_ENVAR);
+    int rate = pr ? __atoi_a(pr) : 0;
+    __get_galloc_info()->profiler.setRate(rate > 0 ? rate : 0);
+  }
+
+  if (force_update_all ||
+      strcmp(envar, config.MEMORY_PRESSURE_FRAMES_ENVAR) == 0 ||
+      strcmp(envar, config.MEMORY_PRESSURE_LIMIT_ENVAR) == 0) {
+    char *pf = __getenv_a(config.MEMORY_PRESSURE_FRAMES_ENVAR);
+    char *pl = __getenv_a(config.MEMORY_PRESSURE_LIMIT_ENVAR);
+    int frames = pf ? __atoi_a(pf) : 0;
+    int mb = pl ? __atoi_a(pl) : 0;
+    __get_galloc_info()->setPressureLimits(frames > 0 ? frames : 0,
+                                           mb > 0 ? mb * kMegaByte : 0);
+  }
+
   return 0;
 }
 
@@ -2480,6 +5052,7 @@ __zinit::__zinit() {
 
   update_memlogging(__get_instance(), nullptr);
   update_memlogging_level(__get_instance(), nullptr);
+  update_memlogging_events(__get_instance(), nullptr);
 
   if (__doLogMemoryUsage()) {
     int len = 0;
@@ -2537,15 +5110,27 @@ __zinit:: ~__zinit() {
                         "LEAK: " : "";
      
     __memprintf("%s%sPROCESS TERMINATING (current31=%zu, max31=%zu, " \
-                "current64=%zu, max64=%zu): %s\n",
+                "current64=%zu, max64=%zu, segpool-hits=%zu, " \
+                "segpool-misses=%zu): %s\n",
                 leak, childInfo,
                 __get_galloc_info()->getCurrentMem31(),
                 __get_galloc_info()->getMaxMem31(),
                 __get_galloc_info()->getCurrentMem64(),
                 __get_galloc_info()->getMaxMem64(),
+#if __USE_IARV64
+                __get_galloc_info()->getSegPoolHits(),
+                __get_galloc_info()->getSegPoolMisses(),
+#else
+                (size_t)0, (size_t)0,
+#endif
                 __gArgsStr);
+    __get_galloc_info()->displayArenas();
+    __get_galloc_info()->displayTags();
   }
+  // From here on __memprintf() writes directly to the log file; write out
+  // what it has buffered so far.
   __zoslib_terminated = true;
+  __memprintf_flush();
 }
 
 __init_zoslib::__init_zoslib(const zoslib_config_t &config) {
@@ -2732,6 +5317,66 @@ int __zinit::setEnvarHelpMap() {
                      "memory statistics summary, and any error messages are "
                      "always displayed if logging of memory diagnostic "
                      "messages is enabled"));
+
+  envarHelpMap.insert(
+      std::make_pair(zoslibEnvar(config.MEMORY_EVENT_LOG_FILE_ENVAR,
+                                 std::string("")),
+                     "name of a file to which every memory allocation and "
+                     "release is logged in a compact binary format, for "
+                     "analysis with zoslib-memlog; %PID% and %PPID% in it "
+                     "are replaced by the process and parent process IDs"));
+
+  envarHelpMap.insert(
+      std::make_pair(zoslibEnvar(config.MEMORY_SAMPLE_FILE_ENVAR,
+                                 std::string("")),
+                     "name of a CSV file to which the current and peak "
+                     "memory usage, segment and block counts are appended "
+                     "periodically by a sampler thread; %PID% and %PPID% "
+                     "in it are replaced by the process and parent process "
+                     "IDs"));
+
+  envarHelpMap.insert(
+      std::make_pair(zoslibEnvar(config.MEMORY_SAMPLE_INTERVAL_ENVAR,
+                                 std::string("")),
+                     "milliseconds between the samples written to "
+                     "__MEMORY_SAMPLE_FILE (default: 1000)"));
+
+  envarHelpMap.insert(
+      std::make_pair(zoslibEnvar(config.MEMORY_SEGMENT_POOL_MAX_ENVAR,
+                                 std::string("")),
+                     "maximum number of megabytes of released 64-bit "
+                     "segments to keep for reuse by later allocations, or 0 "
+                     "to release them immediately (default: 64)"));
+
+  envarHelpMap.insert(
+      std::make_pair(zoslibEnvar(config.MEMORY_LARGE_FRAMES_ENVAR,
+                                 std::string("")),
+                     "set to 1M or 2G to back 64-bit segments with fixed "
+                     "large frames of that size, if the system has them "
+                     "configured (2G frames only back multiples of 2GB)"));
+
+  envarHelpMap.insert(
+      std::make_pair(zoslibEnvar(config.MEMORY_PROFILE_RATE_ENVAR,
+                                 std::string("")),
+                     "record the call stack of about one allocation per this "
+                     "many bytes allocated by __zalloc, for "
+                     "__zalloc_heap_profile() (default: 0, no profiling)"));
+
+  envarHelpMap.insert(
+      std::make_pair(zoslibEnvar(config.MEMORY_PRESSURE_FRAMES_ENVAR,
+                                 std::string("")),
+                     "trim the allocator's caches and call the callbacks "
+                     "registered with __zalloc_pressure_register() while "
+                     "fewer than this many frames are available to the "
+                     "system (default: 0, not monitored)"));
+
+  envarHelpMap.insert(
+      std::make_pair(zoslibEnvar(config.MEMORY_PRESSURE_LIMIT_ENVAR,
+                                 std::string("")),
+                     "trim the allocator's caches and call the callbacks "
+                     "registered with __zalloc_pressure_register() while "
+                     "__zalloc has more than this many megabytes allocated "
+                     "(default: 0, not monitored)"));
  
 
   return __update_envar_settings(NULL);
@@ -2973,6 +5618,15 @@ extern "C" void init_zoslib_config(zoslib_config_t *const config) {
       UNTAGGED_READ_MODE_CCSID1047_DEFAULT;
   config->MEMORY_USAGE_LOG_FILE_ENVAR = MEMORY_USAGE_LOG_FILE_ENVAR_DEFAULT;
   config->MEMORY_USAGE_LOG_LEVEL_ENVAR = MEMORY_USAGE_LOG_LEVEL_ENVAR_DEFAULT;
+  config->MEMORY_USAGE_LOG_INC_ENVAR = MEMORY_USAGE_LOG_INC_ENVAR_DEFAULT;
+  config->MEMORY_SEGMENT_POOL_MAX_ENVAR = MEMORY_SEGMENT_POOL_MAX_ENVAR_DEFAULT;
+  config->MEMORY_LARGE_FRAMES_ENVAR = MEMORY_LARGE_FRAMES_ENVAR_DEFAULT;
+  config->MEMORY_PROFILE_RATE_ENVAR = MEMORY_PROFILE_RATE_ENVAR_DEFAULT;
+  config->MEMORY_PRESSURE_FRAMES_ENVAR = MEMORY_PRESSURE_FRAMES_ENVAR_DEFAULT;
+  config->MEMORY_PRESSURE_LIMIT_ENVAR = MEMORY_PRESSURE_LIMIT_ENVAR_DEFAULT;
+  config->MEMORY_EVENT_LOG_FILE_ENVAR = MEMORY_EVENT_LOG_FILE_ENVAR_DEFAULT;
+  config->MEMORY_SAMPLE_FILE_ENVAR = MEMORY_SAMPLE_FILE_ENVAR_DEFAULT;
+  config->MEMORY_SAMPLE_INTERVAL_ENVAR = MEMORY_SAMPLE_INTERVAL_ENVAR_DEFAULT;
 }
 
 extern "C" void init_zoslib(const zoslib_config_t config) {
@@ -3096,6 +5750,227 @@ extern "C" char* __getprogramdir() {
   return NULL;
 }
 
+#if (__TARGET_LIB__ < 0x43010000)
+// Without posix_memalign(), __aligned_malloc() carves blocks of up to
+// kSlabMaxSize with at most page alignment out of 1MB chunks, each chunk
+// dedicated to one of the slab size classes. The class chosen for a request
+// has a size that's a multiple of the alignment, and chunks are megabyte
+// aligned, so no block needs padding or a header. Alignments of 1MB and more
+// get segments of their own. Like a slab span, a chunk has its own free list
+// and count of blocks in use, and is returned to __zfree() once it has none
+// in use, unless it's the only chunk of its class with free blocks; trim()
+// returns that one too.
+class __AlignedPool {
+  struct __chunk {
+    __chunk *next;
+    __chunk *prev;
+    char *base;
+    void *free_list; // released blocks, linked through their first word
+    int cls;
+    unsigned int nobjs;
+    unsigned int nused;
+    unsigned int nbump; // blocks nbump..nobjs-1 have never been handed out
+  };
+  struct __region {
+    void *base;
+    size_t len;
+    __chunk *chunk; // nullptr for a segment
+  };
+  struct __class {
+    std::mutex lock;
+    __chunk *partial; // chunks of this class with at least one free block
+  } __attribute__((aligned(kCacheLineSize)));
+
+  // Chunks and segments, keyed by their megabyte-aligned address. It only
+  // changes when a chunk or segment is added or removed, so releases look
+  // blocks up under a shared lock.
+  pthread_rwlock_t region_lock;
+  std::unordered_map<key_type, __region, __hash_func> regions;
+  __class classes[kSlabNumClasses];
+
+  static void unlink(__chunk **head, __chunk *ch) {
+    if (ch->prev)
+      ch->prev->next = ch->next;
+    else
+      *head = ch->next;
+    if (ch->next)
+      ch->next->prev = ch->prev;
+    ch->next = ch->prev = nullptr;
+  }
+  static void push(__chunk **head, __chunk *ch) {
+    ch->prev = nullptr;
+    ch->next = *head;
+    if (*head)
+      (*head)->prev = ch;
+    *head = ch;
+  }
+
+  void add_region(void *key, void *base, size_t len, __chunk *chunk) {
+    pthread_rwlock_wrlock(&region_lock);
+    regions[(key_type)key] = {base, len, chunk};
+    pthread_rwlock_unlock(&region_lock);
+  }
+  bool remove_region(void *key) {
+    pthread_rwlock_wrlock(&region_lock);
+    bool removed = regions.erase((key_type)key) != 0;
+    pthread_rwlock_unlock(&region_lock);
+    return removed;
+  }
+
+  __chunk *new_chunk(int cls) {
+    __chunk *ch = (__chunk *)calloc(1, sizeof(__chunk));
+    if (!ch)
+      return nullptr;
+    ch->base = (char *)__zalloc_nozero(kMegaByte, kMegaByte);
+    if (!ch->base) {
+      free(ch);
+      return nullptr;
+    }
+    ch->cls = cls;
+    ch->nobjs = kMegaByte / kSlabClassSizes[cls];
+    add_region(ch->base, ch->base, kMegaByte, ch);
+    return ch;
+  }
+  void free_chunk(__chunk *ch) {
+    remove_region(ch->base);
+    __zfree(ch->base, kMegaByte);
+    free(ch);
+  }
+
+  void *alloc_block(int cls) {
+    __class &c = classes[cls];
+    std::lock_guard<std::mutex> guard(c.lock);
+    __chunk *ch = c.partial;
+    if (!ch) {
+      ch = new_chunk(cls);
+      if (!ch)
+        return nullptr;
+      push(&c.partial, ch);
+    }
+    void *p;
+    if (ch->free_list) {
+      p = ch->free_list;
+      ch->free_list = *(void **)p;
+    } else {
+      p = ch->base + ch->nbump++ * kSlabClassSizes[cls];
+    }
+    if (++ch->nused == ch->nobjs)
+      unlink(&c.partial, ch);
+    return p;
+  }
+
+  void release_block(__chunk *ch, void *ptr) {
+    __class &c = classes[ch->cls];
+    bool empty;
+    {
+      std::lock_guard<std::mutex> guard(c.lock);
+      *(void **)ptr = ch->free_list;
+      ch->free_list = ptr;
+      if (ch->nused-- == ch->nobjs)
+        push(&c.partial, ch);
+      // Keep the last chunk with free blocks even when it empties, so a
+      // single alloc/free loop doesn't keep getting and returning a chunk.
+      empty = ch->nused == 0 && (ch != c.partial || ch->next);
+      if (empty)
+        unlink(&c.partial, ch);
+    }
+    if (empty)
+      free_chunk(ch);
+  }
+
+  void *alloc_segment(size_t size, size_t alignment) {
+    // __zfree() takes an int length.
+    if (size > INT_MAX || alignment > INT_MAX)
+      return nullptr;
+    size_t len = __round_up(size, kMegaByte) + alignment - kMegaByte;
+    if (len > INT_MAX)
+      return nullptr;
+    void *base = __zalloc_nozero(len, kMegaByte);
+    if (!base)
+      return nullptr;
+    void *p = (void *)__round_up((size_t)base, alignment);
+    add_region(p, base, len, nullptr);
+    return p;
+  }
+
+public:
+  __AlignedPool() {
+    pthread_rwlock_init(&region_lock, NULL);
+    for (int i = 0; i < kSlabNumClasses; ++i)
+      classes[i].partial = nullptr;
+  }
+
+  // Returns nullptr if the request isn't served by the pool, or if the
+  // storage for it can't be obtained.
+  void *alloc(size_t size, size_t alignment) {
+    int cls = __SlabAllocator::size_class(size, alignment);
+    if (cls >= 0)
+      return alloc_block(cls);
+    if (alignment >= kMegaByte)
+      return alloc_segment(size, alignment);
+    return nullptr;
+  }
+
+  // Returns false if ptr wasn't allocated by alloc().
+  bool release(void *ptr) {
+    key_type k = (key_type)ptr & ~(kMegaByte - 1);
+    __region r;
+    pthread_rwlock_rdlock(&region_lock);
+    auto it = regions.find(k);
+    bool found = it != regions.end();
+    if (found)
+      r = it->second;
+    pthread_rwlock_unlock(&region_lock);
+    if (!found)
+      return false;
+    if (r.chunk) {
+      release_block(r.chunk, ptr);
+      return true;
+    }
+    if (k != (key_type)ptr || !remove_region(ptr))
+      return false;
+    __zfree(r.base, (int)r.len);
+    return true;
+  }
+
+  // Returns the chunks kept by release_block() with no blocks in use, and
+  // returns the number of bytes released.
+  size_t trim() {
+    size_t bytes = 0;
+    for (int i = 0; i < kSlabNumClasses; ++i) {
+      __class &c = classes[i];
+      __chunk *empty = nullptr;
+      {
+        std::lock_guard<std::mutex> guard(c.lock);
+        if (c.partial && c.partial->nused == 0 && !c.partial->next) {
+          empty = c.partial;
+          unlink(&c.partial, empty);
+        }
+      }
+      if (empty) {
+        free_chunk(empty);
+        bytes += kMegaByte;
+      }
+    }
+    return bytes;
+  }
+};
+
+// Set once the pool is created, so that trimming doesn't create it.
+static std::atomic<__AlignedPool *> __aligned_pool(nullptr);
+
+static __AlignedPool *__get_aligned_pool() {
+  // Never destroyed, as blocks may be released during exit.
+  static __AlignedPool *pool = __aligned_pool = new __AlignedPool;
+  return pool;
+}
+
+static size_t __trim_aligned_pool() {
+  __AlignedPool *pool = __aligned_pool.load();
+  return pool ? pool->trim() : 0;
+}
+#endif
+
 extern "C" void *__aligned_malloc(size_t size, size_t alignment) {
 #if (__TARGET_LIB__ >= 0x43010000)
   void *ptr;
@@ -3109,9 +5984,18 @@ extern "C" void *__aligned_malloc(size_t size, size_t alignment) {
     errno = EINVAL;
     return nullptr;
   }
+  if (alignment == 0)
+    alignment = sizeof(void *);
+  // The pool gets its storage from __zalloc(), which isn't usable before
+  // zoslib is initialized.
+  if (__galloc_info != nullptr) {
+    void *ptr = __get_aligned_pool()->alloc(size, alignment);
+    if (ptr != nullptr)
+      return ptr;
+  }
   size_t req_size = size + alignment;
   void *ptr = malloc(req_size);
-  if (ptr == nullptr || alignment == 0)
+  if (ptr == nullptr)
     return ptr;
   size_t sptr = reinterpret_cast<size_t>(ptr);
   size_t mod = sptr % alignment;
@@ -3127,6 +6011,8 @@ extern "C" void __aligned_free(void *ptr) {
 #if (__TARGET_LIB__ >= 0x43010000)
   free(ptr);
 #else
+  if (ptr == nullptr || __get_aligned_pool()->release(ptr))
+    return;
   free((reinterpret_cast<void**>(ptr))[-1]);
 #endif
 }
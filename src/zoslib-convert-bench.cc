@@ -0,0 +1,184 @@
+///////////////////////////////////////////////////////////////////////////////
+// Licensed Materials - Property of IBM
+// ZOSLIB
+// (C) Copyright IBM Corp. 2020. All Rights Reserved.
+// US Government Users Restricted Rights - Use, duplication
+// or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+///////////////////////////////////////////////////////////////////////////////
+
+// Measures the throughput of each table-translation kernel that can run on
+// this machine over buffer sizes from 16 bytes to 64MB, and of each UTF-8
+// validation kernel over ASCII, Latin and CJK text. Like the kernels, it
+// only uses standard C++, so it can be built and run on any host:
+//   c++ -O2 -iquote include src/zoslib-convert-bench.cc src/zos-convert.cc
+
+#include "zos-convert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+
+namespace {
+
+const size_t kMinSize = 16;
+const size_t kMaxSize = 64 * 1024 * 1024;
+
+struct Options {
+  size_t max_size = kMaxSize;
+  double seconds = 0.2;
+};
+
+// Returns the MB/s of run() over size bytes.
+template <typename F> double measure(F run, size_t size, double seconds) {
+  typedef std::chrono::steady_clock clock;
+  size_t iterations = 1;
+  for (;;) {
+    clock::time_point start = clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+      run();
+    double elapsed =
+        std::chrono::duration<double>(clock::now() - start).count();
+    if (elapsed >= seconds)
+      return (double)size * iterations / elapsed / (1024 * 1024);
+    iterations *= 2;
+  }
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-m bytes] [-t seconds]\n"
+          "Reports the throughput in MB/s of each table-translation kernel "
+          "over\nbuffer sizes from %zu bytes up, and of each UTF-8 validation "
+          "kernel.\n"
+          "  -m bytes    largest buffer size (default: %zu)\n"
+          "  -t seconds  minimum time of each measurement (default: 0.2)\n",
+          prog, kMinSize, kMaxSize);
+}
+
+// Text made of the given characters, picked at random, cut to size bytes at
+// a character boundary and padded with spaces.
+std::vector<unsigned char> make_corpus(const char *const *chars, size_t size) {
+  std::vector<unsigned char> text;
+  size_t n = 0;
+  while (chars[n])
+    ++n;
+  for (;;) {
+    const char *c = chars[rand() % n];
+    size_t len = strlen(c);
+    if (text.size() + len > size)
+      break;
+    text.insert(text.end(), c, c + len);
+  }
+  text.resize(size, ' ');
+  return text;
+}
+
+int bench_utf8(const char *prog, const Options &opts) {
+  static const char *const ascii[] = {"e", "t", "a", "o", " ", " ", ".",
+                                      "\n", "S", "1", nullptr};
+  static const char *const latin[] = {"e", "t", "a", " ", " ", "n",
+                                      "\xc3\xa9", "\xc3\xbc", "\xc3\x9f",
+                                      "\xc5\x82", nullptr};
+  static const char *const cjk[] = {"\xe4\xb8\xad", "\xe6\x96\x87",
+                                    "\xe3\x81\xae", "\xed\x95\x9c",
+                                    "\xe3\x80\x82", " ", nullptr};
+  static const struct {
+    const char *name;
+    const char *const *chars;
+  } corpora[] = {{"ascii", ascii}, {"latin", latin}, {"cjk", cjk}};
+
+  size_t count;
+  const __utf8_kernel *kernels = __utf8_kernels(&count);
+  int rc = 0;
+  printf("\n%6s %10s", "utf-8", "bytes");
+  for (size_t k = 0; k < count; ++k)
+    printf(" %10s", kernels[k].name);
+  printf("  (MB/s)\n");
+  for (const auto &corpus : corpora) {
+    for (size_t size = 64; size <= opts.max_size; size *= 64) {
+      std::vector<unsigned char> text = make_corpus(corpus.chars, size);
+      printf("%6s %10zu", corpus.name, size);
+      for (size_t k = 0; k < count; ++k) {
+        if (!kernels[k].validate(text.data(), text.size())) {
+          fprintf(stderr, "%s: kernel %s rejects the %s corpus\n", prog,
+                  kernels[k].name, corpus.name);
+          rc = 1;
+        }
+        printf(" %10.0f",
+               measure([&] { kernels[k].validate(text.data(), text.size()); },
+                       size, opts.seconds));
+        fflush(stdout);
+      }
+      printf("\n");
+    }
+  }
+  return rc;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options opts;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+      opts.max_size = strtoul(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      opts.seconds = strtod(argv[++i], nullptr);
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (opts.max_size < kMinSize) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  // The kernels don't depend on what's in the table, only on every entry
+  // being reachable, so any permutation will do.
+  unsigned char table[256];
+  for (int i = 0; i < 256; ++i)
+    table[i] = (unsigned char)(i * 167 + 13);
+
+  std::vector<unsigned char> src(opts.max_size);
+  std::vector<unsigned char> dst(opts.max_size);
+  std::vector<unsigned char> expected(opts.max_size);
+  srand(1);
+  for (size_t i = 0; i < src.size(); ++i)
+    src[i] = (unsigned char)rand();
+
+  size_t count;
+  const __convert_kernel *kernels = __convert_kernels(&count);
+  const __convert_kernel &scalar = kernels[count - 1];
+  scalar.convert(table, expected.data(), src.size(), src.data());
+  int rc = 0;
+  for (size_t k = 0; k < count; ++k) {
+    kernels[k].convert(table, dst.data(), src.size(), src.data());
+    if (memcmp(dst.data(), expected.data(), dst.size())) {
+      fprintf(stderr, "%s: kernel %s doesn't match the scalar kernel\n",
+              argv[0], kernels[k].name);
+      rc = 1;
+    }
+  }
+
+  printf("%10s", "bytes");
+  for (size_t k = 0; k < count; ++k)
+    printf(" %10s", kernels[k].name);
+  printf("  (MB/s; %s is selected)\n", __convert_kernel_selected()->name);
+  for (size_t size = kMinSize; size <= opts.max_size; size *= 4) {
+    printf("%10zu", size);
+    for (size_t k = 0; k < count; ++k) {
+      printf(" %10.0f",
+             measure([&] {
+               kernels[k].convert(table, dst.data(), size, src.data());
+             }, size, opts.seconds));
+      fflush(stdout);
+    }
+    printf("\n");
+  }
+  rc |= bench_utf8(argv[0], opts);
+  return rc;
+}
@@ -0,0 +1,540 @@
+///////////////////////////////////////////////////////////////////////////////
+// Licensed Materials - Property of IBM
+// ZOSLIB
+// (C) Copyright IBM Corp. 2020. All Rights Reserved.
+// US Government Users Restricted Rights - Use, duplication
+// or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+///////////////////////////////////////////////////////////////////////////////
+
+// Replays a binary memory-event log written while __MEMORY_EVENT_LOG_FILE
+// was set, and reports peak usage over time, leaks, churn hot spots and
+// fragmentation for each process in it. It only uses standard C++, so it can
+// be built and run on any host:
+//   c++ -std=c++11 -iquote include src/zoslib-memlog.cc -o zoslib-memlog
+
+#include "zos-memlog.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+const uint64_t kBar = 2ULL * 1024 * 1024 * 1024;
+const uint64_t kPageSize = 4096;
+const uint64_t kSegmentSize = 1024 * 1024;
+// Each thread's events are in order, but threads are written out in turn, so
+// events are sorted within this many microseconds before they're replayed.
+const uint64_t kReorderWindow = 5000000;
+const int kSizeClasses = 28;
+
+struct Options {
+  size_t top = 10;
+  uint64_t interval = 0; // microseconds, or 0 for at most 40 rows
+};
+
+struct Event {
+  uint64_t time;
+  uint64_t seq; // keeps the order of the file between equal keys
+  uint64_t addr;
+  uint64_t size;
+  uint32_t thread;
+  uint16_t op;
+  uint32_t stack;
+};
+
+struct EventAfter {
+  bool operator()(const Event &a, const Event &b) const {
+    return a.time != b.time ? a.time > b.time : a.seq > b.seq;
+  }
+};
+
+struct Block {
+  uint64_t size;
+  uint64_t time;
+  uint32_t stack;
+};
+
+struct Displaced {
+  Block block;
+  uint64_t time; // of the allocation that displaced it
+};
+
+struct Churn {
+  uint64_t allocs = 0;
+  uint64_t frees = 0;
+  uint64_t bytes = 0;
+  uint64_t lifetime = 0; // total of the freed blocks, in microseconds
+};
+
+struct Leak {
+  uint64_t blocks = 0;
+  uint64_t bytes = 0;
+};
+
+struct Interval {
+  uint64_t max = 0;
+  uint64_t end = 0;
+  uint64_t allocs = 0;
+  uint64_t frees = 0;
+};
+
+int size_class(uint64_t size) {
+  int i = 0;
+  while (i < kSizeClasses - 1 && (16ULL << i) < size)
+    ++i;
+  return i;
+}
+
+std::string size_class_name(int cls) {
+  char buf[64];
+  if (cls == kSizeClasses - 1)
+    snprintf(buf, sizeof(buf), "size > %" PRIu64, (uint64_t)8 << cls);
+  else
+    snprintf(buf, sizeof(buf), "size <= %" PRIu64, (uint64_t)16 << cls);
+  return buf;
+}
+
+// Groups a block by its call stack if it was sampled, and otherwise by its
+// size class.
+std::string group_of(const Block &b) {
+  if (b.stack)
+    return "stack " + std::to_string(b.stack);
+  return size_class_name(size_class(b.size));
+}
+
+uint32_t swap32(uint32_t v) {
+  return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+uint64_t swap64(uint64_t v) {
+  return ((uint64_t)swap32((uint32_t)v) << 32) | swap32((uint32_t)(v >> 32));
+}
+uint16_t swap16(uint16_t v) { return (uint16_t)((v >> 8) | (v << 8)); }
+
+// The events of one process, from its header to the next one.
+class Replay {
+public:
+  Replay(const Options &opts, const zoslib_memlog_header &h, bool swap)
+      : opts_(opts), header_(h), swap_(swap),
+        interval_(opts.interval ? opts.interval : 1000000) {
+    if (swap_) {
+      header_.pid = (int32_t)swap32((uint32_t)h.pid);
+      header_.ppid = (int32_t)swap32((uint32_t)h.ppid);
+      header_.start_time = swap64(h.start_time);
+    }
+  }
+
+  int32_t pid() const { return header_.pid; }
+
+  void add(const zoslib_memlog_event &raw) {
+    Event e;
+    e.time = swap_ ? swap64(raw.time) : raw.time;
+    e.addr = swap_ ? swap64(raw.addr) : raw.addr;
+    e.size = swap_ ? swap64(raw.size) : raw.size;
+    e.thread = swap_ ? swap32(raw.thread) : raw.thread;
+    e.op = swap_ ? swap16(raw.op) : raw.op;
+    e.stack = swap_ ? swap32(raw.stack) : raw.stack;
+    e.seq = seq_++;
+    if (e.time > latest_)
+      latest_ = e.time;
+    pending_.push(e);
+    while (!pending_.empty() && pending_.top().time + kReorderWindow < latest_) {
+      events_.push_back(pending_.top());
+      pending_.pop();
+    }
+    if (events_.size() >= 65536)
+      replay_pending();
+  }
+
+  void add_stack(uint32_t id, const std::string &stack) { stacks_[id] = stack; }
+
+  void report() {
+    while (!pending_.empty()) {
+      events_.push_back(pending_.top());
+      pending_.pop();
+    }
+    replay_pending();
+    print_summary();
+    print_timeline();
+    print_leaks();
+    print_churn();
+    print_fragmentation();
+  }
+
+private:
+  void replay_pending() {
+    for (const Event &e : events_)
+      replay(e);
+    events_.clear();
+  }
+
+  void replay(const Event &e) {
+    last_time_ = e.time;
+    switch (e.op) {
+    case ZOSLIB_MEMLOG_ALLOC: {
+      ++allocs_;
+      auto it = live_.find(e.addr);
+      if (it != live_.end()) {
+        // A free is logged before the block is released, and an allocation
+        // after it's obtained, but at the same time, another thread's free
+        // of the block may come after this; keep the earlier block in case
+        // it does.
+        displaced_[e.addr] = {it->second, e.time};
+        ++overlaps_;
+        release(it);
+      }
+      Block b = {e.size, e.time, e.stack};
+      live_.emplace(e.addr, b);
+      (e.addr >= kBar ? cur64_ : cur31_) += e.size;
+      Churn &c = churn_[group_of(b)];
+      ++c.allocs;
+      c.bytes += e.size;
+      interval_at(e.time).allocs++;
+      break;
+    }
+    case ZOSLIB_MEMLOG_FREE: {
+      ++frees_;
+      auto d = displaced_.find(e.addr);
+      if (d != displaced_.end() && d->second.time == e.time) {
+        Churn &c = churn_[group_of(d->second.block)];
+        ++c.frees;
+        c.lifetime += e.time - d->second.block.time;
+        displaced_.erase(d);
+        --overlaps_;
+        interval_at(e.time).frees++;
+        break;
+      }
+      auto it = live_.find(e.addr);
+      if (it == live_.end()) {
+        ++unknown_frees_;
+        break;
+      }
+      Churn &c = churn_[group_of(it->second)];
+      ++c.frees;
+      c.lifetime += e.time - it->second.time;
+      release(it);
+      interval_at(e.time).frees++;
+      break;
+    }
+    case ZOSLIB_MEMLOG_ALLOC_FAILED:
+      ++failures_;
+      break;
+    case ZOSLIB_MEMLOG_DROPPED:
+      dropped_ += e.size;
+      break;
+    }
+    uint64_t cur = cur31_ + cur64_;
+    if (cur > peak_) {
+      peak_ = cur;
+      peak_time_ = e.time;
+    }
+    if (cur31_ > peak31_)
+      peak31_ = cur31_;
+    if (cur64_ > peak64_)
+      peak64_ = cur64_;
+    Interval &iv = interval_at(e.time);
+    if (cur > iv.max)
+      iv.max = cur;
+    iv.end = cur;
+  }
+
+  void release(std::unordered_map<uint64_t, Block>::iterator it) {
+    (it->first >= kBar ? cur64_ : cur31_) -= it->second.size;
+    live_.erase(it);
+  }
+
+  Interval &interval_at(uint64_t time) {
+    size_t i = time / interval_;
+    if (opts_.interval == 0) {
+      // The length of the log isn't known up front, so start with rows of a
+      // second, and keep to at most 40 rows by doubling their length.
+      while (i >= 40) {
+        std::vector<Interval> merged((intervals_.size() + 1) / 2);
+        for (size_t j = 0; j < intervals_.size(); ++j) {
+          Interval &m = merged[j / 2];
+          m.max = std::max(m.max, intervals_[j].max);
+          m.end = intervals_[j].end;
+          m.allocs += intervals_[j].allocs;
+          m.frees += intervals_[j].frees;
+        }
+        intervals_.swap(merged);
+        interval_ *= 2;
+        i = time / interval_;
+      }
+    }
+    while (intervals_.size() <= i) {
+      Interval iv;
+      if (!intervals_.empty())
+        iv.max = iv.end = intervals_.back().end;
+      intervals_.push_back(iv);
+    }
+    return intervals_[i];
+  }
+
+  void print_summary() {
+    printf("Process %d (parent %d)%s\n", (int)header_.pid, (int)header_.ppid,
+           swap_ ? ", log written in the other byte order" : "");
+    printf("  duration:      %.3f s\n", last_time_ / 1e6);
+    printf("  allocations:   %" PRIu64 " (%" PRIu64 " failed)\n", allocs_,
+           failures_);
+    printf("  releases:      %" PRIu64 " (%" PRIu64 " of unknown blocks)\n",
+           frees_, unknown_frees_);
+    if (overlaps_)
+      printf("  reallocated without a release: %" PRIu64 "\n", overlaps_);
+    if (dropped_)
+      printf("  dropped events: %" PRIu64 " (the results are incomplete)\n",
+             dropped_);
+    printf("  peak usage:    %" PRIu64 " bytes at %.3f s (below the bar: "
+           "%" PRIu64 ", above the bar: %" PRIu64 ")\n",
+           peak_, peak_time_ / 1e6, peak31_, peak64_);
+    printf("  final usage:   %" PRIu64 " bytes in %zu blocks\n",
+           cur31_ + cur64_, live_.size());
+  }
+
+  void print_timeline() {
+    printf("\n  %-20s %16s %16s %12s %12s\n", "time (s)", "peak bytes",
+           "end bytes", "allocs", "frees");
+    for (size_t i = 0; i < intervals_.size(); ++i) {
+      const Interval &iv = intervals_[i];
+      char range[32];
+      snprintf(range, sizeof(range), "%.3f-%.3f", i * interval_ / 1e6,
+               (i + 1) * interval_ / 1e6);
+      printf("  %-20s %16" PRIu64 " %16" PRIu64 " %12" PRIu64 " %12" PRIu64
+             "\n", range, iv.max, iv.end, iv.allocs, iv.frees);
+    }
+  }
+
+  void print_stack(const std::string &group) {
+    if (group.compare(0, 6, "stack ") != 0)
+      return;
+    auto it = stacks_.find((uint32_t)atol(group.c_str() + 6));
+    if (it != stacks_.end())
+      printf("      %s\n", it->second.c_str());
+  }
+
+  void print_leaks() {
+    std::map<std::string, Leak> leaks;
+    for (const auto &e : live_) {
+      Leak &l = leaks[group_of(e.second)];
+      ++l.blocks;
+      l.bytes += e.second.size;
+    }
+    std::vector<std::pair<std::string, Leak>> sorted(leaks.begin(),
+                                                     leaks.end());
+    std::sort(sorted.begin(), sorted.end(),
+              [](const std::pair<std::string, Leak> &a,
+                 const std::pair<std::string, Leak> &b) {
+                return a.second.bytes > b.second.bytes;
+              });
+    printf("\n  Blocks not released (top %zu by bytes):\n", opts_.top);
+    if (sorted.empty())
+      printf("    none\n");
+    for (size_t i = 0; i < sorted.size() && i < opts_.top; ++i) {
+      printf("    %-24s %16" PRIu64 " bytes %12" PRIu64 " blocks\n",
+             sorted[i].first.c_str(), sorted[i].second.bytes,
+             sorted[i].second.blocks);
+      print_stack(sorted[i].first);
+    }
+  }
+
+  void print_churn() {
+    std::vector<std::pair<std::string, Churn>> sorted(churn_.begin(),
+                                                      churn_.end());
+    std::sort(sorted.begin(), sorted.end(),
+              [](const std::pair<std::string, Churn> &a,
+                 const std::pair<std::string, Churn> &b) {
+                return a.second.frees > b.second.frees;
+              });
+    printf("\n  Churn hot spots (top %zu by blocks allocated and released):\n",
+           opts_.top);
+    if (sorted.empty() || sorted[0].second.frees == 0)
+      printf("    none\n");
+    for (size_t i = 0; i < sorted.size() && i < opts_.top; ++i) {
+      const Churn &c = sorted[i].second;
+      if (c.frees == 0)
+        break;
+      printf("    %-24s %12" PRIu64 " released of %12" PRIu64
+             " allocated, %16" PRIu64 " bytes, mean lifetime %.3f ms\n",
+             sorted[i].first.c_str(), c.frees, c.allocs, c.bytes,
+             c.lifetime / 1e3 / c.frees);
+      print_stack(sorted[i].first);
+    }
+  }
+
+  // Reports how much of the pages and segments that the blocks still live
+  // at the end touch is actually in use by them.
+  void print_fragmentation() {
+    printf("\n  Fragmentation of the blocks not released:\n");
+    for (int above = 0; above < 2; ++above) {
+      std::unordered_set<uint64_t> pages, segments;
+      uint64_t bytes = 0;
+      for (const auto &e : live_) {
+        if ((e.first >= kBar) != (above != 0) || e.second.size == 0)
+          continue;
+        bytes += e.second.size;
+        uint64_t last = e.first + e.second.size - 1;
+        for (uint64_t p = e.first / kPageSize; p <= last / kPageSize; ++p)
+          pages.insert(p);
+        for (uint64_t s = e.first / kSegmentSize; s <= last / kSegmentSize;
+             ++s)
+          segments.insert(s);
+      }
+      const char *where = above ? "above the bar" : "below the bar";
+      if (bytes == 0) {
+        printf("    %s: none\n", where);
+        continue;
+      }
+      printf("    %s: %" PRIu64 " bytes in %zu pages (%.1f%% used) and %zu "
+             "megabyte segments (%.1f%% used)\n",
+             where, bytes, pages.size(),
+             100.0 * bytes / (pages.size() * kPageSize), segments.size(),
+             100.0 * bytes / (segments.size() * kSegmentSize));
+    }
+  }
+
+  const Options &opts_;
+  zoslib_memlog_header header_;
+  bool swap_;
+  uint64_t seq_ = 0;
+  uint64_t latest_ = 0;
+  std::priority_queue<Event, std::vector<Event>, EventAfter> pending_;
+  std::vector<Event> events_;
+  std::unordered_map<uint64_t, Block> live_;
+  std::unordered_map<uint64_t, Displaced> displaced_;
+  std::map<uint32_t, std::string> stacks_;
+  std::map<std::string, Churn> churn_;
+  uint64_t interval_;
+  std::vector<Interval> intervals_;
+  uint64_t cur31_ = 0, cur64_ = 0;
+  uint64_t peak_ = 0, peak_time_ = 0, peak31_ = 0, peak64_ = 0;
+  uint64_t allocs_ = 0, frees_ = 0, failures_ = 0, unknown_frees_ = 0;
+  uint64_t overlaps_ = 0, dropped_ = 0, last_time_ = 0;
+};
+
+bool is_header(const zoslib_memlog_header &h) {
+  static const unsigned char magic[] = ZOSLIB_MEMLOG_MAGIC;
+  return memcmp(h.magic, magic, sizeof(magic)) == 0;
+}
+
+int analyze(const char *fname, const Options &opts) {
+  FILE *fp = fopen(fname, "rb");
+  if (!fp) {
+    perror(fname);
+    return 1;
+  }
+  // Processes that append to the same log interleave their events, so each
+  // event goes to the replay of its pid, set up by that process's header.
+  // A header and an event are read the same way, as an event is larger.
+  std::vector<Replay *> replays; // in the order of their headers
+  std::map<int32_t, Replay *> by_pid;
+  bool swap = false;
+  int rc = 0;
+  for (;;) {
+    zoslib_memlog_header h;
+    size_t n = fread(&h, 1, sizeof(h), fp);
+    if (n == 0)
+      break;
+    if (n == sizeof(h) && is_header(h)) {
+      swap = h.byte_order != ZOSLIB_MEMLOG_BYTE_ORDER;
+      uint32_t version = swap ? swap32(h.version) : h.version;
+      if (version != ZOSLIB_MEMLOG_VERSION) {
+        fprintf(stderr, "%s: unsupported log version %u\n", fname, version);
+        rc = 1;
+        break;
+      }
+      Replay *replay = new Replay(opts, h, swap);
+      replays.push_back(replay);
+      by_pid[replay->pid()] = replay;
+      continue;
+    }
+    zoslib_memlog_event ev;
+    memcpy(&ev, &h, n);
+    if (n < sizeof(h) ||
+        fread((char *)&ev + n, 1, sizeof(ev) - n, fp) != sizeof(ev) - n) {
+      fprintf(stderr, "%s: truncated event at the end\n", fname);
+      break;
+    }
+    int32_t pid = swap ? (int32_t)swap32((uint32_t)ev.pid) : ev.pid;
+    auto it = by_pid.find(pid);
+    if (it == by_pid.end()) {
+      fprintf(stderr, "%s: not a memory-event log, or an event of process "
+              "%d precedes its header\n", fname, (int)pid);
+      rc = 1;
+      break;
+    }
+    Replay *replay = it->second;
+    uint16_t op = swap ? swap16(ev.op) : ev.op;
+    if (op == ZOSLIB_MEMLOG_STACK) {
+      uint64_t id = swap ? swap64(ev.addr) : ev.addr;
+      uint64_t len = swap ? swap64(ev.size) : ev.size;
+      if (len > ZOSLIB_MEMLOG_MAX_STACK) {
+        fprintf(stderr, "%s: corrupt stack record of %" PRIu64 " bytes\n",
+                fname, len);
+        rc = 1;
+        break;
+      }
+      std::string stack(len, '\0');
+      if (fread(&stack[0], 1, len, fp) != len) {
+        fprintf(stderr, "%s: truncated stack at the end\n", fname);
+        break;
+      }
+      replay->add_stack((uint32_t)id, stack);
+      continue;
+    }
+    replay->add(ev);
+  }
+  for (size_t i = 0; i < replays.size(); ++i) {
+    if (i)
+      printf("\n");
+    replays[i]->report();
+    delete replays[i];
+  }
+  fclose(fp);
+  return rc;
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-n top] [-i seconds] logfile...\n"
+          "Reports peak usage over time, leaks, churn hot spots and "
+          "fragmentation\nfrom a log written while __MEMORY_EVENT_LOG_FILE "
+          "was set.\n"
+          "  -n top      number of entries in each list (default: 10)\n"
+          "  -i seconds  length of the rows of the usage timeline (default: "
+          "at most 40 rows)\n",
+          prog);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options opts;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      opts.top = strtoul(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+      opts.interval = (uint64_t)(strtod(argv[++i], nullptr) * 1e6);
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (i == argc) {
+    usage(argv[0]);
+    return 2;
+  }
+  int rc = 0;
+  for (; i < argc; ++i)
+    rc |= analyze(argv[i], opts);
+  return rc;
+}
@@ -0,0 +1,253 @@
+///////////////////////////////////////////////////////////////////////////////
+// Licensed Materials - Property of IBM
+// ZOSLIB
+// (C) Copyright IBM Corp. 2020. All Rights Reserved.
+// US Government Users Restricted Rights - Use, duplication
+// or disclosure restricted by GSA ADP Schedule Contract with IBM Corp.
+///////////////////////////////////////////////////////////////////////////////
+
+// Measures the throughput of __zalloc() and __zfree() from 1 thread up to
+// the number of online CPUs (at most 16), of __zfree() alone for slab and
+// __malloc31 blocks, what keeping the index used by __zalloc_find() up to
+// date adds to them, and of segments backed by each size of frames.
+
+#include "zos.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const size_t KB = 1024;
+const size_t MB = KB * 1024;
+const size_t GB = MB * 1024;
+
+struct Options {
+  int iterations = 20000;
+};
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-n iterations]\n"
+          "Reports the throughput of __zalloc() and __zfree() from 1 thread "
+          "up to\nthe number of online CPUs, of __zfree() alone, the cost of "
+          "indexing blocks\nfor __zalloc_find(), and the throughput of "
+          "segments backed by the default,\n1M and 2G frames.\n"
+          "  -n iterations  alloc/free pairs per thread (default: 20000)\n",
+          prog);
+}
+
+// Allocates and frees blocks of mixed sizes from nthreads threads and
+// returns the number of alloc/free pairs completed per second.
+double run_zalloc_threads(int nthreads, int iterations) {
+  static const size_t sizes[] = {64, 4 * KB, 16 * KB, 100 * KB};
+  static const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < nthreads; ++t) {
+    threads.emplace_back([iterations]() {
+      void *live[16] = {};
+      for (int i = 0; i < iterations; ++i) {
+        int slot = i % 16;
+        size_t size = sizes[i % nsizes];
+        if (live[slot])
+          __zfree(live[slot], sizes[(i - 16) % nsizes]);
+        live[slot] = __zalloc(size, PAGE_SIZE);
+      }
+      for (int i = iterations - 16; i < iterations; ++i) {
+        if (i >= 0 && live[i % 16])
+          __zfree(live[i % 16], sizes[i % nsizes]);
+      }
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return (double)nthreads * iterations / elapsed.count();
+}
+
+void bench_threads(const Options &opts) {
+  int maxthreads = __get_num_online_cpus();
+  if (maxthreads < 1)
+    maxthreads = 1;
+  if (maxthreads > 16)
+    maxthreads = 16;
+  double base = 0;
+  for (int n = 1; n <= maxthreads; n *= 2) {
+    double ops = run_zalloc_threads(n, opts.iterations);
+    if (n == 1)
+      base = ops;
+    printf("zalloc/zfree threads=%-2d %12.0f ops/s  scaling=%.2fx\n", n, ops,
+           ops / base);
+  }
+}
+
+// Allocates batches of blocks from nthreads threads, then times freeing them,
+// and returns the number of frees per second.
+double run_zfree_threads(int nthreads, size_t size, int nblocks) {
+  std::vector<std::thread> threads;
+  std::vector<double> seconds(nthreads);
+  for (int t = 0; t < nthreads; ++t) {
+    threads.emplace_back([t, size, nblocks, &seconds]() {
+      std::vector<void *> blocks(nblocks);
+      for (int round = 0; round < 8; ++round) {
+        for (int i = 0; i < nblocks; ++i)
+          blocks[i] = __zalloc(size, 8);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < nblocks; ++i)
+          __zfree(blocks[i], size);
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        seconds[t] += elapsed.count();
+      }
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+  double total = 0;
+  for (double sec : seconds)
+    total += sec;
+  return 8.0 * nblocks * nthreads / (total / nthreads);
+}
+
+void bench_free() {
+  // 64 bytes comes from a slab, 40KB from __malloc31 with a block header.
+  for (size_t size : {64UL, 40 * KB}) {
+    for (int n : {1, 4}) {
+      double frees = run_zfree_threads(n, size, 2000);
+      printf("zfree size=%-6zu threads=%d %12.0f frees/s\n", size, n, frees);
+    }
+  }
+}
+
+// Allocates and frees blocks of the given size from nthreads threads, with
+// __zalloc() and __zfree(), or with __malloc31() and free() if raw is set,
+// and returns the number of nanoseconds each pair takes.
+double run_pairs(int nthreads, size_t size, int iterations, bool raw) {
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < nthreads; ++t) {
+    threads.emplace_back([size, iterations, raw]() {
+      for (int i = 0; i < iterations; ++i) {
+        if (raw) {
+          free(__malloc31(size));
+        } else {
+          __zfree(__zalloc_nozero(size, 8), size);
+        }
+      }
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() * 1e9 * nthreads / ((double)nthreads * iterations);
+}
+
+void bench_index(const Options &opts) {
+  // 40KB blocks come from __malloc31 and are indexed; what __zalloc() adds
+  // to __malloc31() bounds the cost of indexing them.
+  for (int n : {1, 4}) {
+    double zalloc = run_pairs(n, 40 * KB, opts.iterations, false);
+    double raw = run_pairs(n, 40 * KB, opts.iterations, true);
+    printf("index size=%-6zu threads=%d %8.0f ns/pair  __malloc31=%8.0f "
+           "ns/pair  overhead=%6.0f ns\n",
+           40 * KB, n, zalloc, raw, zalloc - raw);
+  }
+  std::vector<void *> blocks(256);
+  for (auto &p : blocks)
+    p = __zalloc_nozero(40 * KB, 8);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < opts.iterations; ++i)
+    __zalloc_find((char *)blocks[i % blocks.size()] + i % (40 * KB), nullptr,
+                  nullptr);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("index lookups %12.0f finds/s\n", opts.iterations / elapsed.count());
+  for (void *p : blocks)
+    __zfree(p, 40 * KB);
+}
+
+// Sets __MEMORY_LARGE_FRAMES, or unsets it if frames is nullptr.
+void set_large_frames(const char *frames) {
+  const char *envar = "__MEMORY_LARGE_FRAMES";
+  if (frames)
+    setenv(envar, frames, 1);
+  else
+    unsetenv(envar);
+  __update_envar_settings(envar);
+}
+
+// Times allocating and freeing segments of the given size, and touching
+// every 4K page of them 4 times, with the given __MEMORY_LARGE_FRAMES value
+// (nullptr for the default frames).
+void run_segments(const char *frames, size_t size, int iterations) {
+  set_large_frames(frames);
+  std::chrono::duration<double> alloc_time(0), touch_time(0);
+  for (int i = 0; i < iterations; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    char *p = static_cast<char *>(__zalloc(size, MB));
+    auto allocated = std::chrono::steady_clock::now();
+    if (p == nullptr) {
+      fprintf(stderr, "__zalloc of %zu bytes failed\n", size);
+      return;
+    }
+    for (int pass = 0; pass < 4; ++pass) {
+      for (size_t off = 0; off < size; off += 4 * KB)
+        p[off] += 1;
+    }
+    auto touched = std::chrono::steady_clock::now();
+    __zfree(p, size);
+    alloc_time += (allocated - start) + (std::chrono::steady_clock::now() -
+                                         touched);
+    touch_time += touched - allocated;
+  }
+  printf("segments frames=%-7s size=%-10zu %10.0f alloc+free/s "
+         "%10.0f page-touches/s\n",
+         frames ? frames : "default", size, iterations / alloc_time.count(),
+         iterations * 4.0 * (size / (4 * KB)) / touch_time.count());
+}
+
+void bench_frames() {
+  const char *saved = getenv("__MEMORY_LARGE_FRAMES");
+  std::string restore = saved ? saved : "";
+  // 64MB segments are too big to be pooled; 2G frames only back multiples
+  // of 2GB, so they're measured on 2GB segments, against the others.
+  run_segments(nullptr, 64 * MB, 16);
+  run_segments("1M", 64 * MB, 16);
+  run_segments(nullptr, 2 * GB, 2);
+  run_segments("1M", 2 * GB, 2);
+  run_segments("2G", 2 * GB, 2);
+  set_large_frames(saved ? restore.c_str() : nullptr);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options opts;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      opts.iterations = atoi(argv[++i]);
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (opts.iterations < 16) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  bench_threads(opts);
+  bench_free();
+  bench_index(opts);
+  bench_frames();
+  return 0;
+}
@@ -2,8 +2,11 @@
 #include "gtest/gtest.h"
 
 #include <math.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <vector>
+
 namespace {
 
 constexpr int KB = 1024;
@@ -62,4 +65,51 @@ TEST(AlignedAlloc, TestFour) {
   __aligned_free(ptr);
 }
 
+TEST(AlignedAlloc, Reuse) {
+  // Many small blocks, which stay intact while the others are in use.
+  for (size_t alignment : {64UL, 4096UL}) {
+    std::vector<char *> blocks;
+    for (int i = 0; i < 1000; ++i) {
+      char *p = static_cast<char *>(__aligned_malloc(100, alignment));
+      ASSERT_NE(p, nullptr);
+      ASSERT_EQ(reinterpret_cast<size_t>(p) % alignment, 0);
+      memset(p, i & 0xff, 100);
+      blocks.push_back(p);
+    }
+    for (int i = 0; i < 1000; ++i) {
+      EXPECT_EQ(blocks[i][0], (char)(i & 0xff));
+      EXPECT_EQ(blocks[i][99], (char)(i & 0xff));
+      __aligned_free(blocks[i]);
+    }
+  }
+  // Alignments of 1MB and more.
+  for (size_t alignment : {(size_t)MB, 4UL * MB}) {
+    char *p = static_cast<char *>(__aligned_malloc(3 * MB + 1, alignment));
+    ASSERT_NE(p, nullptr);
+    ASSERT_EQ(reinterpret_cast<size_t>(p) % alignment, 0);
+    p[3 * MB] = 1;
+    __aligned_free(p);
+  }
+}
+
+#if (__TARGET_LIB__ < 0x43010000)
+TEST(AlignedAlloc, ReturnsEmptyChunks) {
+  // 4K blocks with 4K alignment fill 1MB chunks 256 at a time; once they're
+  // all released, at most one chunk is kept.
+  struct zalloc_stats before, after;
+  ASSERT_EQ(__zalloc_stats(&before), 0);
+  std::vector<void *> blocks;
+  for (int i = 0; i < 1024; ++i) {
+    void *p = __aligned_malloc(4 * KB, 4 * KB);
+    ASSERT_NE(p, nullptr);
+    blocks.push_back(p);
+  }
+  for (void *p : blocks)
+    __aligned_free(p);
+  ASSERT_EQ(__zalloc_stats(&after), 0);
+  EXPECT_LE(after.current31 + after.current64,
+            before.current31 + before.current64 + MB);
+}
+#endif
+
 } // namespace
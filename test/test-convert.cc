@@ -84,4 +84,189 @@ TEST(A2ETest, A2ES) {
   }
 }
 
+TEST(ClassifyTest, ClassifyAE) {
+  for (int i = 0; i < ARRAY_SIZE(ascii); i++) {
+    const size_t len = strlen(ascii[i]) + 1;
+    int ccsid, am;
+    EXPECT_EQ(819, __classify_ae((const unsigned char *)ascii[i], len, &am));
+    EXPECT_EQ(0, am);
+    EXPECT_EQ(len - 1,
+              strlen_ae((const unsigned char *)ascii[i], &ccsid, len, &am));
+    EXPECT_EQ(819, ccsid);
+    EXPECT_EQ(0, am);
+  }
+  for (int i = 0; i < ARRAY_SIZE(ebcdic); i++) {
+    const size_t len = strlen(ebcdic[i]) + 1;
+    int ccsid, am;
+    EXPECT_EQ(1047, __classify_ae((const unsigned char *)ebcdic[i], len, &am));
+    EXPECT_EQ(0, am);
+    EXPECT_EQ(len - 1,
+              strlen_ae((const unsigned char *)ebcdic[i], &ccsid, len, &am));
+    EXPECT_EQ(1047, ccsid);
+    EXPECT_EQ(0, am);
+  }
+
+  // Valid in both, so the answer is the last one given on this thread.
+  const unsigned char both[] = {0x0b, 0x0c, 0x0d, 0x00};
+  int ccsid, am;
+  EXPECT_EQ(1047, __classify_ae(both, sizeof(both), &am));
+  EXPECT_EQ(1, am);
+  EXPECT_EQ(3, strlen_ae(both, &ccsid, sizeof(both), &am));
+  EXPECT_EQ(1047, ccsid);
+  EXPECT_EQ(1, am);
+}
+
+TEST(Utf8Test, Validate) {
+  static const char *valid[] = {"", "Hello, World!\n",
+                                "\xc4\x85\xc3\xa9",      // Latin
+                                "\xe4\xb8\xad\xe6\x96\x87",  // CJK
+                                "\xf0\x9f\x98\x80",          // 4 bytes
+                                "\xed\xa0\x80"};             // surrogate
+  static const char *invalid[] = {"\x80", "\xc0\x80", "\xc3",
+                                  "\xe0\x9f\xbf", "\xf4\x90\x80\x80",
+                                  "\xf8\x88\x80\x80\x80"};
+  char msg[256];
+  for (int i = 0; i < ARRAY_SIZE(valid); i++)
+    EXPECT_EQ(0, __utf8_validate(valid[i], strlen(valid[i]), msg, sizeof(msg)))
+        << i;
+  for (int i = 0; i < ARRAY_SIZE(invalid); i++)
+    EXPECT_EQ(-1, __utf8_validate(invalid[i], strlen(invalid[i]), msg,
+                                  sizeof(msg)))
+        << i;
+
+  // Errors past the ASCII fast path are found and described where they are.
+  char text[300];
+  memset(text, 'x', sizeof(text));
+  text[100] = '\n';
+  text[250] = '\xc0';
+  text[251] = '\xaf';
+  msg[0] = 0;
+  EXPECT_EQ(-1, __utf8_validate(text, sizeof(text), msg, sizeof(msg)));
+  EXPECT_NE(nullptr, strstr(msg, "offset 251 around line 2"));
+  // Only what's before the first NUL is checked.
+  text[200] = 0;
+  EXPECT_EQ(0, __utf8_validate(text, sizeof(text), msg, sizeof(msg)));
+
+  // Every kernel agrees with the scanner, at every position in a block.
+  size_t count;
+  const struct __utf8_kernel *kernels = __utf8_kernels(&count);
+  EXPECT_STREQ("scanner", kernels[count - 1].name);
+  unsigned char buf[96];
+  for (size_t pos = 0; pos < sizeof(buf); pos++) {
+    for (int lead = 0x80; lead < 0x100; lead += 5) {
+      memset(buf, 'a', sizeof(buf));
+      buf[pos] = lead;
+      if (pos + 1 < sizeof(buf))
+        buf[pos + 1] = 0x80 + pos % 0x40;
+      if (pos + 2 < sizeof(buf))
+        buf[pos + 2] = 0xbf;
+      int expected = kernels[count - 1].validate(buf, sizeof(buf));
+      for (size_t k = 0; k + 1 < count; k++)
+        ASSERT_EQ(expected, kernels[k].validate(buf, sizeof(buf)))
+            << kernels[k].name << " lead " << lead << " at " << pos;
+    }
+  }
+}
+
+TEST(CcsidGuessTest, Stream) {
+  // UTF-8 fed a byte at a time, so every sequence is split between chunks.
+  const char utf8[] = "line 1\nz\xc3\xb3\xc5\x82w \xe4\xb8\xad\xf0\x9f\x98\x80\n";
+  struct __ccsid_guess guess;
+  __ccsid_guess_begin(&guess);
+  for (int i = 0; i < sizeof(utf8) - 1; i++)
+    EXPECT_EQ(0, __ccsid_guess_feed(&guess, utf8 + i, 1));
+  EXPECT_EQ(819, __ccsid_guess_end(&guess, NULL, 0));
+
+  for (int i = 0; i < ARRAY_SIZE(ebcdic); i++) {
+    __ccsid_guess_begin(&guess);
+    const size_t len = strlen(ebcdic[i]);
+    __ccsid_guess_feed(&guess, ebcdic[i], len / 2);
+    __ccsid_guess_feed(&guess, ebcdic[i] + len / 2, len - len / 2);
+    EXPECT_EQ(1047, __ccsid_guess_end(&guess, NULL, 0));
+    EXPECT_EQ(1047, __guess_ue(ebcdic[i], len, NULL, 0));
+  }
+
+  // Neither, which is decided as soon as the data shows it; the error is
+  // where it is in the whole stream.
+  const unsigned char binary[] = {'a', '\n', 'b', '\n', 0xc3, 0x28, 0xff};
+  char msg[512];
+  __ccsid_guess_begin(&guess);
+  EXPECT_EQ(0, __ccsid_guess_feed(&guess, binary, 5));
+  EXPECT_EQ(65535, __ccsid_guess_feed(&guess, binary + 5, 2));
+  EXPECT_EQ(65535, __ccsid_guess_end(&guess, msg, sizeof(msg)));
+  EXPECT_NE(nullptr, strstr(msg, "offset 5 around line 3"));
+
+  // A sequence still cut off at the end isn't UTF-8.
+  __ccsid_guess_begin(&guess);
+  __ccsid_guess_feed(&guess, "ab\xe4\xb8", 4);
+  EXPECT_EQ(65535, __ccsid_guess_end(&guess, msg, sizeof(msg)));
+}
+
+TEST(ConvertKernelTest, MatchesTables) {
+  const unsigned char *tables[] = {__ibm1047_iso88591, __iso88591_ibm1047};
+  unsigned char src[1024 + 3];
+  for (int i = 0; i < sizeof(src); i++)
+    src[i] = (unsigned char)(i * 7);
+  size_t count;
+  const struct __convert_kernel *kernels = __convert_kernels(&count);
+  ASSERT_GE(count, 1);
+  EXPECT_STREQ("scalar", kernels[count - 1].name);
+  for (size_t k = 0; k < count; k++) {
+    for (int t = 0; t < ARRAY_SIZE(tables); t++) {
+      // Odd lengths and offsets exercise the tails and unaligned loads.
+      for (size_t len = 0; len <= sizeof(src) - 3; len += 61) {
+        unsigned char dst[sizeof(src)];
+        kernels[k].convert(tables[t], dst + 1, len, src + 3);
+        for (size_t i = 0; i < len; i++)
+          ASSERT_EQ(tables[t][src[3 + i]], dst[1 + i])
+              << kernels[k].name << " at " << i << " of " << len;
+      }
+      unsigned char inplace[sizeof(src)];
+      memcpy(inplace, src, sizeof(src));
+      kernels[k].convert(tables[t], inplace, sizeof(inplace), inplace);
+      for (size_t i = 0; i < sizeof(src); i++)
+        ASSERT_EQ(tables[t][src[i]], inplace[i]) << kernels[k].name;
+    }
+  }
+}
+
+TEST(ConvertCcsidTest, BuiltInCodePages) {
+  // '[' and ']' move around the most between the EBCDIC code pages.
+  const struct {
+    int ccsid;
+    unsigned char brackets[2];
+  } pages[] = {{37, {0xba, 0xbb}},  {273, {0x63, 0xfc}}, {285, {0xb1, 0xbb}},
+               {500, {0x4a, 0x5a}}, {1047, {0xad, 0xbd}}, {1140, {0xba, 0xbb}}};
+  for (int p = 0; p < ARRAY_SIZE(pages); p++) {
+    unsigned char ebcdic[2];
+    EXPECT_EQ(ebcdic, __convert_ccsid(ebcdic, "[]", 2, 819, pages[p].ccsid));
+    EXPECT_EQ(pages[p].brackets[0], ebcdic[0]) << pages[p].ccsid;
+    EXPECT_EQ(pages[p].brackets[1], ebcdic[1]) << pages[p].ccsid;
+  }
+
+  // Every byte converts between any two code pages and back.
+  const int ccsids[] = {819, 37, 273, 285, 500, 1047, 1140};
+  unsigned char src[256], dst[256], back[256];
+  for (int i = 0; i < sizeof(src); i++)
+    src[i] = (unsigned char)i;
+  for (int f = 0; f < ARRAY_SIZE(ccsids); f++) {
+    for (int t = 0; t < ARRAY_SIZE(ccsids); t++) {
+      __convert_ccsid(dst, src, sizeof(src), ccsids[f], ccsids[t]);
+      __convert_ccsid(back, dst, sizeof(dst), ccsids[t], ccsids[f]);
+      EXPECT_EQ(0, memcmp(src, back, sizeof(src)))
+          << ccsids[f] << " to " << ccsids[t];
+    }
+  }
+
+  // IBM-1047 is the same as _convert_a2e() in place.
+  memcpy(dst, src, sizeof(src));
+  __convert_ccsid(dst, dst, sizeof(dst), 819, 1047);
+  for (int i = 0; i < sizeof(src); i++)
+    EXPECT_EQ(__iso88591_ibm1047[i], dst[i]);
+
+  errno = 0;
+  EXPECT_EQ(nullptr, __convert_ccsid(dst, src, sizeof(src), 819, 1208));
+  EXPECT_EQ(EINVAL, errno);
+}
+
 } // namespace
@@ -0,0 +1,658 @@
+#include "zos-memlog.h"
+#include "zos.h"
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <chrono>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr size_t KB = 1024;
+constexpr size_t MB = KB * 1024;
+
+TEST(ZallocTest, Below2GB) {
+  size_t alignment = sysconf(_SC_PAGESIZE);
+  for (size_t size : {8UL, 100UL, 4 * KB, 12 * KB + 8, 300 * KB}) {
+    char *p = static_cast<char *>(__zalloc(size, alignment));
+    ASSERT_NE(p, nullptr);
+    EXPECT_EQ(reinterpret_cast<size_t>(p) % alignment, 0);
+    for (size_t i = 0; i < size; ++i)
+      ASSERT_EQ(p[i], 0);
+    memset(p, 0xff, size);
+    EXPECT_EQ(__zfree(p, size), 0);
+  }
+}
+
+TEST(ZallocTest, SmallBlocks) {
+  // Enough blocks of each size to span several slabs.
+  for (size_t size : {24UL, 200UL, 4 * KB, 8 * KB + 16, 16 * KB}) {
+    for (size_t alignment : {8UL, (size_t)PAGE_SIZE}) {
+      std::vector<char *> blocks;
+      for (int i = 0; i < 64; ++i) {
+        char *p = static_cast<char *>(__zalloc(size, alignment));
+        ASSERT_NE(p, nullptr);
+        EXPECT_EQ(reinterpret_cast<size_t>(p) % alignment, 0);
+        for (size_t j = 0; j < size; ++j)
+          ASSERT_EQ(p[j], 0);
+        memset(p, i + 1, size);
+        blocks.push_back(p);
+      }
+      for (int i = 0; i < 64; ++i) {
+        EXPECT_EQ(blocks[i][0], i + 1);
+        EXPECT_EQ(blocks[i][size - 1], i + 1);
+        EXPECT_EQ(__zfree(blocks[i], size), 0);
+      }
+    }
+  }
+}
+
+TEST(ZallocTest, SmallBlockFreedTwice) {
+  void *p = __zalloc(64, 8);
+  ASSERT_NE(p, nullptr);
+  EXPECT_EQ(__zfree(p, 64), 0);
+  // The second free is refused, so the block isn't handed out twice.
+  EXPECT_EQ(__zfree(p, 64), -1);
+  void *a = __zalloc(64, 8);
+  void *b = __zalloc(64, 8);
+  ASSERT_NE(a, nullptr);
+  ASSERT_NE(b, nullptr);
+  EXPECT_NE(a, b);
+  void *base;
+  EXPECT_EQ(__zalloc_find(a, &base, nullptr), 0);
+  EXPECT_EQ(__zfree(a, 64), 0);
+  EXPECT_EQ(__zfree(b, 64), 0);
+  // A freed block isn't found.
+  EXPECT_EQ(__zalloc_find(a, &base, nullptr), -1);
+}
+
+TEST(ZallocTest, Segments) {
+  for (size_t size : {MB, 3 * MB}) {
+    char *p = static_cast<char *>(__zalloc(size, MB));
+    ASSERT_NE(p, nullptr);
+    EXPECT_EQ(reinterpret_cast<size_t>(p) % MB, 0);
+    EXPECT_EQ(p[0], 0);
+    EXPECT_EQ(p[size - 1], 0);
+    p[size - 1] = 1;
+    EXPECT_EQ(__zfree(p, size), 0);
+  }
+}
+
+TEST(ZallocTest, FreeUnknownSegment) {
+  char *p = static_cast<char *>(__zalloc(MB, MB));
+  ASSERT_NE(p, nullptr);
+  EXPECT_EQ(__zfree(p, MB), 0);
+  // A segment that's already released is no longer in the registry.
+  EXPECT_NE(__zfree(p, MB), 0);
+}
+
+TEST(ZallocTest, SegmentReuseIsZeroed) {
+  // A released segment may be pooled and handed out again, but must still
+  // read as zeros.
+  for (int i = 0; i < 4; ++i) {
+    char *p = static_cast<char *>(__zalloc(2 * MB, MB));
+    ASSERT_NE(p, nullptr);
+    for (size_t off = 0; off < 2 * MB; off += PAGE_SIZE)
+      ASSERT_EQ(p[off], 0);
+    memset(p, 0xa5, 2 * MB);
+    EXPECT_EQ(__zfree(p, 2 * MB), 0);
+  }
+}
+
+TEST(ZallocTest, NoZero) {
+  for (size_t size : {200UL, 64 * KB, MB}) {
+    char *p = static_cast<char *>(__zalloc_nozero(size, PAGE_SIZE));
+    ASSERT_NE(p, nullptr);
+    EXPECT_EQ(reinterpret_cast<size_t>(p) % PAGE_SIZE, 0);
+    memset(p, 0x5a, size);
+    EXPECT_EQ(__zfree(p, size), 0);
+  }
+  // __zalloc still clears a block that __zalloc_nozero handed out before.
+  char *p = static_cast<char *>(__zalloc_nozero(200, 8));
+  ASSERT_NE(p, nullptr);
+  memset(p, 0x5a, 200);
+  EXPECT_EQ(__zfree(p, 200), 0);
+  p = static_cast<char *>(__zalloc(200, 8));
+  ASSERT_NE(p, nullptr);
+  for (size_t i = 0; i < 200; ++i)
+    ASSERT_EQ(p[i], 0);
+  EXPECT_EQ(__zfree(p, 200), 0);
+}
+
+TEST(ZallocTest, ReserveCommit) {
+  char *p = static_cast<char *>(__zreserve(16 * MB));
+  ASSERT_NE(p, nullptr);
+  EXPECT_EQ(reinterpret_cast<size_t>(p) % MB, 0);
+
+  // Grow the committed part in steps, as a heap would.
+  EXPECT_EQ(__zcommit(p, MB), 0);
+  memset(p, 1, MB);
+  EXPECT_EQ(__zcommit(p, 4 * MB), 0);
+  EXPECT_EQ(p[0], 1);
+  EXPECT_EQ(p[4 * MB - 1], 0);
+  memset(p, 2, 4 * MB);
+
+  // Decommitted storage reads as zeros once it's committed again.
+  EXPECT_EQ(__zdecommit(p + 2 * MB, 2 * MB), 0);
+  EXPECT_EQ(p[2 * MB - 1], 2);
+  EXPECT_EQ(__zcommit(p + 2 * MB, 1), 0);
+  EXPECT_EQ(p[2 * MB], 0);
+
+  // Ranges outside the reservation are rejected.
+  EXPECT_NE(__zcommit(p + 15 * MB, 2 * MB), 0);
+  EXPECT_EQ(errno, EINVAL);
+  EXPECT_NE(__zrelease(p + MB), 0);
+
+  EXPECT_EQ(__zrelease(p), 0);
+  EXPECT_NE(__zrelease(p), 0);
+}
+
+TEST(ZallocTest, Stats) {
+  struct zalloc_stats before, during, after;
+  EXPECT_NE(__zalloc_stats(nullptr), 0);
+  ASSERT_EQ(__zalloc_stats(&before), 0);
+  void *small = __zalloc(100, 8);
+  void *seg = __zalloc(MB, MB);
+  ASSERT_NE(small, nullptr);
+  ASSERT_NE(seg, nullptr);
+  ASSERT_EQ(__zalloc_stats(&during), 0);
+  EXPECT_EQ(during.allocs31, before.allocs31 + 1);
+  EXPECT_EQ(during.allocs64, before.allocs64 + 1);
+  EXPECT_EQ(during.live31, before.live31 + 1);
+  EXPECT_EQ(during.live64, before.live64 + 1);
+  EXPECT_GE(during.current64, before.current64 + MB);
+  EXPECT_GE(during.max64, during.current64);
+  // 100 bytes is in (64, 128], and 1MB in (512K, 1M].
+  EXPECT_EQ(during.size_classes[3], before.size_classes[3] + 1);
+  EXPECT_EQ(during.size_classes[16], before.size_classes[16] + 1);
+  EXPECT_EQ(__zfree(small, 100), 0);
+  EXPECT_EQ(__zfree(seg, MB), 0);
+  ASSERT_EQ(__zalloc_stats(&after), 0);
+  EXPECT_EQ(after.frees31, before.frees31 + 1);
+  EXPECT_EQ(after.frees64, before.frees64 + 1);
+  EXPECT_EQ(after.live31, before.live31);
+  EXPECT_EQ(after.live64, before.live64);
+  EXPECT_EQ(after.current64, before.current64);
+}
+
+TEST(ZallocTest, ThreadCache) {
+  struct zalloc_stats before, after;
+  ASSERT_EQ(__zalloc_stats(&before), 0);
+  // A new thread starts with an empty cache, and its counts are added to
+  // the totals when it ends.
+  std::thread t([] {
+    for (int i = 0; i < 100; ++i) {
+      void *p = __zalloc(64, 8);
+      ASSERT_NE(p, nullptr);
+      EXPECT_EQ(__zfree(p, 64), 0);
+    }
+  });
+  t.join();
+  ASSERT_EQ(__zalloc_stats(&after), 0);
+  EXPECT_GE(after.tcache_misses, before.tcache_misses + 1);
+  EXPECT_GE(after.tcache_hits, before.tcache_hits + 99);
+
+  // Blocks released by one thread can be allocated by another, and more
+  // of them than a cache holds go back to the slabs.
+  std::vector<void *> blocks;
+  for (int i = 0; i < 1000; ++i)
+    blocks.push_back(__zalloc(32, 8));
+  std::thread u([&blocks] {
+    for (void *p : blocks)
+      EXPECT_EQ(__zfree(p, 32), 0);
+  });
+  u.join();
+  for (int i = 0; i < 1000; ++i) {
+    char *p = static_cast<char *>(__zalloc(32, 8));
+    ASSERT_NE(p, nullptr);
+    EXPECT_EQ(p[0], 0);
+    EXPECT_EQ(__zfree(p, 32), 0);
+  }
+}
+
+TEST(ZallocTest, Tags) {
+  struct zalloc_tag_stats st;
+  EXPECT_EQ(__zalloc_tag_stats(0, &st), -1);
+  EXPECT_EQ(__zalloc_tag_stats(ZALLOC_MAX_TAGS, &st), -1);
+  EXPECT_EQ(__zalloc_tagged(100, 8, ZALLOC_MAX_TAGS), nullptr);
+  ASSERT_EQ(__zalloc_tag_config(3, "buffers", 0, 0), 0);
+
+  void *small = __zalloc_tagged(100, 8, 3);
+  void *seg = __zalloc_tagged(MB, MB, 3);
+  void *untagged = __zalloc(200, 8);
+  ASSERT_NE(small, nullptr);
+  ASSERT_NE(seg, nullptr);
+  ASSERT_NE(untagged, nullptr);
+  ASSERT_EQ(__zalloc_tag_stats(3, &st), 0);
+  EXPECT_STREQ(st.name, "buffers");
+  EXPECT_EQ(st.current, MB + 100);
+  EXPECT_EQ(st.max, MB + 100);
+  EXPECT_EQ(st.allocs, 2);
+  EXPECT_EQ(__zfree(seg, MB), 0);
+  EXPECT_EQ(__zfree(untagged, 200), 0);
+  ASSERT_EQ(__zalloc_tag_stats(3, &st), 0);
+  EXPECT_EQ(st.current, 100);
+  EXPECT_EQ(st.max, MB + 100);
+
+  // Over the soft limit, allocations only fail if the tag says so.
+  ASSERT_EQ(__zalloc_tag_config(3, nullptr, 1000, 0), 0);
+  void *over = __zalloc_tagged(2000, 8, 3);
+  ASSERT_NE(over, nullptr);
+  EXPECT_EQ(__zfree(over, 2000), 0);
+  ASSERT_EQ(__zalloc_tag_config(3, nullptr, 1000, ZALLOC_TAG_FAIL_OVER_LIMIT),
+            0);
+  errno = 0;
+  EXPECT_EQ(__zalloc_tagged(2000, 8, 3), nullptr);
+  EXPECT_EQ(errno, ENOMEM);
+  ASSERT_EQ(__zalloc_tag_stats(3, &st), 0);
+  EXPECT_STREQ(st.name, "buffers");
+  EXPECT_EQ(st.denied, 1);
+  EXPECT_EQ(st.limit, 1000);
+  EXPECT_EQ(__zfree(small, 100), 0);
+  ASSERT_EQ(__zalloc_tag_stats(3, &st), 0);
+  EXPECT_EQ(st.current, 0);
+  ASSERT_EQ(__zalloc_tag_config(3, nullptr, 0, 0), 0);
+}
+
+TEST(ZallocTest, TagLimitUnderContention) {
+  // Threads racing to allocate under a limit that fails can't get over it
+  // together.
+  const size_t limit = 100 * 64;
+  ASSERT_EQ(__zalloc_tag_config(4, "racing", limit, ZALLOC_TAG_FAIL_OVER_LIMIT),
+            0);
+  std::vector<std::vector<void *>> blocks(8);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([t, &blocks]() {
+      for (int i = 0; i < 100; ++i) {
+        void *p = __zalloc_tagged(64, 8, 4);
+        if (p)
+          blocks[t].push_back(p);
+      }
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+  struct zalloc_tag_stats st;
+  ASSERT_EQ(__zalloc_tag_stats(4, &st), 0);
+  EXPECT_EQ(st.current, limit);
+  EXPECT_EQ(st.max, limit);
+  EXPECT_EQ(st.allocs, 100);
+  EXPECT_EQ(st.denied, 700);
+  for (auto &v : blocks) {
+    for (void *p : v)
+      EXPECT_EQ(__zfree(p, 64), 0);
+  }
+  ASSERT_EQ(__zalloc_tag_stats(4, &st), 0);
+  EXPECT_EQ(st.current, 0);
+  ASSERT_EQ(__zalloc_tag_config(4, nullptr, 0, 0), 0);
+}
+
+TEST(ZallocTest, HeapProfile) {
+  setenv("__MEMORY_PROFILE_RATE", "4096", 1);
+  __update_envar_settings("__MEMORY_PROFILE_RATE");
+  std::vector<void *> blocks;
+  for (int i = 0; i < 64; ++i)
+    blocks.push_back(__zalloc(8 * KB, 8));
+
+  FILE *fp = tmpfile();
+  ASSERT_NE(fp, nullptr);
+  EXPECT_EQ(__zalloc_heap_profile(fileno(fp)), 0);
+  rewind(fp);
+  // Every block crosses a multiple of the rate, so all of them are sampled.
+  size_t total = 0;
+  char line[4096];
+  while (fgets(line, sizeof(line), fp)) {
+    char *bytes = strrchr(line, ' ');
+    ASSERT_NE(bytes, nullptr);
+    total += strtoul(bytes + 1, nullptr, 10);
+  }
+  fclose(fp);
+  EXPECT_GE(total, 64 * 8 * KB);
+
+  for (void *p : blocks)
+    EXPECT_EQ(__zfree(p, 8 * KB), 0);
+  unsetenv("__MEMORY_PROFILE_RATE");
+  __update_envar_settings("__MEMORY_PROFILE_RATE");
+}
+
+TEST(ZallocTest, Find) {
+  static const size_t sizes[] = {24, 8 * KB,     100 * KB,
+                                 MB, 3 * MB + 5, 40 * MB + 8};
+  for (size_t len : sizes) {
+    char *p = (char *)__zalloc(len, 8);
+    ASSERT_NE(p, nullptr);
+    void *base;
+    size_t found;
+    for (size_t off : {(size_t)0, len / 2, len - 1}) {
+      ASSERT_EQ(__zalloc_find(p + off, &base, &found), 0);
+      EXPECT_EQ(base, p);
+      EXPECT_GE(found, len);
+    }
+    EXPECT_EQ(__zfree(p, len), 0);
+  }
+  int local;
+  EXPECT_EQ(__zalloc_find(&local, nullptr, nullptr), -1);
+  EXPECT_EQ(errno, ENOENT);
+}
+
+void CountPressure(const struct zalloc_pressure *info, void *arg) {
+  ((std::atomic<int> *)arg)[info->under_pressure ? 1 : 0]++;
+}
+
+TEST(ZallocTest, PressureCallback) {
+  std::atomic<int> calls[2] = {{0}, {0}};
+  EXPECT_EQ(__zalloc_pressure_unregister(CountPressure, calls), -1);
+  ASSERT_EQ(__zalloc_pressure_register(CountPressure, calls), 0);
+  setenv("__MEMORY_PRESSURE_LIMIT", "1", 1);
+  __update_envar_settings("__MEMORY_PRESSURE_LIMIT");
+  void *p = __zalloc(2 * MB, MB);
+  ASSERT_NE(p, nullptr);
+  for (int i = 0; i < 50 && calls[1] == 0; ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_EQ(calls[1], 1);
+  EXPECT_EQ(__zfree(p, 2 * MB), 0);
+  for (int i = 0; i < 50 && calls[0] == 0; ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_EQ(calls[0], 1);
+  unsetenv("__MEMORY_PRESSURE_LIMIT");
+  __update_envar_settings("__MEMORY_PRESSURE_LIMIT");
+  EXPECT_EQ(__zalloc_pressure_unregister(CountPressure, calls), 0);
+}
+
+void CountWatermark(const struct zalloc_watermark *info, void *arg) {
+  ((int *)arg)[info->growth_rate ? 1 : 0]++;
+}
+
+TEST(ZallocTest, Watermark) {
+  int calls[2] = {0, 0};
+  EXPECT_EQ(__zalloc_watermark_register(2, MB, 0, CountWatermark, calls), -1);
+  EXPECT_EQ(__zalloc_watermark_register(ZALLOC_WATERMARK_64, MB, MB,
+                                        CountWatermark, calls),
+            -1);
+  struct zalloc_stats st;
+  ASSERT_EQ(__zalloc_stats(&st), 0);
+  ASSERT_EQ(__zalloc_watermark_register(ZALLOC_WATERMARK_64,
+                                        st.current64 + 3 * MB, 0,
+                                        CountWatermark, calls),
+            0);
+  ASSERT_EQ(__zalloc_watermark_register(ZALLOC_WATERMARK_64, 0, 4 * MB,
+                                        CountWatermark, calls),
+            0);
+  void *p[4];
+  for (int i = 0; i < 4; ++i) {
+    p[i] = __zalloc(MB, MB);
+    ASSERT_NE(p[i], nullptr);
+    EXPECT_EQ(calls[0], i >= 2 ? 1 : 0);
+  }
+  // 4MB within a second.
+  EXPECT_EQ(calls[1], 1);
+  // The level is reported again after usage has fallen well below it.
+  EXPECT_EQ(__zfree(p[3], MB), 0);
+  EXPECT_EQ(__zfree(p[2], MB), 0);
+  p[2] = __zalloc(MB, MB);
+  ASSERT_NE(p[2], nullptr);
+  EXPECT_EQ(calls[0], 2);
+  for (int i = 0; i < 3; ++i)
+    EXPECT_EQ(__zfree(p[i], MB), 0);
+  EXPECT_EQ(__zalloc_watermark_unregister(CountWatermark, calls), 0);
+  EXPECT_EQ(__zalloc_watermark_unregister(CountWatermark, calls), -1);
+}
+
+TEST(ZallocTest, EventLog) {
+  char fname[] = "/tmp/zalloc-events-XXXXXX";
+  int fd = mkstemp(fname);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  unlink(fname);
+  setenv("__MEMORY_EVENT_LOG_FILE", fname, 1);
+  __update_envar_settings("__MEMORY_EVENT_LOG_FILE");
+  void *p = __zalloc(100 * KB, 8);
+  ASSERT_NE(p, nullptr);
+  EXPECT_EQ(__zfree(p, 100 * KB), 0);
+  unsetenv("__MEMORY_EVENT_LOG_FILE");
+  __update_envar_settings("__MEMORY_EVENT_LOG_FILE");
+
+  FILE *fp = fopen(fname, "rb");
+  ASSERT_NE(fp, nullptr);
+  struct zoslib_memlog_header h;
+  ASSERT_EQ(fread(&h, sizeof(h), 1, fp), 1u);
+  EXPECT_EQ(h.byte_order, ZOSLIB_MEMLOG_BYTE_ORDER);
+  EXPECT_EQ(h.version, (uint32_t)ZOSLIB_MEMLOG_VERSION);
+  EXPECT_EQ(h.pid, getpid());
+  struct zoslib_memlog_event ev;
+  bool allocated = false, freed = false;
+  while (fread(&ev, sizeof(ev), 1, fp) == 1) {
+    if (ev.addr != (uintptr_t)p || ev.size != 100 * KB)
+      continue;
+    if (ev.op == ZOSLIB_MEMLOG_ALLOC)
+      allocated = true;
+    else if (ev.op == ZOSLIB_MEMLOG_FREE)
+      freed = allocated;
+  }
+  fclose(fp);
+  unlink(fname);
+  EXPECT_TRUE(allocated);
+  EXPECT_TRUE(freed);
+}
+
+TEST(ZallocTest, Sampler) {
+  char fname[] = "/tmp/zalloc-samples-XXXXXX";
+  int fd = mkstemp(fname);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  setenv("__MEMORY_SAMPLE_INTERVAL", "10", 1);
+  setenv("__MEMORY_SAMPLE_FILE", fname, 1);
+  __update_envar_settings("__MEMORY_SAMPLE_FILE");
+  void *p = __zalloc(MB, MB);
+  ASSERT_NE(p, nullptr);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_EQ(__zfree(p, MB), 0);
+  unsetenv("__MEMORY_SAMPLE_FILE");
+  unsetenv("__MEMORY_SAMPLE_INTERVAL");
+  __update_envar_settings("__MEMORY_SAMPLE_FILE");
+
+  FILE *fp = fopen(fname, "r");
+  ASSERT_NE(fp, nullptr);
+  char line[256];
+  ASSERT_NE(fgets(line, sizeof(line), fp), nullptr);
+  EXPECT_EQ(strncmp(line, "time_ms,pid,current31,", 22), 0);
+  int samples = 0;
+  size_t max64 = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    unsigned long long t;
+    int pid;
+    size_t cur31, max31, cur64;
+    ASSERT_EQ(sscanf(line, "%llu,%d,%zu,%zu,%zu,%zu", &t, &pid, &cur31,
+                     &max31, &cur64, &max64),
+              6);
+    EXPECT_EQ(pid, getpid());
+    ++samples;
+  }
+  EXPECT_GE(samples, 2);
+  EXPECT_GE(max64, MB);
+  fclose(fp);
+  unlink(fname);
+}
+
+TEST(ZallocTest, Arena) {
+  struct zalloc_stats before, during, after;
+  ASSERT_EQ(__zalloc_stats(&before), 0);
+  __zarena_t *arena = __zarena_create(64 * KB);
+  ASSERT_NE(arena, nullptr);
+  for (int round = 0; round < 2; ++round) {
+    for (int i = 0; i < 1000; ++i) {
+      size_t len = i % 500 + 1;
+      char *p = (char *)__zarena_alloc(arena, len, 64);
+      ASSERT_NE(p, nullptr);
+      EXPECT_EQ((size_t)p % 64, 0u);
+      // Blocks are zeroed, also after a reset.
+      EXPECT_EQ(p[0], 0);
+      EXPECT_EQ(p[len - 1], 0);
+      memset(p, 0xff, len);
+    }
+    char *big = (char *)__zarena_alloc(arena, 2 * MB, 8);
+    ASSERT_NE(big, nullptr);
+    memset(big, 0xff, 2 * MB);
+    ASSERT_EQ(__zalloc_stats(&during), 0);
+    EXPECT_EQ(during.arenas, before.arenas + 1);
+    EXPECT_EQ(during.arena_allocs, before.arena_allocs + 1001);
+    EXPECT_GE(during.arena_bytes, before.arena_bytes + 2 * MB + 250 * KB);
+    __zarena_reset(arena);
+    ASSERT_EQ(__zalloc_stats(&during), 0);
+    EXPECT_EQ(during.arena_allocs, before.arena_allocs);
+    EXPECT_EQ(during.arena_bytes, before.arena_bytes + 64 * KB);
+  }
+  __zarena_destroy(arena);
+  ASSERT_EQ(__zalloc_stats(&after), 0);
+  EXPECT_EQ(after.arenas, before.arenas);
+  EXPECT_EQ(after.arena_bytes, before.arena_bytes);
+}
+
+TEST(ZallocTest, MultiThreaded) {
+  // A slab block, a __malloc31 block and a segment; each slot of a thread
+  // always holds the same size.
+  static const size_t sizes[] = {64, 4 * KB, 40 * KB, 2 * MB};
+  static const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+  struct zalloc_stats before, after;
+  ASSERT_EQ(__zalloc_stats(&before), 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([t]() {
+      const char mark = (char)(t + 1);
+      char *live[16] = {};
+      for (int i = 0; i < 1000; ++i) {
+        int slot = i % 16;
+        size_t size = sizes[slot % nsizes];
+        if (live[slot]) {
+          // No other thread got the block while this one had it.
+          EXPECT_EQ(live[slot][0], mark);
+          EXPECT_EQ(live[slot][size - 1], mark);
+          EXPECT_EQ(__zfree(live[slot], size), 0);
+        }
+        char *p = static_cast<char *>(__zalloc(size, 8));
+        live[slot] = p;
+        ASSERT_NE(p, nullptr);
+        EXPECT_EQ(p[0], 0);
+        EXPECT_EQ(p[size - 1], 0);
+        p[0] = p[size - 1] = mark;
+      }
+      for (int slot = 0; slot < 16; ++slot) {
+        if (live[slot]) {
+          EXPECT_EQ(__zfree(live[slot], sizes[slot % nsizes]), 0);
+        }
+      }
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+  ASSERT_EQ(__zalloc_stats(&after), 0);
+  EXPECT_EQ(after.allocs31 - before.allocs31, after.frees31 - before.frees31);
+  EXPECT_EQ(after.allocs64 - before.allocs64, after.frees64 - before.frees64);
+  EXPECT_EQ(after.live31, before.live31);
+  EXPECT_EQ(after.live64, before.live64);
+  EXPECT_EQ(after.current31, before.current31);
+  EXPECT_EQ(after.current64, before.current64);
+}
+
+// Allocates a block from __malloc31 and frees it, which goes through the
+// header in front of the block, and checks the usage below the bar.
+// Sets *freed to the address of the block allocated and released.
+void CheckMalloc31Free(void **freed) {
+  struct zalloc_stats before, during, after;
+  ASSERT_EQ(__zalloc_stats(&before), 0);
+  // 40KB is too big for the slabs.
+  void *p = __zalloc(40 * KB, 8);
+  ASSERT_NE(p, nullptr);
+  ASSERT_EQ(__zalloc_stats(&during), 0);
+  EXPECT_EQ(during.live31, before.live31 + 1);
+  EXPECT_EQ(during.current31, before.current31 + 40 * KB);
+  EXPECT_EQ(__zfree(p, 40 * KB), 0);
+  ASSERT_EQ(__zalloc_stats(&after), 0);
+  EXPECT_EQ(after.live31, before.live31);
+  EXPECT_EQ(after.current31, before.current31);
+  *freed = p;
+}
+
+TEST(ZallocTest, Malloc31Free) {
+  void *p = nullptr;
+  CheckMalloc31Free(&p);
+
+  // With every message logged, the block is also entered in the registry,
+  // and must be found there when it's freed, or a warning is logged.
+  char fname[] = "/tmp/zalloc-usage-XXXXXX";
+  int fd = mkstemp(fname);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  setenv("__MEMORY_USAGE_LOG_FILE", fname, 1);
+  setenv("__MEMORY_USAGE_LOG_LEVEL", "2", 1);
+  __update_envar_settings("__MEMORY_USAGE_LOG_FILE");
+  __update_envar_settings("__MEMORY_USAGE_LOG_LEVEL");
+  EXPECT_TRUE(__doLogMemoryAll());
+  CheckMalloc31Free(&p);
+  __memprintf_flush();
+  unsetenv("__MEMORY_USAGE_LOG_LEVEL");
+  unsetenv("__MEMORY_USAGE_LOG_FILE");
+  __update_envar_settings("__MEMORY_USAGE_LOG_LEVEL");
+  __update_envar_settings("__MEMORY_USAGE_LOG_FILE");
+  EXPECT_FALSE(__doLogMemoryWarning());
+  EXPECT_FALSE(__doLogMemoryUsage());
+
+  char addr[32];
+  snprintf(addr, sizeof(addr), "addr=%p,", p);
+  FILE *fp = fopen(fname, "r");
+  ASSERT_NE(fp, nullptr);
+  char line[256];
+  bool freed = false;
+  while (fgets(line, sizeof(line), fp)) {
+    EXPECT_EQ(strstr(line, "WARNING"), nullptr) << line;
+    if (strstr(line, addr) && strstr(line, "free31 OK"))
+      freed = true;
+  }
+  fclose(fp);
+  EXPECT_TRUE(freed);
+  unlink(fname);
+}
+
+// Sets __MEMORY_LARGE_FRAMES, or unsets it if frames is nullptr.
+void SetLargeFrames(const char *frames) {
+  const char *envar = "__MEMORY_LARGE_FRAMES";
+  if (frames)
+    setenv(envar, frames, 1);
+  else
+    unsetenv(envar);
+  __update_envar_settings(envar);
+}
+
+TEST(ZallocTest, LargeFrames) {
+  const char *saved = getenv("__MEMORY_LARGE_FRAMES");
+  std::string restore = saved ? saved : "";
+  // Segments are backed by large frames if the system has them configured,
+  // or else by the default frames; 2G frames back only multiples of 2GB, so
+  // these fall back to 1M frames. 20MB is too big to be pooled.
+  const size_t size = 20 * MB;
+  for (const char *frames : {"1M", "2G"}) {
+    SetLargeFrames(frames);
+    struct zalloc_stats before, after;
+    ASSERT_EQ(__zalloc_stats(&before), 0);
+    for (int i = 0; i < 2; ++i) {
+      char *p = static_cast<char *>(__zalloc(size, MB));
+      ASSERT_NE(p, nullptr) << frames;
+      EXPECT_EQ(reinterpret_cast<size_t>(p) % MB, 0);
+      for (size_t off = 0; off < size; off += 4 * KB) {
+        ASSERT_EQ(p[off], 0) << frames;
+        p[off] = 1;
+      }
+      EXPECT_EQ(__zfree(p, size), 0);
+    }
+    ASSERT_EQ(__zalloc_stats(&after), 0);
+    EXPECT_EQ(after.live64, before.live64);
+    EXPECT_EQ(after.current64, before.current64);
+  }
+  SetLargeFrames(saved ? restore.c_str() : nullptr);
+}
+
+} // namespace